@@ -63,6 +63,49 @@ void instanceconfigframeheader(instance_data_t *inst)
 #endif
 }
 
+#if (SHORT_ADDR_RANGING == 1)
+// -------------------------------------------------------------------------------------------------------------------
+//
+// function to construct the header bytes of the ranging messages using the 16-bit addresses negotiated in the ranging init
+//
+// -------------------------------------------------------------------------------------------------------------------
+//
+void instanceconfigshortframeheader(instance_data_t *inst)
+{
+    inst->msg_f.panID[0] = (inst->panid) & 0xff;
+    inst->msg_f.panID[1] = inst->panid >> 8;
+
+    inst->msg_f.frameCtrl[0] = 0x1 /*frame type 0x1 == data*/ | 0x40 /*PID comp*/;
+    inst->msg_f.frameCtrl[1] = 0x8 /*dest short address (16bits)*/ | 0x80 /*src short address (16bits)*/;
+}
+#endif
+
+
+#if (BROADCAST_POLL == 1)
+// -------------------------------------------------------------------------------------------------------------------
+//
+// function to construct the broadcast poll/final message header bytes (destination is the broadcast address 0xFFFF)
+//
+// -------------------------------------------------------------------------------------------------------------------
+//
+void instanceconfigbcframeheader(instance_data_t *inst)
+{
+    inst->bcmsg.panID[0] = (inst->panid) & 0xff;
+    inst->bcmsg.panID[1] = inst->panid >> 8;
+
+    inst->bcmsg.frameCtrl[0] = 0x1 /*frame type 0x1 == data*/ | 0x40 /*PID comp*/;
+    inst->bcmsg.destAddr[0] = 0xff;
+    inst->bcmsg.destAddr[1] = 0xff;
+#if (USING_64BIT_ADDR==1)
+    inst->bcmsg.frameCtrl[1] = 0x8 /*dest short address (16bits)*/ | 0xC0 /*src extended address (64bits)*/;
+    memcpy(&inst->bcmsg.sourceAddr[0], inst->eui64, ADDR_BYTE_SIZE_L);
+#else
+    inst->bcmsg.frameCtrl[1] = 0x8 /*dest short address (16bits)*/ | 0x80 /*src short address (16bits)*/;
+    inst->bcmsg.sourceAddr[0] = inst->tagShortAdd & 0xFF;
+    inst->bcmsg.sourceAddr[1] = (inst->tagShortAdd >> 8) & 0xFF;
+#endif
+}
+#endif
 
 // -------------------------------------------------------------------------------------------------------------------
 //
@@ -75,6 +118,11 @@ void setupmacframedata(instance_data_t *inst, int fcode)
     inst->msg.messageData[FCODE] = fcode; //message function code (specifies if message is a poll, response or other...)
 
 	instanceconfigframeheader(inst);
+#if (SHORT_ADDR_RANGING == 1)
+    inst->msg_f.messageData[FCODE] = fcode;
+
+    instanceconfigshortframeheader(inst);
+#endif
 }
 
 // -------------------------------------------------------------------------------------------------------------------
@@ -191,7 +239,21 @@ int testapprun_s(instance_data_t *inst, int message)
                 	memcpy(&inst->msg.sourceAddr[0], inst->eui64, ADDR_BYTE_SIZE_L);
 					//set source address into the message structure
 					memcpy(&inst->rng_initmsg.sourceAddr[0], inst->eui64, ADDR_BYTE_SIZE_L);
+#if (SHORT_ADDR_RANGING == 1)
+                    {
+                    	//short address used by the Tags which accept 16-bit addresses in the ranging init
+                    	uint16 addr = inst->eui64[0] + (inst->eui64[1] << 8);
+                        dwt_setaddress16(addr);
+						memcpy(&inst->msg_f.sourceAddr[0], inst->eui64, ADDR_BYTE_SIZE_S);
+                    }
 #endif
+#endif
+
+                    //start of the superframe the Tags' slots refer to
+                    inst->sfStartTime = portGetTickCount();
+                    inst->sfIndex = 0;
+                    inst->sfRangeCount = 0;
+                    inst->sfRangeCountLast = 0;
 
                     // First time anchor listens we don't do a delayed RX
 					dwt_setrxaftertxdelay(0);
@@ -233,6 +295,11 @@ int testapprun_s(instance_data_t *inst, int message)
 
             inst->done = INST_NOT_DONE_YET;
             inst->instToSleep = 0;
+            inst->burstCount = 0; //new burst
+            inst->burstTofNum = 0;
+#if (BROADCAST_POLL == 1)
+            inst->anchTofMask = 0;
+#endif
             inst->testAppState = inst->nextState;
             inst->nextState = 0; //clear
             inst->instancetimer_saved = inst->instancetimer = portGetTickCount(); //set timer base
@@ -240,11 +307,12 @@ int testapprun_s(instance_data_t *inst, int message)
             if (inst->sleep_en)
             {
             	uint32 x = 0;
+            	uint8 devid[4];
                 //wake up device from low power mode
                 //NOTE - in the ARM  code just drop chip select for 200us
             	//led_on(LED_PC9);
                 port_SPIx_clear_chip_select();  //CS low
-                instance_data[0].dwIDLE = 0; //reset
+                instance_data[INST_CURRENT].dwIDLE = 0; //reset
 
                 setup_DW1000RSTnIRQ(1); //enable RSTn IRQ
 
@@ -253,22 +321,26 @@ int testapprun_s(instance_data_t *inst, int message)
 
                 //need to poll to check when the DW1000 is in IDLE, the CPLL interrupt is not reliable
                 //when RSTn goes high the DW1000 is in INIT, it will enter IDLE after PLL lock (in 5 us)
-                while(instance_data[0].dwIDLE == 0) // this variable will be sent in the IRQ (process_dwRSTn_irq)
+                while(instance_data[INST_CURRENT].dwIDLE == 0) // this variable will be sent in the IRQ (process_dwRSTn_irq)
                 {
                 	 //wait for DW1000 to go to IDLE state RSTn pin to go high
                 	x++;
                 }
                 setup_DW1000RSTnIRQ(0); //disable RSTn IRQ
                 port_SPIx_set_chip_select();  //CS high
+                port_SPIx_clockstate(DW_CLK_PLL); //in IDLE
+
+                dwt_invalidateshadow(); //the registers not restored from the AON are back to their reset values
+
+                instspicostbegin(inst);
+                dwt_batchbegin(); //the re-initialisation is issued in one pass
 
                 //!!! NOTE it takes ~35us for the DW1000 to download AON and lock the PLL and be in IDLE state
                 //do some dummy reads of the dev ID register to make sure DW1000 is in IDLE before setting LEDs
-            	x = dwt_readdevid(); //dummy read... need to wait for 5 us to exit INIT state (5 SPI bytes @ ~18 MHz)
-            	x = dwt_readdevid(); //dummy read... need to wait for 5 us to exit INIT state (5 SPI bytes @ ~18 MHz)
-            	x = dwt_readdevid(); //dummy read... need to wait for 5 us to exit INIT state (5 SPI bytes @ ~18 MHz)
-            	x = dwt_readdevid(); //dummy read... need to wait for 5 us to exit INIT state (5 SPI bytes @ ~18 MHz)
-
-            	x = dwt_readdevid(); //dummy read... need to wait for 5 us to exit INIT state (5 SPI bytes @ ~18 MHz)
+                for(x = 0; x < 5; x++)
+                {
+                	dwt_batchread(DEV_ID_ID, 0, 4, devid); //dummy read... need to wait for 5 us to exit INIT state (5 SPI bytes @ ~18 MHz)
+                }
 
                 /*if(x != DWT_DEVICE_ID)
                 {
@@ -285,6 +357,9 @@ int testapprun_s(instance_data_t *inst, int message)
                 //set EUI as it will not be preserved unless the EUI is programmed and loaded from NVM
                 dwt_entersleepaftertx(0);
                 dwt_setinterrupt(DWT_INT_TFRS, 1); //re-enable the TX/RX interrupts
+
+                dwt_batchend();
+                instspicostend(inst, &inst->wakeSpiCost);
             }
 #endif
 
@@ -300,6 +375,8 @@ int testapprun_s(instance_data_t *inst, int message)
                     && (inst->instToSleep)  //go to sleep before sending the next poll
                     )
             {
+                int reported = 0;
+
                 //the app should put chip into low power state and wake up in tagSleepTime_ms time...
                 //the app could go to *_IDLE state and wait for uP to wake it up...
                 inst->done = INST_DONE_WAIT_FOR_NEXT_EVENT_TO; //don't sleep here but kick off the TagTimeoutTimer (instancetimer)
@@ -315,13 +392,42 @@ int testapprun_s(instance_data_t *inst, int message)
                 {
                     //put device into low power mode
                     dwt_entersleep(); //go to sleep
+                    port_SPIx_clockstate(DW_CLK_SLEEP);
                 }
 #endif
 				//DW1000 gone to sleep - report the received range
-				if(inst->tof > 0) //if ToF == 0 - then no new range to report
+#if (BROADCAST_POLL == 1)
+				if(inst->anchTofMask) //report the range with each anchor that responded
+				{
+					instreportbctof(inst);
+					inst->newrange = 1;
+					reported = 1;
+				}
+#else
+				if(inst->burstTofNum > 1) //report the median range of the burst
+				{
+					inst->tof = instburstmediantof(inst);
+					reportTOF(inst);
+					inst->newrange = 1;
+					reported = 1;
+				}
+				else if(inst->tof > 0) //if ToF == 0 - then no new range to report
 				{
 					reportTOF(inst);
 					inst->newrange = 1;
+					reported = 1;
+				}
+#endif
+
+				if(reported && (inst->ttfr_ms < 0)) //first range since power up
+				{
+					inst->ttfr_ms = portGetTickCount() - inst->ttfrStart;
+				}
+
+				//set the time to the next wake-up from the ranges (not on the sleep to our first slot after the ranging init)
+				if((inst->mode == TAG) && (inst->burstCount > 0))
+				{
+					instadapttagrate(inst, reported);
 				}
 				//inst->deviceissleeping = 1; //this is to stop polling device status register (as it will wake it up)
 
@@ -337,6 +443,12 @@ int testapprun_s(instance_data_t *inst, int message)
             {
 				int flength = (BLINK_FRAME_CRTL_AND_ADDRESS + FRAME_CRC);
 
+                if((inst->ttfr_ms < 0) && (inst->ttfrStart == 0))
+                {
+                	inst->ttfrStart = portGetTickCount(); //first blink - start of the time to first range
+                }
+                inst->blinkAttempts++;
+
                 //blink frames with IEEE EUI-64 tag ID
                 inst->blinkmsg.frameCtrl = 0xC5 ;
                 inst->blinkmsg.seqNum = inst->frame_sn++;
@@ -365,6 +477,7 @@ int testapprun_s(instance_data_t *inst, int message)
         case TA_TXRANGINGINIT_WAIT_SEND :
                 {
                 uint16 resp_dly_us, resp_dly;
+                uint16 sf_phase;
 
 				inst->psduLength = RANGINGINIT_MSG_LEN;
 
@@ -374,18 +487,32 @@ int testapprun_s(instance_data_t *inst, int message)
                 inst->rng_initmsg.messageData[RNG_INIT_TAG_SHORT_ADDR_HI] = (inst->tagShortAdd >> 8) & 0xFF;
 
                 // First response delay to send is anchor's response delay.
-                resp_dly_us = ANC_TURN_AROUND_TIME_US + inst->fl_us[POLL];
+                resp_dly_us = inst->ancTurnAround_us + inst->fl_us[POLL];
                 resp_dly = ((RESP_DLY_UNIT_US << RESP_DLY_UNIT_SHIFT) & RESP_DLY_UNIT_MASK)
                            + ((resp_dly_us << RESP_DLY_VAL_SHIFT) & RESP_DLY_VAL_MASK);
                 inst->rng_initmsg.messageData[RNG_INIT_ANC_RESP_DLY_LO] = resp_dly & 0xFF;
                 inst->rng_initmsg.messageData[RNG_INIT_ANC_RESP_DLY_HI] = (resp_dly >> 8) & 0xFF;
                 // Second response delay to send is tag's response delay.
-                resp_dly_us = TAG_TURN_AROUND_TIME_US + inst->fl_us[RESP];
+                resp_dly_us = inst->tagTurnAround_us + inst->fl_us[RESP];
                 resp_dly = ((RESP_DLY_UNIT_US << RESP_DLY_UNIT_SHIFT) & RESP_DLY_UNIT_MASK)
                            + ((resp_dly_us << RESP_DLY_VAL_SHIFT) & RESP_DLY_VAL_MASK);
                 inst->rng_initmsg.messageData[RNG_INIT_TAG_RESP_DLY_LO] = resp_dly & 0xFF;
                 inst->rng_initmsg.messageData[RNG_INIT_TAG_RESP_DLY_HI] = (resp_dly >> 8) & 0xFF;
 
+                // Tag's slot in the superframe, and superframe phase when this message will be sent
+                sf_phase = (instgetsfphase(inst) + RNG_INIT_REPLY_DLY_MS) % inst->sfPeriod_ms;
+                inst->rng_initmsg.messageData[RNG_INIT_SLOT_NUM] = inst->tagToRangeWith;
+                inst->rng_initmsg.messageData[RNG_INIT_SLOT_DUR_LO] = inst->slotDuration_ms & 0xFF;
+                inst->rng_initmsg.messageData[RNG_INIT_SLOT_DUR_HI] = (inst->slotDuration_ms >> 8) & 0xFF;
+                inst->rng_initmsg.messageData[RNG_INIT_SF_PERIOD_LO] = inst->sfPeriod_ms & 0xFF;
+                inst->rng_initmsg.messageData[RNG_INIT_SF_PERIOD_HI] = (inst->sfPeriod_ms >> 8) & 0xFF;
+                inst->rng_initmsg.messageData[RNG_INIT_SF_PHASE_LO] = sf_phase & 0xFF;
+                inst->rng_initmsg.messageData[RNG_INIT_SF_PHASE_HI] = (sf_phase >> 8) & 0xFF;
+                // offer 16-bit addresses for the rest of the session
+                inst->rng_initmsg.messageData[RNG_INIT_OPTIONS] = inst->shortAddrRanging ? RNG_INIT_OPT_SHORT_ADDR : 0;
+                // channel/preamble code partition of the Tag's slot
+                inst->rng_initmsg.messageData[RNG_INIT_OPTIONS] |= (instslotpartition(inst->tagToRangeWith) << RNG_INIT_OPT_PART_SHIFT) & RNG_INIT_OPT_PART_MASK;
+
 				inst->rng_initmsg.frameCtrl[0] = 0x41; //
 
 #if (USING_64BIT_ADDR == 1)
@@ -405,6 +532,12 @@ int testapprun_s(instance_data_t *inst, int message)
                 inst->testAppState = TA_TX_WAIT_CONF;                                               // wait confirmation
                 inst->previousState = TA_TXRANGINGINIT_WAIT_SEND ;
 
+                if(inst->dblBuffOn) //the receiver is still on (re-enabled after the blink) - turn it off before the TX
+                {
+                	dwt_forcetrxoff();
+                	inst->rxOn = 0;
+                }
+
 				dwt_writetxdata(inst->psduLength, (uint8 *)  &inst->rng_initmsg, 0) ;	// write the frame data
 
 				//anchor - we don't use timeout, if the ACK is missed we'll get a Poll or Blink
@@ -416,9 +549,11 @@ int testapprun_s(instance_data_t *inst, int message)
 					inst->wait4ack = 0; //clear the flag as the TX has failed the TRX is off
 			        inst->lateTX++;
 
+			        instadmitqueue(inst, &inst->rng_initmsg.destAddr[0]); //answer this Tag first on its next blink
                 }
                 else
                 {
+                	instadmitdone(inst, &inst->rng_initmsg.destAddr[0]);
                     inst->testAppState = TA_TX_WAIT_CONF ;                                               // wait confirmation
                     inst->previousState = TA_TXRANGINGINIT_WAIT_SEND ;
                     inst->done = INST_DONE_WAIT_FOR_NEXT_EVENT;  //no timeout
@@ -449,27 +584,61 @@ int testapprun_s(instance_data_t *inst, int message)
             {
 
                 //NOTE the anchor address is set after receiving the ranging initialisation message
-				inst->instToSleep = 1; //go to Sleep after this poll
-
+				inst->burstCount++;
+				inst->instToSleep = (inst->burstCount >= TAG_BURST_POLLS); //go to Sleep after the last poll of the burst
+
+#if (BROADCAST_POLL == 1)
+				//one poll to all the anchors, they respond one after the other in their response slot
+				inst->bcmsg.seqNum = inst->frame_sn++;
+				inst->bcmsg.messageData[FCODE] = RTLS_DEMO_MSG_TAG_POLLB;
+				inst->respRxMask = 0;
+#if (USING_64BIT_ADDR==1)
+				inst->psduLength = TAG_POLL_MSG_LEN + FRAME_CRTL_AND_ADDRESS_LS + FRAME_CRC;
+#else
+				inst->psduLength = TAG_POLL_MSG_LEN + FRAME_CRTL_AND_ADDRESS_S + FRAME_CRC;
+#endif
+#else
 				inst->msg.seqNum = inst->frame_sn++;
+#if (SS_TWR == 1)
+				setupmacframedata(inst, RTLS_DEMO_MSG_TAG_POLLSS); //the anchor's response will complete the ranging exchange
+#else
 				setupmacframedata(inst, RTLS_DEMO_MSG_TAG_POLL);
+#endif
 #if (USING_64BIT_ADDR==1)
 
 				inst->psduLength = TAG_POLL_MSG_LEN + FRAME_CRTL_AND_ADDRESS_L + FRAME_CRC;
 #else
 				inst->psduLength = TAG_POLL_MSG_LEN + FRAME_CRTL_AND_ADDRESS_S + FRAME_CRC;
+#endif
+#if (SHORT_ADDR_RANGING == 1)
+				if(inst->shortAddrRanging)
+				{
+					inst->msg_f.seqNum = inst->msg.seqNum;
+					inst->psduLength = TAG_POLL_MSG_LEN + FRAME_CRTL_AND_ADDRESS_S + FRAME_CRC;
+				}
+#endif
 #endif
 				//set the delayed rx on time (the response message will be sent after this delay)
                 dwt_setrxaftertxdelay(inst->txToRxDelayTag_sy);
                 dwt_setrxtimeout((uint16)inst->fwtoTime_sy);
 
-				dwt_writetxdata(inst->psduLength, (uint8 *)  &inst->msg, 0) ;	// write the frame data
+#if (BROADCAST_POLL == 1)
+				dwt_writetxdata(inst->psduLength, (uint8 *)  &inst->bcmsg, 0) ;	// write the frame data
+#else
+				dwt_writetxdata(inst->psduLength, RNG_MSG(inst), 0) ;	// write the frame data
+#endif
 
 				//response is expected
 				inst->wait4ack = DWT_RESPONSE_EXPECTED;
 
-				dwt_writetxfctrl(inst->psduLength, 0);
-				dwt_starttx(DWT_START_TX_IMMEDIATE | inst->wait4ack);
+				//the next poll of a burst is sent a fixed gap after the previous exchange (if that time has passed,
+				//e.g. the previous exchange timed out, the poll is sent now)
+				if((inst->burstCount == 1)
+					|| instancesendpacket(inst->psduLength, DWT_START_TX_DELAYED | inst->wait4ack, (inst->burstRefTime + inst->burstGap) >> 8))
+				{
+					dwt_writetxfctrl(inst->psduLength, 0);
+					dwt_starttx(DWT_START_TX_IMMEDIATE | inst->wait4ack);
+				}
 
                 inst->testAppState = TA_TX_WAIT_CONF ;                                               // wait confirmation
                 inst->previousState = TA_TXPOLL_WAIT_SEND ;
@@ -488,9 +657,26 @@ int testapprun_s(instance_data_t *inst, int message)
 
         case TA_TXFINAL_WAIT_SEND :
             {
+#if (BROADCAST_POLL == 1)
+            	int i;
+
+                // Embbed into Final message: 40-bit respRxTime of each anchor and the mask of the responses received
+				for(i = 0; i < ANCHOR_LIST_SIZE; i++)
+				{
+					memcpy(&(inst->bcmsg.messageData[RRXT_B + (5 * i)]), (uint8 *)&inst->anchRespRxTime[i], 5);
+				}
+				inst->bcmsg.messageData[RMSK_B] = inst->respRxMask;
+
+				inst->bcmsg.messageData[FCODE] = RTLS_DEMO_MSG_TAG_FINALB;
+#if (USING_64BIT_ADDR==1)
+				inst->psduLength = TAG_FINALB_MSG_LEN + FRAME_CRTL_AND_ADDRESS_LS + FRAME_CRC;
+#else
+				inst->psduLength = TAG_FINALB_MSG_LEN + FRAME_CRTL_AND_ADDRESS_S + FRAME_CRC;
+#endif
+#else
                 // Embbed into Final message:40-bit respRxTime
                 // Write Response RX time field of Final message
-				memcpy(&(inst->msg.messageData[RRXT]), (uint8 *)&inst->anchorRespRxTime, 5);
+				memcpy(&(RNG_MSG_DATA(inst)[RRXT]), (uint8 *)&inst->anchorRespRxTime, 5);
 
 				setupmacframedata(inst, RTLS_DEMO_MSG_TAG_FINAL);
 #if (USING_64BIT_ADDR==1)
@@ -498,6 +684,13 @@ int testapprun_s(instance_data_t *inst, int message)
 #else
 				inst->psduLength = TAG_FINAL_MSG_LEN + FRAME_CRTL_AND_ADDRESS_S + FRAME_CRC;
 #endif
+#if (SHORT_ADDR_RANGING == 1)
+				if(inst->shortAddrRanging)
+				{
+					inst->psduLength = TAG_FINAL_MSG_LEN + FRAME_CRTL_AND_ADDRESS_S + FRAME_CRC;
+				}
+#endif
+#endif
 
 #if 0
 #if (DEEP_SLEEP == 1)
@@ -509,7 +702,18 @@ int testapprun_s(instance_data_t *inst, int message)
 #endif
 #endif
 
-				dwt_writetxdata(inst->psduLength, (uint8 *)  &inst->msg, 0) ;	// write the frame data
+#if (BROADCAST_POLL == 1)
+				dwt_writetxdata(inst->psduLength, (uint8 *)  &inst->bcmsg, 0) ;	// write the frame data
+#else
+				dwt_writetxdata(inst->psduLength, RNG_MSG(inst), 0) ;	// write the frame data
+#endif
+
+#if (TURNAROUND_CALIB == 1)
+                if(inst->turnCalibCount < TURNAROUND_CALIB_SAMPLES)
+                {
+                	instturnaroundcalib(inst, (uint32)(inst->anchorRespRxTime >> 8));
+                }
+#endif
 
                 if(instancesendpacket(inst->psduLength, DWT_START_TX_DELAYED, inst->delayedReplyTime))
                 {
@@ -525,6 +729,9 @@ int testapprun_s(instance_data_t *inst, int message)
 #endif
 					inst->wait4ack = 0; //clear the flag as the TX has failed the TRX is off
 			        inst->lateTX++;
+#if (TURNAROUND_CALIB == 1)
+			        instturnaroundlate(inst);
+#endif
 
                     break; //exit this switch case...
                 }
@@ -567,6 +774,10 @@ int testapprun_s(instance_data_t *inst, int message)
                 //thus the reception of the ACK will be processed before the TX confirmation of the frame that requested it.
 				if(dw_event->type != DWT_SIG_TX_DONE) //wait for TX done confirmation
                 {
+					if((dw_event->type == SIG_RX_BLINK) && (inst->mode == ANCHOR)) //a blink received before the TX - answer it later
+					{
+						instadmitqueue(inst, &(dw_event->msgu.rxblinkmsg.tagID[0]));
+					}
 					if(dw_event->type == DWT_SIG_RX_TIMEOUT) //got RX timeout - i.e. did not get the response (e.g. ACK)
 					{
 						//printf("RX timeout in TA_TX_WAIT_CONF (%d)\n", inst->previousState);
@@ -583,6 +794,7 @@ int testapprun_s(instance_data_t *inst, int message)
 
                 if(inst->previousState == TA_TXFINAL_WAIT_SEND)
                 {
+                    inst->burstRefTime = dw_event->timeStamp; //the next poll of the burst is timed from the final
                     inst->testAppState = TA_TXE_WAIT ;
                     inst->nextState = TA_TXPOLL_WAIT_SEND ;
                     break;
@@ -614,10 +826,17 @@ int testapprun_s(instance_data_t *inst, int message)
 		                tagCalculatedFinalTxTime = tagCalculatedFinalTxTime + inst->txantennaDelay;
 		                tagCalculatedFinalTxTime &= MASK_40BIT;
 
+#if (BROADCAST_POLL == 1)
+		                // Write Calculated TX time field of Final message
+						memcpy(&(inst->bcmsg.messageData[FTXT_B]), (uint8 *)&tagCalculatedFinalTxTime, 5);
+		                // Write Poll TX time field of Final message
+						memcpy(&(inst->bcmsg.messageData[PTXT_B]), (uint8 *)&inst->txu.tagPollTxTime, 5);
+#else
 		                // Write Calculated TX time field of Final message
-						memcpy(&(inst->msg.messageData[FTXT]), (uint8 *)&tagCalculatedFinalTxTime, 5);
+						memcpy(&(RNG_MSG_DATA(inst)[FTXT]), (uint8 *)&tagCalculatedFinalTxTime, 5);
 		                // Write Poll TX time field of Final message
-						memcpy(&(inst->msg.messageData[PTXT]), (uint8 *)&inst->txu.tagPollTxTime, 5);
+						memcpy(&(RNG_MSG_DATA(inst)[PTXT]), (uint8 *)&inst->txu.tagPollTxTime, 5);
+#endif
 					}
 
                     inst->testAppState = TA_RXE_WAIT ;                      // After sending, tag expects response/report, anchor waits to receive a final/new poll
@@ -631,12 +850,13 @@ int testapprun_s(instance_data_t *inst, int message)
 
 
         case TA_RXE_WAIT :
-    		memcpy(&dataseq[0], (const uint8 *) "RXW", 16);
-    		LCD_GLASS_DisplayString(dataseq);
-    		Sleep(200);
         {
 
-            if(inst->wait4ack == 0) //if this is set the RX will turn on automatically after TX
+            if(inst->rxOn) //double buffer mode - the receiver has been re-enabled by the IC after the last frame
+            {
+            	inst->wait4ack = 0 ;
+            }
+            else if(inst->wait4ack == 0) //if this is set the RX will turn on automatically after TX
             {
                 //turn RX on
 				instancerxon(inst, 0, 0) ;   // turn RX on, with/without delay
@@ -670,38 +890,49 @@ int testapprun_s(instance_data_t *inst, int message)
                     //printf("we got blink message from %08X\n", ( tagaddr& 0xFFFF));
                     if((inst->mode == LISTENER) || (inst->mode == ANCHOR))
                     {
+						int slot;
+
 						inst->canprintinfo = 1;
 
-						//add this Tag to the list of Tags we know about if the BP is on
+						//add this Tag to the list of Tags we know about, its index in the list is its slot in the superframe
 						//if(GPIO_ReadInputDataBit(REGISTERING_GPIO, REGISTERING_GPIO_PIN))
 					//	{
-							instaddtagtolist(inst, &(dw_event->msgu.rxblinkmsg.tagID[0]));
+							slot = instaddtagtolist(inst, &(dw_event->msgu.rxblinkmsg.tagID[0]));
 						//}
 
                         //initiate ranging message if the tag is in the list
 						//if(istaginlist(inst, &(dw_event->msgu.rxblinkmsg.tagID[0])))
 					//	{
-							if(inst->tagToRangeWith < TAG_LIST_SIZE)
+							//initiate ranging message if there is a slot for this Tag in the superframe
+							//(and no Tag heard before it is still waiting for its ranging init)
+#if (BROADCAST_POLL == 1)
+							//only the coordinator gives the slots, the other anchors just know the Tag
+							if((slot < SF_SLOTS) && (inst->anchorIndex == BC_COORD_INDEX)
+								&& instadmitcanreply(inst, &(dw_event->msgu.rxblinkmsg.tagID[0])))
 							{
-								//initiate ranging message this is a Blink from the Tag we would like to range to
-								if(memcmp(&inst->tagList[inst->tagToRangeWith][0],  &(dw_event->msgu.rxblinkmsg.tagID[0]), BLINK_FRAME_SOURCE_ADDRESS) == 0)
-								{
-									inst->tagShortAdd = (dwt_getpartid() & 0xFF);
-									inst->tagShortAdd =  (inst->tagShortAdd << 8) + dw_event->msgu.rxblinkmsg.tagID[0] ;
+								inst->tagToRangeWith = slot;
+								//the same on every anchor: the 2 LSBs of the Tag's EUI
+								inst->tagShortAdd = dw_event->msgu.rxblinkmsg.tagID[0] + (dw_event->msgu.rxblinkmsg.tagID[1] << 8);
+#else
+							if((slot < SF_SLOTS) && instadmitcanreply(inst, &(dw_event->msgu.rxblinkmsg.tagID[0])))
+							{
+								inst->tagToRangeWith = slot;
+								inst->tagShortAdd = (dwt_getpartid() & 0xFF);
+								inst->tagShortAdd =  (inst->tagShortAdd << 8) + slot ;
+#endif
 
-									//if using longer reply delay time (e.g. if interworking with a PC application)
-									inst->delayedReplyTime = (dw_event->timeStamp + inst->rnginitReplyDelay) >> 8 ;  // time we should send the blink response
+								//if using longer reply delay time (e.g. if interworking with a PC application)
+								inst->delayedReplyTime = (dw_event->timeStamp + inst->rnginitReplyDelay) >> 8 ;  // time we should send the blink response
 
-									//set destination address
-									memcpy(&inst->rng_initmsg.destAddr[0], &(dw_event->msgu.rxblinkmsg.tagID[0]), BLINK_FRAME_SOURCE_ADDRESS); //remember who to send the reply to
+								//set destination address
+								memcpy(&inst->rng_initmsg.destAddr[0], &(dw_event->msgu.rxblinkmsg.tagID[0]), BLINK_FRAME_SOURCE_ADDRESS); //remember who to send the reply to
 
-									inst->testAppState = TA_TXE_WAIT;
-									inst->nextState = TA_TXRANGINGINIT_WAIT_SEND ;
+								inst->testAppState = TA_TXE_WAIT;
+								inst->nextState = TA_TXRANGINGINIT_WAIT_SEND ;
 
-									break;
-								}
-                            //else stay in RX
+								break;
 							}
+                            //else stay in RX (superframe full)
 					//	}
                     }
                     //else //not initiating ranging - continue to receive
@@ -752,14 +983,13 @@ int testapprun_s(instance_data_t *inst, int message)
                     {
                         if(inst->mode == ANCHOR)
                         {
-#if (USING_64BIT_ADDR==1)
-							if(memcmp(&inst->tagList[inst->tagToRangeWith][0], &srcAddr[0], BLINK_FRAME_SOURCE_ADDRESS) == 0) //if the Tag's address does not match (ignore the message)
-#else
-							//if using 16-bit addresses the ranging messages from tag are using the short address tag was given in the ranging init message
-							if(inst->tagShortAdd == (srcAddr[0] + (srcAddr[1] << 8)))
-#endif
-							//only process messages from the associated tag
+                        	//if using 16-bit addresses the ranging messages from tag are using the short address tag was given in the ranging init message
+                        	int slot = insttagslot(inst, &srcAddr[0], ((dw_event->msgu.frame[1] & 0xC0) == 0xC0) ? ADDR_BYTE_SIZE_L : ADDR_BYTE_SIZE_S);
+
+							//only process messages from the Tags which have a slot in the superframe (ignore the message otherwise)
+							if(slot < SF_SLOTS)
                             {
+								inst->tagToRangeWith = slot;
 								fcode = fn_code;
                             }
                         }
@@ -774,8 +1004,9 @@ int testapprun_s(instance_data_t *inst, int message)
                             {
                                 if(inst->mode == TAG_TDOA) //only start ranging with someone if not ranging already
                                 {
-                                    uint32 final_reply_delay_us;
+                                    uint32 rx_dly_us;
                                     uint32 resp_dly[RESP_DLY_NB];
+                                    uint16 sf_phase;
                                     int i;
 
                                     inst->testAppState = TA_TXE_WAIT;
@@ -784,6 +1015,20 @@ int testapprun_s(instance_data_t *inst, int message)
                                     inst->tagShortAdd = messageData[RNG_INIT_TAG_SHORT_ADDR_LO]
                                                         + (messageData[RNG_INIT_TAG_SHORT_ADDR_HI] << 8) ;
 
+#if (SHORT_ADDR_RANGING == 1)
+                                    if(messageData[RNG_INIT_OPTIONS] & RNG_INIT_OPT_SHORT_ADDR)
+                                    {
+                                        //use 16-bit addresses for the rest of the session, the anchor's short address is the 2 LSBs of its EUI
+                                        inst->shortAddrRanging = 1;
+                                        memcpy(&inst->msg_f.destAddr[0], &srcAddr[0], ADDR_BYTE_SIZE_S);
+                                        inst->msg_f.sourceAddr[0] = inst->tagShortAdd & 0xFF;
+                                        inst->msg_f.sourceAddr[1] = (inst->tagShortAdd >> 8) & 0xFF;
+                                        dwt_setaddress16(inst->tagShortAdd);
+
+                                        instance_init_timings(); //the ranging frames are shorter - recompute the frame lengths and timeouts
+                                    }
+#endif
+
                                     // Get response delays from message and update internal timings accordingly
                                     resp_dly[RESP_DLY_ANC] =  messageData[RNG_INIT_ANC_RESP_DLY_LO]
                                                               + (messageData[RNG_INIT_ANC_RESP_DLY_HI] << 8);
@@ -799,11 +1044,21 @@ int testapprun_s(instance_data_t *inst, int message)
                                         }
                                     }
                                     // Update delay between poll transmission and response reception.
-                                    inst->txToRxDelayTag_sy = US_TO_SY_INT(resp_dly[RESP_DLY_ANC] - inst->fl_us[POLL]) - RX_START_UP_SY;
+                                    rx_dly_us = resp_dly[RESP_DLY_ANC];
+                                    if(rx_dly_us > (ANC_RX_TURN_AROUND_US + inst->fl_us[POLL]))
+                                    {
+                                    	// the anchor may shorten its turn-around time: listen from the earliest response time
+                                    	inst->fwtoTime_sy += US_TO_SY_INT(rx_dly_us - (ANC_RX_TURN_AROUND_US + inst->fl_us[POLL]));
+                                    	rx_dly_us = ANC_RX_TURN_AROUND_US + inst->fl_us[POLL];
+                                    }
+                                    inst->txToRxDelayTag_sy = US_TO_SY_INT(rx_dly_us - inst->fl_us[POLL]) - RX_START_UP_SY;
                                     // Update delay between poll transmission and final transmission.
-                                    final_reply_delay_us = resp_dly[RESP_DLY_ANC] + resp_dly[RESP_DLY_TAG];
-                                    inst->finalReplyDelay = convertmicrosectodevicetimeu(final_reply_delay_us);
-                                    inst->finalReplyDelay_ms = CEIL_DIV(final_reply_delay_us, 1000);
+                                    inst->ancRespDly_us = resp_dly[RESP_DLY_ANC];
+                                    inst->tagTurnAround_us = resp_dly[RESP_DLY_TAG] - inst->fl_us[RESP];
+                                    inst->turnCalibCount = (SS_TWR == 1) ? TURNAROUND_CALIB_SAMPLES : 0; //calibrate our turn-around time (no final in SS-TWR)
+                                    inst->turnLatMax_us = 0;
+                                    inst->turnSaved_us = 0;
+                                    instsetreplydelays(inst);
                                     // If we are using long response delays, deactivate sleep.
                                     if (resp_dly[RESP_DLY_ANC] >= LONG_RESP_DLY_LIMIT_US
                                         || resp_dly[RESP_DLY_TAG] >= LONG_RESP_DLY_LIMIT_US)
@@ -811,6 +1066,12 @@ int testapprun_s(instance_data_t *inst, int message)
                                         inst->sleep_en = 0;
                                     }
 
+                                    // Get our slot in the anchor's superframe, we poll once per superframe in this slot
+                                    inst->tagSlot = messageData[RNG_INIT_SLOT_NUM];
+                                    inst->slotDuration_ms = messageData[RNG_INIT_SLOT_DUR_LO] + (messageData[RNG_INIT_SLOT_DUR_HI] << 8);
+                                    inst->sfPeriod_ms = messageData[RNG_INIT_SF_PERIOD_LO] + (messageData[RNG_INIT_SF_PERIOD_HI] << 8);
+                                    sf_phase = messageData[RNG_INIT_SF_PHASE_LO] + (messageData[RNG_INIT_SF_PHASE_HI] << 8);
+
 #if (USING_64BIT_ADDR == 1)
 									memcpy(&inst->msg.destAddr[0], &srcAddr[0], ADDR_BYTE_SIZE_L); //set the anchor address for the reply (set destination address)
 #else
@@ -821,11 +1082,34 @@ int testapprun_s(instance_data_t *inst, int message)
 #endif
 
 									memcpy(&inst->relpyAddress[0], &srcAddr[0], ADDR_BYTE_SIZE_L); //remember who to send the reply to (set destination address)
+#if (BROADCAST_POLL == 1)
+									instanceconfigbcframeheader(inst);
+#endif
+
+                                    //move to the channel/preamble code partition of our slot
+                                    instsetpartition(inst, (messageData[RNG_INIT_OPTIONS] & RNG_INIT_OPT_PART_MASK) >> RNG_INIT_OPT_PART_SHIFT);
 
                                     inst->mode = TAG ;
+                                    inst->blinkAttempts = 0;
+                                    inst->burstCount = 0;
+                                    inst->burstTofNum = 0;
+                                    inst->rateDiv = 1; //start at the fastest rate
+                                    inst->rateLastRange = -1;
 									//inst->responseTimeouts = 0; //reset timeout count
-									inst->instToSleep = 0; //don't go to sleep - start ranging instead and then sleep after 1 range is done or poll times out
-									inst->instancetimer_saved = inst->instancetimer = portGetTickCount(); //set timer base
+									if(inst->sfPeriod_ms == 0)
+									{
+										inst->instToSleep = 0; //don't go to sleep - start ranging instead and then sleep after 1 range is done or poll times out
+										inst->instancetimer_saved = inst->instancetimer = portGetTickCount(); //set timer base
+									}
+									else
+									{
+										//sleep until the start of our slot (the timer expires at instancetimer_saved + tagSleepTime_ms)
+										inst->tagSleepTime_ms = inst->sfPeriod_ms;
+										inst->instToSleep = 1;
+										inst->instancetimer_saved = inst->instancetimer = portGetTickCount()
+												+ ((inst->tagSlot * inst->slotDuration_ms + inst->sfPeriod_ms - sf_phase) % inst->sfPeriod_ms)
+												- inst->tagSleepTime_ms;
+									}
                                 }
 								//printf("GOT RTLS_DEMO_MSG_RNG_INIT - start ranging - \n");
 								//else we ignore this message if already associated... (not TAG_TDOA)
@@ -833,6 +1117,8 @@ int testapprun_s(instance_data_t *inst, int message)
 							break; //RTLS_DEMO_MSG_RNG_INIT
 
                             case RTLS_DEMO_MSG_TAG_POLL:
+                            case RTLS_DEMO_MSG_TAG_POLLB:
+                            case RTLS_DEMO_MSG_TAG_POLLSS:
                             {
 								if(inst->mode == LISTENER) //don't process any ranging messages when in Listener mode
 								{
@@ -844,11 +1130,13 @@ int testapprun_s(instance_data_t *inst, int message)
                                 if (!inst->frameFilteringEnabled)
                                 {
                                     // if we missed the ACK to the ranging init message we may not have turned frame filtering on
-                                    dwt_enableframefilter(DWT_FF_DATA_EN | DWT_FF_ACK_EN); //we are starting ranging - enable the filter....
+                                    // keep reserved frame types (blinks) so that new Tags can still join the superframe
+                                    dwt_enableframefilter(DWT_FF_DATA_EN | DWT_FF_ACK_EN | DWT_FF_RSVD_EN); //we are starting ranging - enable the filter....
                                     inst->frameFilteringEnabled = 1 ;
                                 }
 
-								if(inst->previousState == TA_TXRESPONSE_WAIT_SEND)
+								//no final received after our last response (a single-sided TWR response does not expect one)
+								if((inst->previousState == TA_TXRESPONSE_WAIT_SEND) && (RNG_MSG_DATA(inst)[FCODE] != RTLS_DEMO_MSG_ANCH_RESPSS))
 								{
 									inst->norange = 3;
 								}
@@ -858,6 +1146,11 @@ int testapprun_s(instance_data_t *inst, int message)
                                 	inst->canprintinfo = 0;
                                 	inst->testAppState = TA_TX_WAIT_CONF;                                               // wait confirmation
                                 	inst->previousState = TA_TXRESPONSE_WAIT_SEND ;
+
+                                	if(fcode == RTLS_DEMO_MSG_TAG_POLLSS) //the exchange is complete once our response is sent
+                                	{
+                                		instcountsfrange(inst);
+                                	}
                                 }
                                 else
                                 {
@@ -868,6 +1161,7 @@ int testapprun_s(instance_data_t *inst, int message)
                             break; //RTLS_DEMO_MSG_TAG_POLL
 
                             case RTLS_DEMO_MSG_ANCH_RESP:
+                            case RTLS_DEMO_MSG_ANCH_RESPSS:
                             {
                                 if(inst->mode == LISTENER) //don't process any ranging messages when in Listener mode
                                 {
@@ -878,6 +1172,32 @@ int testapprun_s(instance_data_t *inst, int message)
 								inst->anchorRespRxTime = dw_event->timeStamp ; //Response's Rx time
 
 								inst->testAppState = TA_TXFINAL_WAIT_SEND ; // send our response / the final
+#if (BROADCAST_POLL == 1)
+								{
+									int k = messageData[RES_IDX];
+
+									if(k < ANCHOR_LIST_SIZE)
+									{
+										inst->anchRespRxTime[k] = dw_event->timeStamp;
+										inst->respRxMask |= (1 << k);
+										//the ToF in the response is this anchor's own, keep it apart from the other anchors'
+										inst->anchTof[k] = 0;
+										memcpy(&inst->anchTof[k], &(messageData[TOFR]), 5);
+										inst->anchAddr[k] = srcAddr[0] + ((uint16) srcAddr[1] << 8);
+										if((inst->anchTof[k] != 0) && (inst->burstCount > TAG_BURST_SKIP))
+										{
+											inst->anchTofMask |= (1 << k);
+										}
+									}
+
+									//wait for the responses of the next anchors (unless this was the last response slot)
+									if(k < (ANCHOR_LIST_SIZE - 1))
+									{
+										dwt_setrxtimeout((uint16)(US_TO_SY_INT((ANCHOR_LIST_SIZE - 1 - k) * inst->respSlot_us) + RX_START_UP_SY + 10));
+										inst->testAppState = TA_RXE_WAIT ;
+									}
+								}
+#endif
 
 								inst->respPSC = (dwt_read16bitoffsetreg(0x10, 2) >> 4);
 								inst->canprintinfo = 2;
@@ -886,12 +1206,62 @@ int testapprun_s(instance_data_t *inst, int message)
 								//copy previously calculated ToF
 								memcpy(&inst->tof, &(messageData[TOFR]), 5);
 
+								if(fcode == RTLS_DEMO_MSG_ANCH_RESPSS)
+								{
+									int64 Ra, Db;
+
+									// single-sided TWR: ToF = (Ra - Db * (1 - clock offset)) / 2, where Ra is the poll to response
+									// round trip time measured by the Tag and Db the reply time measured (and sent) by the anchor
+									Db = 0;
+									memcpy(&Db, &(messageData[RES_RPLY]), 5);
+									Ra = (int64)((inst->anchorRespRxTime - inst->txu.tagPollTxTime) & MASK_40BIT);
+
+									inst->clockOffset = instcarrierintegratortoppm(inst, inst->carrierIntegrator);
+									inst->tof = (int64) ((((double)Ra) - (((double)Db) * (1.0 - (inst->clockOffset * 1.0e-6)))) / 2.0);
+
+									inst->burstRefTime = inst->anchorRespRxTime; //the next poll of the burst is timed from the response
+									inst->testAppState = TA_TXE_WAIT ; // no final - go to sleep and send the next poll
+									inst->nextState = TA_TXPOLL_WAIT_SEND ;
+								}
+
+								if(inst->burstCount <= TAG_BURST_SKIP) //ToF of the previous wake-up's last exchange
+								{
+									inst->tof = 0;
+								}
+								else if(inst->tof != 0) //keep the range for the median of the burst
+								{
+									instburstaddtof(inst, srcAddr[0] + ((uint16) srcAddr[1] << 8));
+								}
+
+								//re-align the next poll on the start of our slot using the anchor's superframe phase
+								//(after a broadcast poll only the coordinator's response is used, the slot is in its superframe)
+#if (BROADCAST_POLL == 1)
+								if(inst->sfPeriod_ms && (messageData[RES_IDX] == BC_COORD_INDEX))
+#else
+								if(inst->sfPeriod_ms)
+#endif
+								{
+									int sf_err = (messageData[RES_R2] + (messageData[RES_R3] << 8)) - (inst->tagSlot * inst->slotDuration_ms);
+
+									if(sf_err > (inst->sfPeriod_ms >> 1))
+									{
+										sf_err -= inst->sfPeriod_ms;
+									}
+									else if(sf_err <= -(inst->sfPeriod_ms >> 1))
+									{
+										sf_err += inst->sfPeriod_ms;
+									}
+
+									inst->instancetimer_saved -= sf_err;
+								}
+
 								inst->newrangeancaddress = srcAddr[0] + ((uint16) srcAddr[1] << 8);
 								inst->newrangetagaddress = inst->eui64[0] + ((uint16) inst->eui64[1] << 8);
                             }
                             break; //RTLS_DEMO_MSG_ANCH_RESP
 
                             case RTLS_DEMO_MSG_TAG_FINAL:
+                            case RTLS_DEMO_MSG_TAG_FINALB:
                             {
                                 int64 Rb, Da, Ra, Db ;
                                 uint64 tagFinalTxTime  = 0;
@@ -916,9 +1286,25 @@ int testapprun_s(instance_data_t *inst, int message)
 
                                 // times measured at Tag extracted from the message buffer
                                 // extract 40bit times
-								memcpy(&tagPollTxTime, &(messageData[PTXT]), 5);
-								memcpy(&anchorRespRxTime, &(messageData[RRXT]), 5);
-								memcpy(&tagFinalTxTime, &(messageData[FTXT]), 5);
+								if(fcode == RTLS_DEMO_MSG_TAG_FINALB)
+								{
+									//the broadcast final carries the response RX times of all the anchors - find ours
+									if(((messageData[RMSK_B] >> inst->anchorIndex) & 0x1) == 0) //the Tag did not get our response
+									{
+										inst->testAppState = TA_RXE_WAIT ;              // wait for next frame
+										dwt_setrxaftertxdelay(0);
+										break;
+									}
+									memcpy(&tagPollTxTime, &(messageData[PTXT_B]), 5);
+									memcpy(&anchorRespRxTime, &(messageData[RRXT_B + (5 * inst->anchorIndex)]), 5);
+									memcpy(&tagFinalTxTime, &(messageData[FTXT_B]), 5);
+								}
+								else
+								{
+									memcpy(&tagPollTxTime, &(messageData[PTXT]), 5);
+									memcpy(&anchorRespRxTime, &(messageData[RRXT]), 5);
+									memcpy(&tagFinalTxTime, &(messageData[FTXT]), 5);
+								}
 
                                 // poll response round trip delay time is calculated as
                                 // (anchorRespRxTime - tagPollTxTime) - (anchorRespTxTime - tagPollRxTime)
@@ -942,6 +1328,7 @@ int testapprun_s(instance_data_t *inst, int message)
 
                                 reportTOF(inst);
                                 inst->newrange = 1;
+                                instcountsfrange(inst);
                                 inst->newrangetagaddress = srcAddr[0] + ((uint16) srcAddr[1] << 8);
                                 inst->newrangeancaddress = inst->eui64[0] + ((uint16) inst->eui64[1] << 8);
 								//inst->lastReportTime = time_ms;
@@ -1010,9 +1397,6 @@ int testapprun_s(instance_data_t *inst, int message)
 } // end testapprun()
 
 // -------------------------------------------------------------------------------------------------------------------
-#if NUM_INST != 1
-#error These functions assume one instance only
-#else
 
 
 // -------------------------------------------------------------------------------------------------------------------
@@ -1021,7 +1405,7 @@ int testapprun_s(instance_data_t *inst, int message)
 // Returns 0 on success and -1 on error
 int instance_init_s(int mode)
 {
-    int instance = 0 ;
+    int instance = INST_CURRENT;
 
     instance_data[instance].mode =  mode;                                // assume anchor,
     instance_data[instance].testAppState = TA_INIT ;
@@ -1035,11 +1419,43 @@ int instance_init_s(int mode)
     dwt_setleds(3) ; //configure the GPIOs which control the LEDs on EVBs
 
     dwt_setcallbacks(instance_txcallback, instance_rxcallback);
+    instance_setrxprefetch(mode);
 
     instance_setapprun(testapprun_s);
 
     instance_data[instance].anchorListIndex = 0 ;
 
+    //the anchor offers 16-bit addresses in the ranging init, the Tag switches to them when it gets it
+    instance_data[instance].shortAddrRanging = (mode == ANCHOR) ? SHORT_ADDR_RANGING : 0;
+
+    //default turn-around times, they are calibrated on the first exchanges (TURNAROUND_CALIB)
+    instance_data[instance].ancTurnAround_us = ANC_TURN_AROUND_TIME_US;
+    instance_data[instance].tagTurnAround_us = TAG_TURN_AROUND_TIME_US;
+    instance_data[instance].ancRespDly_us = 0;
+
+    //blink discovery metrics
+    instance_data[instance].blinkAttempts = 0;
+    instance_data[instance].ttfrStart = 0;
+    instance_data[instance].ttfr_ms = -1;
+    instance_data[instance].admitQueueLen = 0;
+    instance_data[instance].admitQueuePeak = 0;
+    instance_data[instance].admitCount = 0;
+    instance_data[instance].admitWaitMax_ms = 0;
+    instance_data[instance].turnCalibCount = 0;
+    instance_data[instance].turnLatMax_us = 0;
+    instance_data[instance].turnSaved_us = 0;
+    instance_data[instance].rxcbLatMax_us = 0;
+    if((mode == LISTENER) || ((mode == ANCHOR) && (IMMEDIATE_RESPONSE == 1)))
+    {
+    	instance_data[instance].turnCalibCount = TURNAROUND_CALIB_SAMPLES; //no delayed reply to calibrate
+    }
+
+    //anchors and listeners keep the receiver on between frames: use both RX buffers and let the IC re-enable the receiver
+    instance_data[instance].dblBuffOn = ((mode == ANCHOR) || (mode == LISTENER)) ? DOUBLE_RX_BUFFER : 0;
+    instance_data[instance].rxOn = 0;
+    dwt_setdblrxbuffmode(instance_data[instance].dblBuffOn);
+    dwt_setautorxreenable(instance_data[instance].dblBuffOn);
+
     //sample test calibration functions
     //xtalcalibration();
     //powertest();
@@ -1053,13 +1469,21 @@ extern uint8 dwnsSFDlen[];
 // /!\ This function assumes that there is no user payload in the frame.
 void instance_init_timings(void)
 {
-    instance_data_t *inst = &instance_data[0];
+    instance_data_t *inst = &instance_data[INST_CURRENT];
     uint32 pre_len;
     int sfd_len;
     static const int data_len_bytes[FRAME_TYPE_NB] = {
         BLINK_FRAME_LEN_BYTES, RNG_INIT_FRAME_LEN_BYTES, POLL_FRAME_LEN_BYTES,
         RESP_FRAME_LEN_BYTES, FINAL_FRAME_LEN_BYTES};
+#if (SHORT_ADDR_RANGING == 1)
+    static const int data_len_bytes_s[FRAME_TYPE_NB] = {
+        BLINK_FRAME_LEN_BYTES, RNG_INIT_FRAME_LEN_BYTES, POLL_FRAME_LEN_BYTES_S,
+        RESP_FRAME_LEN_BYTES_S, FINAL_FRAME_LEN_BYTES_S};
+#endif
+    const int *frame_len_bytes = data_len_bytes;
     int i;
+    uint32 resp_us;
+    uint32 exchange_us;
     // Margin used for timeouts computation.
     const int margin_sy = 10;
 
@@ -1104,12 +1528,22 @@ void instance_init_timings(void)
         pre_len *= 99359;
     else
         pre_len *= 101763;
-    // Second step is data length for all frame types.
+    inst->preamble_us = CEIL_DIV(pre_len, 100000);
+    // Second step is data length for all frame types. The poll, response and
+    // final are shorter once 16-bit addresses have been negotiated. Only the
+    // Tag switches: the anchor only offers them and may still get 64-bit polls
+    // (from a Tag that ignored the offer), so it keeps the long frame lengths as
+    // the minimum for its reply delay and slots (a 16-bit poll just gets a reply
+    // a few symbols later than needed).
+#if (SHORT_ADDR_RANGING == 1)
+    if (inst->shortAddrRanging && (inst->mode != ANCHOR))
+        frame_len_bytes = data_len_bytes_s;
+#endif
     for (i = 0; i < FRAME_TYPE_NB; i++)
     {
         // Compute the number of symbols for the given length.
-        inst->fl_us[i] = data_len_bytes[i] * 8
-                         + CEIL_DIV(data_len_bytes[i], 330) * 48;
+        inst->fl_us[i] = frame_len_bytes[i] * 8
+                         + CEIL_DIV(frame_len_bytes[i], 330) * 48;
         // Convert from symbols to time and add PHY header length.
         if(inst->configData.dataRate == DWT_BR_110K)
         {
@@ -1133,6 +1567,14 @@ void instance_init_timings(void)
     // Final frame wait timeout time.
     inst->fwtoTime_sy = US_TO_SY_INT(inst->fl_us[FINAL])
                         + RX_START_UP_SY + margin_sy;
+    // Response slot after a broadcast poll: response frame plus the gap the Tag
+    // needs to re-enable its receiver.
+    inst->respSlot_us = inst->fl_us[RESP] + RESP_SLOT_GAP_US;
+#if (BROADCAST_POLL == 1)
+    // After a broadcast poll the Tag waits for the responses of all the anchors.
+    inst->fwtoTime_sy = US_TO_SY_INT(ANCHOR_LIST_SIZE * inst->respSlot_us - RESP_SLOT_GAP_US)
+                        + RX_START_UP_SY + margin_sy;
+#endif
     // Ranging init frame wait timeout time.
     inst->fwtoTimeB_sy = US_TO_SY_INT(inst->fl_us[RNG_INIT])
                          + RX_START_UP_SY + margin_sy;
@@ -1141,21 +1583,45 @@ void instance_init_timings(void)
         US_TO_SY_INT((RNG_INIT_REPLY_DLY_MS * 1000) - inst->fl_us[BLINK])
         - RX_START_UP_SY;
     // Delay between anchor's response transmission and final reception.
-    inst->txToRxDelayAnc_sy = US_TO_SY_INT(TAG_TURN_AROUND_TIME_US) - RX_START_UP_SY;
+    inst->txToRxDelayAnc_sy = US_TO_SY_INT(TAG_RX_TURN_AROUND_US) - RX_START_UP_SY;
+#if (BROADCAST_POLL == 1)
+    // The final comes after the responses of the anchors in the next slots.
+    inst->txToRxDelayAnc_sy = US_TO_SY_INT(TAG_RX_TURN_AROUND_US
+                                           + (ANCHOR_LIST_SIZE - 1 - inst->anchorIndex) * inst->respSlot_us) - RX_START_UP_SY;
+#endif
 
     // No need to init txToRxDelayTag_sy here as it will be set upon reception
     // of ranging init message.
 
     // Delay between blink reception and ranging init message transmission.
     inst->rnginitReplyDelay = convertmicrosectodevicetimeu(RNG_INIT_REPLY_DLY_MS * 1000);
-    // Delay between poll reception and response transmission. Computed from
-    // poll reception timestamp to response transmission timestamp so you have
-    // to add poll frame length to delay that must be respected between frames.
-#if (IMMEDIATE_RESPONSE == 0)
-    inst->responseReplyDelay = convertmicrosectodevicetimeu(ANC_TURN_AROUND_TIME_US + inst->fl_us[POLL]);
+    // Delay between poll reception and response transmission (and, on a Tag,
+    // between poll transmission and final transmission).
+    instsetreplydelays(inst);
+
+    // Superframe: one slot per Tag in the list, each slot holds a poll/response/final
+    // exchange. The superframe is never shorter than the Tag ranging period,
+    // the slots are then spread over it.
+    resp_us = inst->fl_us[RESP];
+#if (BROADCAST_POLL == 1)
+    resp_us += (ANCHOR_LIST_SIZE - 1) * inst->respSlot_us;
+#endif
+#if (SS_TWR == 1)
+    // single-sided TWR: there is no final in the slot
+    exchange_us = inst->fl_us[POLL] + ANC_TURN_AROUND_TIME_US + resp_us;
 #else
-    inst->responseReplyDelay = 0 ;
+    exchange_us = inst->fl_us[POLL] + ANC_TURN_AROUND_TIME_US + resp_us
+                  + TAG_TURN_AROUND_TIME_US + inst->fl_us[FINAL];
 #endif
+    // A burst is TAG_BURST_POLLS exchanges, each poll after the first is sent TAG_BURST_GAP_US after the
+    // RMARKER of the previous final/response (the frame itself has to be counted in the gap).
+    inst->burstGap = convertmicrosectodevicetimeu(TAG_BURST_GAP_US + inst->fl_us[FINAL]);
+    inst->slotDuration_ms = CEIL_DIV(TAG_BURST_POLLS * exchange_us
+                                     + (TAG_BURST_POLLS - 1) * (TAG_BURST_GAP_US + inst->fl_us[FINAL])
+                                     + SLOT_GUARD_TIME_US, 1000);
+    if ((inst->slotDuration_ms * SF_SLOTS) < inst->tagSleepTime_ms)
+        inst->slotDuration_ms = inst->tagSleepTime_ms / SF_SLOTS;
+    inst->sfPeriod_ms = inst->slotDuration_ms * SF_SLOTS;
 
     // Smart Power is automatically applied by DW chip for frame of which length
     // is < 1 ms. Let the application know if it will be used depending on the
@@ -1166,9 +1632,44 @@ void instance_init_timings(void)
         inst->configData.smartPowerEn = 0;
 }
 
+// -------------------------------------------------------------------------------------------------------------------
+//
+// Set the response (anchor) and final (Tag) delays from the current turn-around times
+//
+void instsetreplydelays(instance_data_t *inst)
+{
+    uint32 reply_us;
+
+    // Computed from poll reception timestamp to response transmission timestamp
+    // so you have to add poll frame length to delay that must be respected between frames.
+#if (IMMEDIATE_RESPONSE == 0)
+    reply_us = inst->ancTurnAround_us + inst->fl_us[POLL];
+#if (BROADCAST_POLL == 1)
+    // Each anchor responds to a broadcast poll in its own response slot.
+    reply_us += inst->anchorIndex * inst->respSlot_us;
+#endif
+    inst->responseReplyDelay = convertmicrosectodevicetimeu(reply_us);
+#else
+    inst->responseReplyDelay = 0 ;
+#endif
+
+    // Tag: the final is sent at poll TX time + anchor response delay (given in
+    // the ranging init) + Tag turn-around time.
+    if(inst->ancRespDly_us)
+    {
+        reply_us = inst->ancRespDly_us + inst->tagTurnAround_us + inst->fl_us[RESP];
+#if (BROADCAST_POLL == 1)
+        // The final is sent after the responses of all the anchors
+        reply_us += (ANCHOR_LIST_SIZE - 1) * inst->respSlot_us;
+#endif
+        inst->finalReplyDelay = convertmicrosectodevicetimeu(reply_us);
+        inst->finalReplyDelay_ms = CEIL_DIV(reply_us, 1000);
+    }
+}
+
 uint64 instance_get_addr(void) //get own address
 {
-    int instance = 0;
+    int instance = INST_CURRENT;
     uint64 x = (uint64) instance_data[instance].eui64[0];
     x |= (uint64) instance_data[instance].eui64[1] << 8;
     x |= (uint64) instance_data[instance].eui64[2] << 16;
@@ -1182,17 +1683,18 @@ uint64 instance_get_addr(void) //get own address
     return (x);
 }
 
-uint64 instance_get_tagaddr(void) //get own address
+uint64 instance_get_tagaddr(void) //get address of the Tag of the last range
 {
-    int instance = 0;
-    uint64 x = (uint64) instance_data[instance].tagList[0][0];
-    x |= (uint64) instance_data[instance].tagList[0][1] << 8;
-    x |= (uint64) instance_data[instance].tagList[0][2] << 16;
-    x |= (uint64) instance_data[instance].tagList[0][3] << 24;
-    x |= (uint64) instance_data[instance].tagList[0][4] << 32;
-    x |= (uint64) instance_data[instance].tagList[0][5] << 40;
-    x |= (uint64) instance_data[instance].tagList[0][6] << 48;
-    x |= (uint64) instance_data[instance].tagList[0][7] << 56;
+    int instance = INST_CURRENT;
+    uint8 *tagAddr = &instance_data[instance].tagList[instance_data[instance].tagToRangeWith][0];
+    uint64 x = (uint64) tagAddr[0];
+    x |= (uint64) tagAddr[1] << 8;
+    x |= (uint64) tagAddr[2] << 16;
+    x |= (uint64) tagAddr[3] << 24;
+    x |= (uint64) tagAddr[4] << 32;
+    x |= (uint64) tagAddr[5] << 40;
+    x |= (uint64) tagAddr[6] << 48;
+    x |= (uint64) tagAddr[7] << 56;
 
 
     return (x);
@@ -1200,7 +1702,7 @@ uint64 instance_get_tagaddr(void) //get own address
 
 uint64 instance_get_anchaddr(void) //get anchor address (that sent the ToF)
 {
-    int instance = 0;
+    int instance = INST_CURRENT;
     uint64 x = (uint64) instance_data[instance].relpyAddress[0];
     x |= (uint64) instance_data[instance].relpyAddress[1] << 8;
     x |= (uint64) instance_data[instance].relpyAddress[2] << 16;
@@ -1215,7 +1717,7 @@ uint64 instance_get_anchaddr(void) //get anchor address (that sent the ToF)
 void instance_readaccumulatordata(void)
 {
 #if DECA_SUPPORT_SOUNDING==1
-    int instance = 0;
+    int instance = INST_CURRENT;
     uint16 len = 992 ; //default (16M prf)
 
     if (instance_data[instance].configData.prf == DWT_PRF_64M)  // Figure out length to read
@@ -1229,7 +1731,6 @@ void instance_readaccumulatordata(void)
 #endif  // support_sounding
 }
 
-#endif
 
 
 /* ==========================================================
@@ -45,6 +45,35 @@ extern "C" {
 
 #define USING_64BIT_ADDR (1) //when set to 0 - the DecaRanging application will use 16-bit addresses
 
+#define BROADCAST_POLL (0) //when set to 1 - the Tag ranges with all the anchors (up to ANCHOR_LIST_SIZE) at once:
+//one broadcast poll, each anchor responds in its own (delayed TX) response slot, then one final carrying the RX times
+//of all the responses. This is N+2 frames for N anchors instead of 3N.
+//Only the coordinator anchor (anchor index BC_COORD_INDEX) answers the blinks: it gives the Tag its slot in its own
+//superframe, which the Tag then follows. Every anchor registers the Tags from their blinks and knows a Tag by its EUI,
+//or by its short address, which is the 2 LSBs of its EUI (as for the anchors), so the Tag has the same address and
+//the same response schedule (response slot = anchor index) with all the anchors.
+//Each new range is reported (main.c, USB) as an "ib" line with the range to each anchor that responded, e.g. for 3
+//anchors: "ib 0001 00000bb8 0002 00000fa0 0003 000007d0" (anchor short address, range in mm, hex).
+#define BC_COORD_INDEX (0)
+
+#define SS_TWR (0) //when set to 1 - single-sided two-way ranging: poll and (delayed TX) response only, no final.
+//The response carries the anchor's reply time, the Tag corrects it with the clock offset measured by the carrier integrator.
+
+#if (SS_TWR == 1) && (BROADCAST_POLL == 1)
+#error "SS_TWR and BROADCAST_POLL cannot be used together"
+#endif
+
+//when using 64-bit addresses the anchor offers 16-bit addresses in the ranging init message: the poll, response and
+//final of the session then use the Tag's short address (tagShortAdd) and the anchor's short address (2 LSBs of its EUI)
+#if (USING_64BIT_ADDR == 1) && (BROADCAST_POLL == 0)
+#define SHORT_ADDR_RANGING (1)
+#else
+#define SHORT_ADDR_RANGING (0)
+#endif
+
+#define DOUBLE_RX_BUFFER (1) //when set to 1 - anchors and listeners use the DW1000 double receive buffer with automatic
+//receiver re-enable: a frame can be received while the previous one is being read/processed. Tags always use a single buffer.
+
 #define SIG_RX_BLINK			7		// Received ISO EUI 64 blink message
 #define SIG_RX_UNKNOWN			99		// Received an unknown frame
 
@@ -64,14 +93,24 @@ enum
 #define RTLS_DEMO_MSG_TAG_POLL              (0x21)          // Tag poll message
 #define RTLS_DEMO_MSG_ANCH_RESP             (0x10)          // Anchor response to poll
 #define RTLS_DEMO_MSG_TAG_FINAL             (0x29)          // Tag final massage back to Anchor (0x29 because of 5 byte timestamps needed for PC app)
+#define RTLS_DEMO_MSG_TAG_POLLB             (0x22)          // Tag broadcast poll message (to all anchors)
+#define RTLS_DEMO_MSG_TAG_FINALB            (0x2A)          // Tag broadcast final message (to all anchors)
+#define RTLS_DEMO_MSG_TAG_POLLSS            (0x23)          // Tag single-sided TWR poll message
+#define RTLS_DEMO_MSG_ANCH_RESPSS           (0x11)          // Anchor response to single-sided TWR poll (carries the reply time)
 
 //lengths including the Decaranging Message Function Code byte
 #define TAG_POLL_MSG_LEN                    1				// FunctionCode(1),
-#define ANCH_RESPONSE_MSG_LEN               9               // FunctionCode(1), RespOption (1), OptionParam(2), Measured_TOF_Time(5)
+#define ANCH_RESPONSE_MSG_LEN               10              // FunctionCode(1), RespOption (1), OptionParam(2), Measured_TOF_Time(5), Anchor_Index(1)
+#define ANCH_RESPSS_MSG_LEN                 15              // FunctionCode(1), RespOption (1), OptionParam(2), Measured_TOF_Time(5), Anchor_Index(1), Reply_Time(5)
 #define TAG_FINAL_MSG_LEN                   16              // FunctionCode(1), Poll_TxTime(5), Resp_RxTime(5), Final_TxTime(5)
-#define RANGINGINIT_MSG_LEN					7				// FunctionCode(1), Tag Address (2), Response Time (2) * 2
+#define TAG_FINALB_MSG_LEN                  (12 + (5 * ANCHOR_LIST_SIZE)) // FunctionCode(1), Poll_TxTime(5), Final_TxTime(5), Resp_Mask(1), Resp_RxTime(5) * ANCHOR_LIST_SIZE
+#define RANGINGINIT_MSG_LEN					(RNG_INIT_OPTIONS + 1) // FunctionCode(1), Tag Address (2), Response Time (2) * 2, Slot (1), Slot duration (2), Superframe period (2), Superframe phase (2), Options (1)
 
+#if (BROADCAST_POLL == 1)
+#define MAX_MAC_MSG_DATA_LEN                (TAG_FINALB_MSG_LEN) //max message len of the above
+#else
 #define MAX_MAC_MSG_DATA_LEN                (TAG_FINAL_MSG_LEN) //max message len of the above
+#endif
 
 #define STANDARD_FRAME_SIZE         127
 
@@ -100,15 +139,39 @@ enum
 // Total frame lengths.
 #if (USING_64BIT_ADDR == 1)
     #define RNG_INIT_FRAME_LEN_BYTES (RANGINGINIT_MSG_LEN + FRAME_CRTL_AND_ADDRESS_L + FRAME_CRC)
-    #define POLL_FRAME_LEN_BYTES (TAG_POLL_MSG_LEN + FRAME_CRTL_AND_ADDRESS_L + FRAME_CRC)
+#if (SS_TWR == 1)
+    #define RESP_FRAME_LEN_BYTES (ANCH_RESPSS_MSG_LEN + FRAME_CRTL_AND_ADDRESS_L + FRAME_CRC)
+#else
     #define RESP_FRAME_LEN_BYTES (ANCH_RESPONSE_MSG_LEN + FRAME_CRTL_AND_ADDRESS_L + FRAME_CRC)
+#endif
+#if (BROADCAST_POLL == 1)
+    // broadcast poll and final use a short (broadcast) destination address
+    #define POLL_FRAME_LEN_BYTES (TAG_POLL_MSG_LEN + FRAME_CRTL_AND_ADDRESS_LS + FRAME_CRC)
+    #define FINAL_FRAME_LEN_BYTES (TAG_FINALB_MSG_LEN + FRAME_CRTL_AND_ADDRESS_LS + FRAME_CRC)
+#else
+    #define POLL_FRAME_LEN_BYTES (TAG_POLL_MSG_LEN + FRAME_CRTL_AND_ADDRESS_L + FRAME_CRC)
     #define FINAL_FRAME_LEN_BYTES (TAG_FINAL_MSG_LEN + FRAME_CRTL_AND_ADDRESS_L + FRAME_CRC)
+#endif
 #else
     #define RNG_INIT_FRAME_LEN_BYTES (RANGINGINIT_MSG_LEN + FRAME_CRTL_AND_ADDRESS_LS + FRAME_CRC)
     #define POLL_FRAME_LEN_BYTES (TAG_POLL_MSG_LEN + FRAME_CRTL_AND_ADDRESS_S + FRAME_CRC)
+#if (SS_TWR == 1)
+    #define RESP_FRAME_LEN_BYTES (ANCH_RESPSS_MSG_LEN + FRAME_CRTL_AND_ADDRESS_S + FRAME_CRC)
+#else
     #define RESP_FRAME_LEN_BYTES (ANCH_RESPONSE_MSG_LEN + FRAME_CRTL_AND_ADDRESS_S + FRAME_CRC)
+#endif
+#if (BROADCAST_POLL == 1)
+    #define FINAL_FRAME_LEN_BYTES (TAG_FINALB_MSG_LEN + FRAME_CRTL_AND_ADDRESS_S + FRAME_CRC)
+#else
     #define FINAL_FRAME_LEN_BYTES (TAG_FINAL_MSG_LEN + FRAME_CRTL_AND_ADDRESS_S + FRAME_CRC)
 #endif
+#endif
+#if (SHORT_ADDR_RANGING == 1)
+    // ranging frame lengths once 16-bit addresses have been negotiated in the ranging init
+    #define POLL_FRAME_LEN_BYTES_S (POLL_FRAME_LEN_BYTES - FRAME_CRTL_AND_ADDRESS_L + FRAME_CRTL_AND_ADDRESS_S)
+    #define RESP_FRAME_LEN_BYTES_S (RESP_FRAME_LEN_BYTES - FRAME_CRTL_AND_ADDRESS_L + FRAME_CRTL_AND_ADDRESS_S)
+    #define FINAL_FRAME_LEN_BYTES_S (FINAL_FRAME_LEN_BYTES - FRAME_CRTL_AND_ADDRESS_L + FRAME_CRTL_AND_ADDRESS_S)
+#endif
 
 #define BLINK_FRAME_CONTROL_BYTES       (1)
 #define BLINK_FRAME_SEQ_NUM_BYTES       (1)
@@ -120,17 +183,110 @@ enum
 
 
 #define ANCHOR_LIST_SIZE			(4) //this is limited to 4 in this application see also
-#define TAG_LIST_SIZE				(1)	//anchor will range with 1st Tag it gets blink from
+#define TAG_LIST_SIZE				(32) //anchor will range with up to 32 Tags, each Tag gets its own slot in the superframe
+
+// Superframe (TDMA) scheduling: the anchor splits its superframe into TAG_LIST_SIZE slots and gives each
+// Tag its slot in the ranging init message. A slot has to hold a poll/response/final exchange plus this guard time.
+#define SLOT_GUARD_TIME_US			(1000)
+
+// Burst ranging: on each wake-up the Tag does TAG_BURST_LEN exchanges back to back (sharing the cost of the wake-up)
+// and reports the median range of the burst before going back to sleep. Each poll after the first is sent (delayed TX)
+// TAG_BURST_GAP_US after the end of the previous exchange, so the anchor has processed the final and is back in RX.
+// The anchor's slot is sized to hold the whole burst.
+#define TAG_BURST_LEN				(1) //number of exchanges per wake-up (1 = no burst)
+#define TAG_BURST_MAX				(8)
+#define TAG_BURST_GAP_US			(500)
+
+#if (TAG_BURST_LEN < 1) || (TAG_BURST_LEN > TAG_BURST_MAX)
+#error "TAG_BURST_LEN must be between 1 and TAG_BURST_MAX"
+#endif
+
+// In DS-TWR the anchor sends the ToF of an exchange in its next response: the first response of a burst carries the
+// last exchange of the previous wake-up (up to a sleep period old). Its ToF is dropped and one more poll is sent, so
+// the burst holds the TAG_BURST_LEN ranges of this wake-up.
+#if (SS_TWR == 0) && (TAG_BURST_LEN > 1)
+#define TAG_BURST_SKIP				(1)
+#else
+#define TAG_BURST_SKIP				(0)
+#endif
+#define TAG_BURST_POLLS				(TAG_BURST_LEN + TAG_BURST_SKIP) //polls per wake-up
+
+// Adaptive Tag ranging rate: the Tag ranges once every rateDiv periods (a period is the superframe, or the Tag sleep
+// time if the anchor does not use one, so the Tag stays on its slot). It goes straight to the fastest rate when it is
+// in the access zone or moving, and backs off one period per range when stationary, far away or not getting ranges.
+// The anchor does not need to know rateDiv: its Tag list is never aged (only instcleartaglist() clears it, at init and
+// on a memory reset), a Tag blinking again gets its slot back from its EUI, and the admission queue (ADMIT_HOLD_MS)
+// only holds Tags that have no slot yet. A slowed-down Tag skipping superframes keeps its slot.
+#define ADAPTIVE_TAG_RATE			(1)
+#define RATE_MAX_DIV				(8)		//slowest rate: one range every RATE_MAX_DIV periods
+#define RATE_NEAR_RANGE_M			(3.0)	//at or below this range always range at the fastest rate
+#define RATE_FAR_RANGE_M			(15.0)	//beyond this range back off even when moving
+#define RATE_MOVING_MPS				(0.25)	//range rate (m/s) above which the Tag is moving
 
 #define DELAYRX_WAIT4REPORT	(160)   //this is the time in us the RX turn on is delayed (after Final transmission and before Report reception starts)
 
 
 #define BLINK_SLEEP_DELAY					1000 //ms
 #define POLL_SLEEP_DELAY					500 //ms
+
+// Blink discovery: a Tag blinks every BLINK_SLEEP_DELAY plus a random jitter, the jitter window doubles after each blink
+// not answered by a ranging init (up to BLINK_BACKOFF_MAX_EXP times) so that Tags powered up together do not stay in step.
+#define BLINK_JITTER_MS						100 //ms
+#define BLINK_BACKOFF_MAX_EXP				3
+
+// Anchor admission queue: Tags whose blink could not be answered (anchor busy, superframe slot being offered to another
+// Tag) are queued, the queued Tags are then answered in order when they blink again. A Tag not heard for ADMIT_HOLD_MS
+// is dropped from the queue.
+#define ADMIT_QUEUE_SIZE					8
+#define ADMIT_HOLD_MS						(2 * (BLINK_SLEEP_DELAY + (BLINK_JITTER_MS << BLINK_BACKOFF_MAX_EXP)))
+
+// Channel/preamble code partitions: each of the RX_PARTITIONS partitions has its own TAG_LIST_SIZE slots in the
+// superframe (partition p owns slots p * TAG_LIST_SIZE to (p + 1) * TAG_LIST_SIZE - 1), so the anchor holds
+// RX_PARTITIONS * TAG_LIST_SIZE Tags. Each partition uses its own channel/preamble code pair (partition 0 is the
+// configured pair, odd partitions move between channels 2 and 5, the next preamble code of the channel is used every two
+// partitions). New Tags are spread over the partitions in turn. A Tag is told its partition in the ranging init message,
+// the anchor re-tunes its receiver (without a full re-initialisation) to the partition of the current slot, it listens
+// on partition 0 during the free slots so that new Tags can blink. RX_PARTITIONS = 1 disables the partitions.
+#define RX_PARTITIONS						(1)
+#define RX_PARTITIONS_MAX					(4)
+#define RX_PARTITION_LEAD_MS				(1) //re-tune this long before the start of the slot
+
+#if (RX_PARTITIONS < 1) || (RX_PARTITIONS > RX_PARTITIONS_MAX)
+#error "RX_PARTITIONS must be between 1 and RX_PARTITIONS_MAX"
+#endif
+#if (RX_PARTITIONS > 1) && (BROADCAST_POLL == 1)
+#error "RX_PARTITIONS needs the single anchor superframe (a broadcast poll is heard by anchors on other partitions)"
+#endif
+
+#define SF_SLOTS							(TAG_LIST_SIZE * RX_PARTITIONS) //slots in the superframe (Tags the anchor holds)
+
+// Header-first receive (anchor): only the MAC header of a data frame is read in the interrupt, a frame whose source is
+// not a Tag of the superframe (e.g. traffic of the other anchors) is dropped and the receiver re-enabled at once,
+// without reading the payload or queueing an event
+#define RX_HEADER_FIRST						(1)
+#define RX_HEADER_LEN						FRAME_CRTL_AND_ADDRESS_L //longest MAC header (64-bit addresses)
+
+// SPI throughput benchmark: after initialisation, time dwt_writetxdata()/dwt_readrxdata() of SPI_BENCH_LEN bytes at
+// each SPI prescaler (results in spiBench[], see main.c, sent back by the USB "b" command). Build it with DMA_ENABLE
+// (1) and (0) to compare the zero-copy DMA path with the serial loop
+#define SPI_BENCHMARK						(0)
+#define SPI_BENCH_LEN						(127)	//standard frame
+#define SPI_BENCH_RATES						(5)		//prescalers 4, 8, 16, 32, 64
+
+// event queue benchmark: after initialisation, time EV_BENCH_EVENTS events through the queue, built in place and with
+// the copies of the former by-value queue as a reference (results in evBench, see main.c)
+#define EV_BENCHMARK						(0)
+#define EV_BENCH_EVENTS						(1000)
 //#define POLL_SLEEP_DELAY					50 //ms	//NOTE 200 gives 5 Hz range period
 
 
+#if (BROADCAST_POLL == 1)
+#define IMMEDIATE_RESPONSE (0) //each anchor responds to a broadcast poll in its own slot, so responses are delayed TX
+#elif (SS_TWR == 1)
+#define IMMEDIATE_RESPONSE (0) //the single-sided TWR response carries its own TX time, so it has to be delayed TX
+#else
 #define IMMEDIATE_RESPONSE (1)
+#endif
 
 // !!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!
 // NOTE: the maximum RX timeout is ~ 65ms
@@ -147,13 +303,21 @@ enum
 #define PTXT                                1
 #define RRXT                                6
 #define FTXT                                11
+// Broadcast final message byte offsets. The response RX times are in anchor
+// index order, bit i of the mask is set if the response of anchor i was received.
+#define PTXT_B                              1
+#define FTXT_B                              6
+#define RMSK_B                              11
+#define RRXT_B                              12
 // Length of ToF value in report message. Can be used as offset to put up to
 // 4 ToF values in the report message.
 #define TOFR                                4
 // Anchor response byte offsets.
 #define RES_R1                              1               // Response option octet 0x02 (1),
-#define RES_R2                              2               // Response option parameter 0x00 (1) - used to notify Tag that the report is coming
-#define RES_R3                              3               // Response option parameter 0x00 (1),
+#define RES_R2                              2               // Response option parameter (1) - superframe phase (ms) low byte
+#define RES_R3                              3               // Response option parameter (1) - superframe phase (ms) high byte
+#define RES_IDX                             9               // Anchor index (1) - response slot of the anchor after a broadcast poll
+#define RES_RPLY                            10              // Reply time (5) - response TX time - poll RX time, in single-sided TWR response
 // Ranging init message byte offsets. Composed of tag short address, anchor
 // response delay and tag response delay.
 #define RNG_INIT_TAG_SHORT_ADDR_LO 1
@@ -162,6 +326,19 @@ enum
 #define RNG_INIT_ANC_RESP_DLY_HI 4
 #define RNG_INIT_TAG_RESP_DLY_LO 5
 #define RNG_INIT_TAG_RESP_DLY_HI 6
+// Superframe the Tag has been given a slot in: slot number, slot duration and
+// superframe period in ms, and superframe phase (ms) when the message is sent.
+#define RNG_INIT_SLOT_NUM 7
+#define RNG_INIT_SLOT_DUR_LO 8
+#define RNG_INIT_SLOT_DUR_HI 9
+#define RNG_INIT_SF_PERIOD_LO 10
+#define RNG_INIT_SF_PERIOD_HI 11
+#define RNG_INIT_SF_PHASE_LO 12
+#define RNG_INIT_SF_PHASE_HI 13
+#define RNG_INIT_OPTIONS 14
+#define RNG_INIT_OPT_SHORT_ADDR 0x01 // ranging frames use 16-bit addresses for the rest of the session
+#define RNG_INIT_OPT_PART_MASK 0x06 // channel/preamble code partition of the Tag's slot
+#define RNG_INIT_OPT_PART_SHIFT 1
 
 // Response delay values coded in ranging init message.
 // This is a bitfield composed of:
@@ -200,7 +377,11 @@ enum
 
 // Default anchor turn-around time: has to be RX_TO_TX_TIME_US when using
 // immediate response, cannot be less than 170 us when not.
+#if (IMMEDIATE_RESPONSE == 1)
 #define ANC_TURN_AROUND_TIME_US RX_TO_TX_TIME_US
+#else
+#define ANC_TURN_AROUND_TIME_US 300
+#endif
 #if (IMMEDIATE_RESPONSE == 1) && (ANC_TURN_AROUND_TIME_US != RX_TO_TX_TIME_US)
     #error "When using immediate response, anchor turn-around time has to be equal to RX to TX time!"
 #endif
@@ -209,6 +390,38 @@ enum
 // power management purpose).
 #define TAG_TURN_AROUND_TIME_US 500
 
+// Turn-around self-calibration: over its first TURNAROUND_CALIB_SAMPLES exchanges the anchor measures the time from the
+// poll RX timestamp to the start of the response TX, the Tag from the response RX timestamp to the start of the final TX.
+// The worst case plus TURNAROUND_MARGIN_US then replaces the default turn-around time (but not below the minimum).
+// The other side turns its receiver on for the minimum turn-around time (and waits longer), so each device can tune
+// its own turn-around time without telling its peer. The superframe slots keep using the default values.
+// Safe fallback: the default ANC/TAG_TURN_AROUND_TIME_US stay in use until the samples are collected, the result is
+// never below ANC/TAG_TURN_AROUND_MIN_US, and a late TX after the calibration restores the default (no new calibration
+// until the next ranging init). The anchor calibrates once after power up, the Tag after each ranging init (DS-TWR).
+// To check it on a board: range for TURNAROUND_CALIB_SAMPLES exchanges, then read ancTurnAround_us/tagTurnAround_us
+// and turnSaved_us (non zero = calibrated value in use) in the debugger, and instance_get_txl() (late TX count).
+// Build with TURNAROUND_CALIB (0) to always use the default turn-around times.
+#define TURNAROUND_CALIB (1)
+#define TURNAROUND_CALIB_SAMPLES (32)
+#define TURNAROUND_MARGIN_US (50)
+#define ANC_TURN_AROUND_MIN_US (170)
+#define TAG_TURN_AROUND_MIN_US (300)
+
+#if (TURNAROUND_CALIB == 1)
+#define ANC_RX_TURN_AROUND_US ANC_TURN_AROUND_MIN_US //earliest anchor response the Tag listens for
+#define TAG_RX_TURN_AROUND_US TAG_TURN_AROUND_MIN_US //earliest Tag final the anchor listens for
+#else
+#define ANC_RX_TURN_AROUND_US ANC_TURN_AROUND_TIME_US
+#define TAG_RX_TURN_AROUND_US TAG_TURN_AROUND_TIME_US
+#endif
+
+// Convert a difference of dwt_readsystimestamphi32() values (1 unit = 256 device time units) to microseconds.
+#define SYSTIME32H_TO_US(x) (((x) * 10) / 2496)
+
+// Gap between two consecutive anchor responses to a broadcast poll (time for
+// the Tag to read the response and re-enable its receiver).
+#define RESP_SLOT_GAP_US 300
+
 // "Long" response delays value. Over this limit, special processes must be
 // applied.
 #define LONG_RESP_DLY_LIMIT_US 25000
@@ -353,6 +566,9 @@ typedef struct
 *******************************************************************************************************************/
 
 #define MAX_EVENT_NUMBER (4)
+#define EVQ_TYPE_BINS (16)		// event queue telemetry: events per type 0..14, the last bin counts the others (SIG_RX_UNKNOWN)
+#define EVQ_LAT_BINS (10)		// latency (commit to instance_getevent()) histogram: bin 0 is < EVQ_LAT_BIN0_US,
+#define EVQ_LAT_BIN0_US (32)	// each next bin is twice as wide, the last one is open ended (>= 8 ms)
 //NOTE: Accumulators don't need to be stored as part of the event structure as when reading them only one RX event can happen...
 //the receiver is singly buffered and will stop after a frame is received
 
@@ -381,11 +597,22 @@ typedef struct
 			iso_IEEE_EUI64_blinkdw_msg rxblinkmsgdw;
 	}msgu;
 
-	//uint32 eventtime ;
+	uint32 eventtime ;		// cycle count when the event was committed (queue latency)
 	//uint32 eventtimeclr ;
 	//uint8 gotit;
 }event_data_t ;
 
+typedef struct
+{
+	uint32 typeCount[EVQ_TYPE_BINS];	// events committed per type
+	uint32 latency[EVQ_LAT_BINS];		// events per latency bin
+	uint32 latencyMax_us;				// longest latency
+	uint32 drops;						// events dropped because the queue was full (evQueueOverflows)
+	uint8  depth;						// events committed and not yet released
+	uint8  highWater;					// deepest the queue has been
+	uint16 reserved;
+} evq_stats_t;
+
 #define RTD_MED_SZ          8      // buffer size for mean of 8
 
 typedef struct{
@@ -393,6 +620,35 @@ typedef struct{
 	uint32 diffFmR;
 } rtd_t;
 
+typedef struct
+{
+	uint8  tagAddr[BLINK_FRAME_SOURCE_ADDRESS];	// EUI of the waiting Tag
+	uint32 firstHeard;							// time of its first blink (ms)
+	uint32 lastHeard;							// time of its last blink (ms)
+} admit_entry_t;
+
+typedef struct
+{
+	uint32 transactions;						// SPI transactions (CS assertions)
+	uint32 bytes;								// SPI bytes (header and data)
+	uint32 time_us;								// elapsed time
+} spi_cost_t;
+
+typedef struct
+{
+	uint16 prescaler;							// SPI clock divider (PCLK2 / prescaler)
+	uint16 writeRate;							// dwt_writetxdata() throughput (bytes/us x 100)
+	uint16 readRate;							// dwt_readrxdata() throughput (bytes/us x 100)
+} spi_bench_t;
+
+typedef struct
+{
+	uint32 eventRate;							// events/s through reserve/commit/get/release
+	uint32 copyRate;							// events/s when each event is copied into and out of the queue
+	uint16 bytesPerEvent;						// event bytes copied per event (0: built in place)
+	uint16 bytesPerEventCopy;					// event bytes copied per event by the by-value queue
+} ev_bench_t;
+
 typedef struct {
                 uint8 PGdelay;
 
@@ -428,12 +684,28 @@ typedef struct
 	//timeouts and delays
 	int tagSleepTime_ms; //in milliseconds
 	int tagBlinkSleepTime_ms;
+	int tagSleepBase_ms; //ranging period set by the application (tagSleepTime_ms is a multiple of it or of the superframe)
+
+	//adaptive ranging rate (Tag)
+	uint8  rateDiv ;				// the Tag ranges once every rateDiv periods
+	double rateLastRange ;			// last range used by the rate controller (< 0 if none)
+	uint32 rateLastTime ;			// time of the last range (ms)
 	//this is the delay used for the delayed transmit (when sending the ranging init, response, and final messages)
 	uint64 rnginitReplyDelay ;
 	uint64 finalReplyDelay ;
 	uint64 responseReplyDelay ;
 	int finalReplyDelay_ms ;
 
+	//turn-around times (self-calibrated when TURNAROUND_CALIB is set)
+	uint16 ancTurnAround_us ;		// anchor: poll RX to response TX (after the poll frame)
+	uint16 tagTurnAround_us ;		// Tag: response RX to final TX (after the response frame)
+	uint32 ancRespDly_us ;			// Tag: anchor response delay given in the ranging init (0 until received)
+	uint32 turnLatMax_us ;			// worst latency measured from the frame RX timestamp to the TX start
+	uint16 turnSaved_us ;			// turn-around time replaced by the calibration (0 if none), restored on a late TX
+	uint16 preamble_us ;			// preamble + SFD duration (the RX/TX timestamp is this long after the frame start)
+	uint32 rxcbLatMax_us ;			// worst latency measured from the frame RX timestamp to the start of the RX callback
+	uint8  turnCalibCount ;			// latencies measured so far (calibration is done at TURNAROUND_CALIB_SAMPLES)
+
 	// xx_sy the units are 1.0256 us
 	uint32 txToRxDelayAnc_sy ;    // this is the delay used after sending a response and turning on the receiver to receive final
 	uint32 txToRxDelayTag_sy ;    // this is the delay used after sending a poll and turning on the receiver to receive response
@@ -458,12 +730,20 @@ typedef struct
 #else
 	srd_msg_dlss rng_initmsg ;  // ranging init message (destination long, source short)
     srd_msg_dsss msg ;			// simple 802.15.4 frame structure (used for tx message) - using short addresses
+#endif
+#if (BROADCAST_POLL == 1)
+#if (USING_64BIT_ADDR == 1)
+	srd_msg_dssl bcmsg ;		// broadcast poll/final message (destination short 0xFFFF, source long)
+#else
+	srd_msg_dsss bcmsg ;		// broadcast poll/final message (destination short 0xFFFF, source short)
+#endif
 #endif
 	iso_IEEE_EUI64_blink_msg blinkmsg ; // frame structure (used for tx blink message)
 
 //messages used in "fast" ranging ...
 	srd_msg_dlss rnmsg ; // ranging init message structure
 	srd_msg_dsss msg_f ; // ranging message with 16-bit addresses - used for "fast" ranging
+	uint8   shortAddrRanging ;		// 1 when msg_f (16-bit addresses) is used for the poll/response/final instead of msg
 
 	//Tag function address/message configuration
 	uint8   eui64[8];				// devices EUI 64-bit address
@@ -491,6 +771,27 @@ typedef struct
 
 	uint32 anchResp1RxTime32l ;		// response 1 rx time - low 32 bits
 
+	//broadcast poll (one poll - many responses)
+	uint32 respSlot_us ;			// duration of one anchor response slot after a broadcast poll
+	uint8  anchorIndex ;			// anchor: response slot of this anchor (0 to ANCHOR_LIST_SIZE-1)
+	uint8  respRxMask ;				// tag: bit i set when the response of anchor i has been received
+	uint64 anchRespRxTime[ANCHOR_LIST_SIZE] ; // tag: receive time of the response of each anchor
+#if (BROADCAST_POLL == 1)
+	uint8  anchTofMask ;			// tag: bit i set when anchTof[i] holds a range of this wake-up
+	uint8  anchDistMask ;			// tag: bit i set when anchDist[i] holds a reported range
+	int64  anchTof[ANCHOR_LIST_SIZE] ; // tag: ToF sent in the response of each anchor (indexed by response slot)
+	uint16 anchAddr[ANCHOR_LIST_SIZE] ; // tag: address of the anchor in each response slot
+	double anchDist[ANCHOR_LIST_SIZE] ; // tag: last reported range with each anchor (m)
+#endif
+
+	//burst ranging (several exchanges per wake-up)
+	uint8  burstCount ;				// tag: polls sent since the wake-up
+	uint8  burstTofNum ;			// tag: ranges received in the current burst
+	uint16 burstAnchAddr ;			// tag: anchor the ranges of the burst come from
+	int64  burstTof[TAG_BURST_MAX] ; // tag: ToF of each range of the burst (signed)
+	uint64 burstRefTime ;			// tag: end of the last exchange (final TX or SS-TWR response RX time)
+	uint64 burstGap ;				// tag: delay from burstRefTime to the next poll of the burst
+
 	//application control parameters
     uint8	wait4ack ;				// if this is set to DWT_RESPONSE_EXPECTED, then the receiver will turn on automatically after TX completion
 	uint8   instToSleep;			// if set the instance will go to sleep before sending the blink/poll message
@@ -502,6 +803,8 @@ typedef struct
     //uint8	deviceissleeping;		// this disabled reading/writing to DW1000 while it is in sleep mode
 									// (DW1000 will wake on chip select so need to disable and chip select line activity)
 	uint8	gotTO;					// got timeout event
+	uint8	dblBuffOn;				// double receive buffer (and automatic receiver re-enable) is in use
+	uint8	rxOn;					// double buffer mode: the receiver was re-enabled automatically after the last frame (no need to enable it)
 
 	uint8   responseRxNum;			// response number
 
@@ -509,13 +812,16 @@ typedef struct
     //diagnostic counters/data, results and logging
     int32 tof32 ;
     int64 tof ;
-    double clockOffset ;
+    double clockOffset ;			// tag: clock offset of the anchor in ppm (from the carrier integrator, SS-TWR)
+    int32 carrierIntegrator ;		// tag: carrier integrator read on reception of the SS-TWR response
 
     uint32 blinkRXcount ;
 	int txmsgcount;
 	int	rxmsgcount;
 	int lateTX;
 	int lateRX;
+	int evQueueOverflows;			// events dropped because the event queue was full
+	evq_stats_t evqStats;			// event queue telemetry (see instance_get_evqstats())
 
     double adist[RTD_MED_SZ] ;
     double adist4[4] ;
@@ -543,10 +849,38 @@ typedef struct
 
 
 	uint8 tagToRangeWith;	//it is the index of the tagList array which contains the address of the Tag we are ranging with
-    uint8 tagListLen ;
+    uint8 tagListLen ;				// highest used slot + 1
     uint8 anchorListIndex ;
-	uint8 tagList[TAG_LIST_SIZE][8];
-
+	uint8 tagList[SF_SLOTS][8];		// indexed by superframe slot
+
+	//blink discovery
+	uint32 randSeed ;				// random number generator state (blink jitter)
+	uint16 blinkAttempts ;			// tag: blinks sent since the last ranging init
+	uint32 ttfrStart ;				// tag: time of the first blink (ms)
+	int    ttfr_ms ;				// tag: time from the first blink to the first range (-1 until ranging)
+	admit_entry_t admitQueue[ADMIT_QUEUE_SIZE]; // anchor: Tags waiting for a ranging init, in order
+	uint8  admitQueueLen ;
+	uint8  admitQueuePeak ;			// anchor: most Tags waiting at the same time
+	uint16 admitCount ;				// anchor: ranging inits sent
+	uint32 admitWaitMax_ms ;		// anchor: longest time from the first blink of a Tag to its ranging init
+
+	//superframe (TDMA) scheduling
+	uint16 slotDuration_ms ;	// duration of one Tag slot
+	uint16 sfPeriod_ms ;		// superframe period (SF_SLOTS slots) - this is the ranging period of each Tag
+	uint32 sfStartTime ;		// anchor: superframe reference time (start of slot 0)
+	uint8  tagSlot ;			// tag: slot given by the anchor in the ranging init message
+	uint32 sfIndex ;			// anchor: index of the superframe the ranges are counted in
+	uint16 sfRangeCount ;		// anchor: ranges completed in the current superframe
+	uint16 sfRangeCountLast ;	// anchor: ranges completed in the previous superframe
+	uint8  rxPartition ;		// channel/preamble code partition the device is tuned to
+
+	//SPI cost of the device (re)configuration
+	spi_cost_t cfgSpiCost ;		// last dwt_configure() / dwt_reconfigure()
+	spi_cost_t wakeSpiCost ;	// last re-initialisation after deep sleep
+	dwt_spistats_t spiCostStart ;
+	uint32 spiCostCycles ;
+	uint32 partSwitchCount ;	// anchor: receiver re-tunes between partitions
+	uint32 rxForeignCount ;		// anchor: frames dropped from their header (header-first receive)
 
 	//event queue - used to store DW1000 events as they are processed by the dw_isr/callback functions
     event_data_t dwevent[MAX_EVENT_NUMBER]; //this holds any TX/RX events and associated message data
@@ -554,18 +888,43 @@ typedef struct
     uint8 dweventIdxOut;
     uint8 dweventIdxIn;
 	uint8 dweventPeek;
+	uint8 dweventHeld;		// slot of the event the state machine is processing (MAX_EVENT_NUMBER if none)
 	uint8 monitor;
 	uint32 timeofTx ;
 	int dwIDLE;
 
 } instance_data_t ;
 
+//frame (and its message data) used for the poll/response/final: msg_f once 16-bit addresses have been negotiated
+#if (SHORT_ADDR_RANGING == 1)
+#define RNG_MSG(inst)           ((inst)->shortAddrRanging ? (uint8 *) &(inst)->msg_f : (uint8 *) &(inst)->msg)
+#define RNG_MSG_DATA(inst)      ((inst)->shortAddrRanging ? &(inst)->msg_f.messageData[0] : &(inst)->msg.messageData[0])
+#else
+#define RNG_MSG(inst)           ((uint8 *) &(inst)->msg)
+#define RNG_MSG_DATA(inst)      (&(inst)->msg.messageData[0])
+#endif
+
 typedef struct
 {
 
 	int (*testapprun_fn)(instance_data_t *inst, int message);
+	uint16 rxPrefetchHdr;		// header-first prefetch length (see instance_setrxprefetch())
 
 } instance_localdata_t ;
+
+// -------------------------------------------------------------------------------------------------------------------
+// instance context: the instance API applies to the current instance and its DW1000, selected with
+// instance_setcontext() (e.g. many Tag and Anchor state machines run in turn in one host process). With a single
+// instance the index is the constant 0, so the firmware code is the same as with a fixed instance_data[0].
+#if (NUM_INST > 1)
+extern int instance_current;
+#define INST_CURRENT				instance_current
+int instance_setcontext(int index);
+#else
+#define INST_CURRENT				(0)
+#define instance_setcontext(index)	dwt_setlocaldataptr(index)
+#endif
+#define instance_getcontext()		(&instance_data[INST_CURRENT])	// handle of the current instance
 //-------------------------------------------------------------------------------------------------------------
 //
 //	Functions used in logging/displaying range and status data
@@ -574,12 +933,37 @@ typedef struct
 
 // function to calculate and report the Time of Flight to the GUI/display
 void reportTOF(instance_data_t *inst);
+// broadcast poll: report the range with each anchor that responded (reportTOF() is given the first response slot)
+void instreportbctof(instance_data_t *inst);
+// add the ToF just received to the ranges of the burst / get the median ToF of the burst
+void instburstaddtof(instance_data_t *inst, uint16 anchAddr);
+int64 instburstmediantof(instance_data_t *inst);
+// adapt the Tag ranging period (tagSleepTime_ms) after a wake-up, newRange is set if a range was reported
+void instadapttagrate(instance_data_t *inst, int newRange);
 // clear the status/ranging data 
 void instanceclearcounts(void) ;
 void instcleartaglist(void);
 void instsettagtorangewith(int tagID);
 int instaddtagtolist(instance_data_t *inst, uint8 *tagAddr);
 int istaginlist(instance_data_t *inst, uint8 *tagAddr);
+int insttagslot(instance_data_t *inst, uint8 *srcAddr, int addrLen);
+// blink discovery: jittered/backed-off blink period, anchor admission queue
+uint32 instrand(instance_data_t *inst);
+int instblinkperiod(instance_data_t *inst);
+int instadmitcanreply(instance_data_t *inst, uint8 *tagAddr);
+void instadmitqueue(instance_data_t *inst, uint8 *tagAddr);
+void instadmitdone(instance_data_t *inst, uint8 *tagAddr);
+uint16 instgetsfphase(instance_data_t *inst);
+void instcountsfrange(instance_data_t *inst);
+// channel/preamble code partitions
+int instslotpartition(int slot);
+void instsetpartition(instance_data_t *inst, int partition);
+void instanchorpartition(instance_data_t *inst);
+// SPI cost of a sequence of register accesses
+void instspicostbegin(instance_data_t *inst);
+void instspicostend(instance_data_t *inst, spi_cost_t *cost);
+void instspibenchmark(spi_bench_t *result);
+void instevbenchmark(ev_bench_t *result);
 
 void instance_readaccumulatordata(void);
 //-------------------------------------------------------------------------------------------------------------
@@ -596,6 +980,7 @@ void instance_close(void);
 // Call init, then call config, then call run. call close when finished
 // initialise the instance (application) structures and DW1000 device
 int instance_init(void);
+int instance_reinit(void); // re-initialise the instance structures only (no DW1000 reset)
 int instance_init_s(int mode);
 
 // configure the instance and DW1000 device
@@ -609,6 +994,7 @@ int instancesendpacket(uint16 length, uint8 txmode, uint32 dtime);
 
 // called (periodically or from and interrupt) to process any outstanding TX/RX events and to drive the ranging application
 int instance_run(void) ;       // returns indication of status report change
+uint32 instance_idletime(void) ; // ticks the main loop can sleep before instance_run() has something to do
 int testapprun(instance_data_t *inst, int message);
 
 void instance_setapprun(int (*apprun_fn)(instance_data_t *inst, int message));
@@ -617,10 +1003,19 @@ void instance_setapprun(int (*apprun_fn)(instance_data_t *inst, int message));
 #define instance_process_irq(x) 	dwt_isr()  //call device interrupt handler
 // configure TX/RX callback functions that are called from DW1000 ISR
 void instance_rxcallback(const dwt_callback_data_t *rxd);
+void instance_setrxprefetch(int mode); //set how dwt_isr() prefetches the frames for instance_rxcallback()
 void instance_txcallback(const dwt_callback_data_t *txd);
 
 // sets the Tag sleep delay time (the time Tag "sleeps" between each ranging attempt)
 void instancesettagsleepdelay(int rangingsleep, int blinkingsleep);
+// turn-around calibration: measure the latency from a frame's RX timestamp (hi 32 bits) to now, just before the TX
+void instturnaroundcalib(instance_data_t *inst, uint32 rxTime32h);
+// turn-around calibration: a delayed reply was late, restore the turn-around time used before the calibration
+void instturnaroundlate(instance_data_t *inst);
+// sets the response (anchor) and final (Tag) delays from the current turn-around times
+void instsetreplydelays(instance_data_t *inst);
+// sets the anchor response slot used to respond to a broadcast poll (call before instance_init_timings)
+void instancesetanchorindex(int index);
 void instancesetreplydelay(int datalength);
 
 // Pre-compute frame lengths, timeouts and delays needed in ranging process.
@@ -641,10 +1036,23 @@ double instance_get_idist(void);
 double instance_get_idistraw(void);
 int instance_get_lcount(void);
 
+// Superframe range rates, in ranges per second:
+// - guaranteed aggregate rate with numtags Tags registered (numtags * 1000 / sfPeriod_ms)
+// - rate measured by the anchor over the last complete superframe
+// The slot/superframe figures quoted for the TDMA scheduler were computed from instance_init_timings(), they have not been
+// measured on hardware: read instance_get_sfrangerate() on the board for the real rate.
+double instance_get_tdmarangerate(int numtags);
+double instance_get_sfrangerate(void);
+
 uint64 instance_get_addr(void); //get own address (8 bytes)
 uint64 instance_get_tagaddr(void); //get tag address (8 bytes)
 uint64 instance_get_anchaddr(void); //get anchor address (that sent the ToF)
 
+// broadcast poll: ranges with each anchor, indexed by response slot, valid when the bit of the slot is set in the mask
+int instance_get_bcrangemask(void);
+double instance_get_bcrange(int slot);
+int instance_get_bcrangeaddr(int slot);
+
 int instancenewrangeancadd(void);
 int instancenewrangetagadd(void);
 int instancenewrange(void);
@@ -662,11 +1070,21 @@ int instance_get_respPSC(void);
 
 int instance_get_txl(void) ;
 int instance_get_rxl(void) ;
+int instance_get_rxovrr(void) ; //get number of receiver overruns (double buffer mode)
+int instance_get_ttfr(void) ; //tag: get time from first blink to first range in ms (-1 if not ranging yet)
+int instance_get_admitpeak(void) ; //anchor: get most Tags waiting for a ranging init at the same time
+int instance_get_admitwaitmax(void) ; //anchor: get longest wait (ms) from first blink to ranging init
+int instance_get_evqlost(void) ; //get number of events lost because the event queue was full
+void instance_get_evqstats(evq_stats_t *stats) ; //get the event queue telemetry (counts per type, depth, latency)
+void instance_get_spicost(spi_cost_t *cfg, spi_cost_t *wake) ; //get SPI transactions, bytes and time of the last configuration and wake-up
+int instance_get_partswitch(void) ; //anchor: get number of receiver re-tunes between channel/preamble code partitions
+int instance_get_rxforeign(void) ; //anchor: get number of frames dropped from their header (header-first receive)
 
 uint32 convertmicrosectodevicetimeu32 (double microsecu);
 uint64 convertmicrosectodevicetimeu (double microsecu);
 double convertdevicetimetosec(int32 dt);
 double convertdevicetimetosec8(uint8* dt);
+double instcarrierintegratortoppm(instance_data_t *inst, int32 carrierIntegrator);
 
 #define DWT_PRF_64M_RFDLY   (514.462f)
 #define DWT_PRF_16M_RFDLY   (513.9067f)
@@ -680,9 +1098,11 @@ int testapprun_tf(instance_data_t *inst, int message);
 
 int instance_peekevent(void);
 
-void instance_putevent(event_data_t newevent);
+event_data_t* instance_reserveevent(void);
+void instance_commitevent(event_data_t *dw_event, uint8 type);
 
 event_data_t* instance_getevent(int x);
+void instance_releaseevent(void);
 
 void instance_clearevents(void);
 
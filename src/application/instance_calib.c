@@ -170,8 +170,8 @@ int powertest(void)
 int instance_startcwmode(int chan)
 {
 	//NOTE: SPI frequency must be < 3MHz
-	//reduce the SPI speed before switching to XTAL
-	SPI_ConfigFastRate(SPI_BaudRatePrescaler_32); //reduce SPI to < 3MHz
+	//reduce the SPI speed before switching to XTAL (it stays there until the device is re-initialised)
+	port_SPIx_clockstate(DW_CLK_XTI);
 
 	dwt_configcwmode(chan);
 
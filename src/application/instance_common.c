@@ -32,6 +32,32 @@ instance_data_t instance_data[NUM_INST] ;
 
 instance_localdata_t instance_localdata[NUM_INST] ;
 
+#if (NUM_INST > 1)
+int instance_current = 0;
+
+// select the instance (and its DW1000) the following calls apply to
+// returns 0 on success and -1 on error (index out of range, DW1000 SPI batch open)
+int instance_setcontext(int index)
+{
+	if((index < 0) || (index >= NUM_INST) || (dwt_setlocaldataptr(index) != DWT_SUCCESS))
+	{
+		return -1;
+	}
+
+	instance_current = index;
+
+	return 0;
+}
+#endif
+
+//events are built in place in the queue: instance_reserveevent() gives the free slot at its input (dwt_isr() also
+//prefetches the good frames straight into it, see instance_rxtarget()), or this sink when the queue is full - the event
+//is then dropped and counted when it is committed
+static event_data_t dw_sinkevent;
+//returned by instance_getevent() when there is no event
+static const event_data_t dw_noevent;
+static void instance_rxtarget(void);
+
 //int eventOutcount = 0;
 //int eventIncount = 0;
 
@@ -92,17 +118,47 @@ double convertdevicetimetosec8(uint8* dt)
     return f ;
 }
 
+// -------------------------------------------------------------------------------------------------------------------
+// convert the carrier integrator value to the clock offset (in ppm) of the remote device, for the configured
+// data rate and channel
+double instcarrierintegratortoppm(instance_data_t *inst, int32 carrierIntegrator)
+{
+    double hz;
 
-void reportTOF(instance_data_t *inst)
+    if(inst->configData.dataRate == DWT_BR_110K)
+    {
+        hz = carrierIntegrator * DWT_FREQ_OFFSET_MULTIPLIER_110KB;
+    }
+    else
+    {
+        hz = carrierIntegrator * DWT_FREQ_OFFSET_MULTIPLIER;
+    }
+
+    switch(inst->configData.chan)
+    {
+        case 1:
+            return hz * DWT_HERTZ_TO_PPM_MULTIPLIER_CHAN_1;
+        case 3:
+            return hz * DWT_HERTZ_TO_PPM_MULTIPLIER_CHAN_3;
+        case 5:
+        case 7:
+            return hz * DWT_HERTZ_TO_PPM_MULTIPLIER_CHAN_5;
+        case 2:
+        case 4:
+        default:
+            return hz * DWT_HERTZ_TO_PPM_MULTIPLIER_CHAN_2;
+    }
+}
+
+
+// convert a (40-bit) ToF to a distance, the raw distance (without range bias correction) is returned in rawDistance
+static double insttoftodistance(instance_data_t *inst, int64 tofi, double *rawDistance)
 {
         double distance ;
         double distance_to_correct ;
         double tof ;
-        double ltave;
-        int64 tofi ;
 
         // check for negative results and accept them making them proper negative integers
-        tofi = inst->tof ;                          // make it signed
         if (tofi > 0x007FFFFFFFFF)                          // MP counter is 40 bits,  close up TOF may be negative
         {
             tofi -= 0x010000000000 ;                       // subtract fill 40 bit range to make it negative
@@ -110,7 +166,7 @@ void reportTOF(instance_data_t *inst)
 
         // convert to seconds (as floating point)
         tof = convertdevicetimetosec(tofi);          //this is divided by 4 to get single time of flight
-        inst_idistraw = distance = tof * SPEED_OF_LIGHT;
+        *rawDistance = distance = tof * SPEED_OF_LIGHT;
 
 #if (CORRECT_RANGE_BIAS == 1)
         //for the 6.81Mb data rate we assume gating gain of 6dB is used,
@@ -135,6 +191,16 @@ void reportTOF(instance_data_t *inst)
         distance = distance - dwt_getrangebias(inst->configData.chan, (float) distance_to_correct, inst->configData.prf);
 #endif
 
+        return distance;
+}
+
+void reportTOF(instance_data_t *inst)
+{
+        double distance ;
+        double ltave;
+
+        distance = insttoftodistance(inst, inst->tof, &inst_idistraw);
+
         if ((distance < 0) || (distance > 20000.000))    // discount any items with error
 		{
             return;
@@ -180,36 +246,245 @@ void reportTOF(instance_data_t *inst)
 
 // -------------------------------------------------------------------------------------------------------------------
 //
-// function to select the destination address (e.g. the address of the next anchor to poll)
+// broadcast poll: each anchor's response carries the ToF of its own exchange with the Tag, keep a range per anchor
 //
+void instreportbctof(instance_data_t *inst)
+{
+#if (BROADCAST_POLL == 1)
+	double raw;
+	int k, first = -1;
+
+	inst->anchDistMask = 0;
+
+	for(k = 0; k < ANCHOR_LIST_SIZE; k++)
+	{
+		if(inst->anchTofMask & (1 << k))
+		{
+			if((inst->burstTofNum > 1) && (inst->anchAddr[k] == inst->burstAnchAddr)) //median of the burst with this anchor
+			{
+				inst->anchTof[k] = instburstmediantof(inst);
+			}
+
+			inst->anchDist[k] = insttoftodistance(inst, inst->anchTof[k], &raw);
+
+			if((inst->anchDist[k] >= 0) && (inst->anchDist[k] <= 20000.000))
+			{
+				inst->anchDistMask |= (1 << k);
+			}
+
+			if(first < 0)
+			{
+				first = k;
+			}
+		}
+	}
+
+	if(first >= 0) //the first response slot is the range of the display/average
+	{
+		inst->tof = inst->anchTof[first];
+		inst->newrangeancaddress = inst->anchAddr[first];
+		reportTOF(inst);
+	}
+
+	inst->anchTofMask = 0;
+#else
+	reportTOF(inst);
+#endif
+}
+
+// -------------------------------------------------------------------------------------------------------------------
+//
+// burst ranging: keep the ToF of each range of the burst (only the ranges with the first anchor of the burst are kept)
+//
+void instburstaddtof(instance_data_t *inst, uint16 anchAddr)
+{
+	int64 tofi = inst->tof;
+
+	if(tofi > 0x007FFFFFFFFF) //40-bit ToF - close up it may be negative
+	{
+		tofi -= 0x010000000000;
+	}
+
+	if(inst->burstTofNum == 0)
+	{
+		inst->burstAnchAddr = anchAddr;
+	}
+	else if((inst->burstAnchAddr != anchAddr) || (inst->burstTofNum == TAG_BURST_MAX))
+	{
+		return;
+	}
+
+	inst->burstTof[inst->burstTofNum++] = tofi;
+}
+
 // -------------------------------------------------------------------------------------------------------------------
 //
+// adaptive Tag ranging rate: range fast when at the door or moving, slow down when stationary or far away
+//
+void instadapttagrate(instance_data_t *inst, int newRange)
+{
+#if (ADAPTIVE_TAG_RATE == 1)
+	uint32 now = portGetTickCount();
+	int fast = 0;
+
+	if(newRange)
+	{
+		if(inst_idist <= RATE_NEAR_RANGE_M) //in the access zone
+		{
+			fast = 1;
+		}
+		else if((inst->rateLastRange >= 0) && (inst_idist < RATE_FAR_RANGE_M) && (now != inst->rateLastTime))
+		{
+			double dr = inst_idist - inst->rateLastRange;
+
+			if(dr < 0)
+			{
+				dr = -dr;
+			}
+			fast = ((dr * 1000.0) >= (RATE_MOVING_MPS * (now - inst->rateLastTime)));
+		}
+
+		inst->rateLastRange = inst_idist;
+		inst->rateLastTime = now;
+	}
+
+	if(fast)
+	{
+		inst->rateDiv = 1;
+	}
+	else if(inst->rateDiv < RATE_MAX_DIV)
+	{
+		inst->rateDiv++;
+	}
+
+	//keep a multiple of the superframe so the Tag still wakes up at the start of its slot
+	inst->tagSleepTime_ms = (inst->sfPeriod_ms ? inst->sfPeriod_ms : inst->tagSleepBase_ms) * inst->rateDiv;
+#endif
+}
+
+// -------------------------------------------------------------------------------------------------------------------
+//
+// turn-around calibration: called just before the response (anchor) or final (Tag) TX is started, with the RX time of
+// the frame it replies to. After TURNAROUND_CALIB_SAMPLES the worst latency plus a margin becomes the turn-around time.
+//
+void instturnaroundcalib(instance_data_t *inst, uint32 rxTime32h)
+{
+	uint32 lat_us = SYSTIME32H_TO_US(dwt_readsystimestamphi32() - rxTime32h);
+	int32 turn_us;
+
+	if(lat_us > inst->turnLatMax_us)
+	{
+		inst->turnLatMax_us = lat_us;
+	}
+
+	if(++inst->turnCalibCount < TURNAROUND_CALIB_SAMPLES)
+	{
+		return;
+	}
+
+	//the latency is counted from the RX timestamp (RMARKER, after the preamble and SFD) and the reply's TX timestamp is
+	//its own RMARKER: the TX has to be started a whole preamble before it. The reply delay is the turn-around time plus
+	//the length of the received frame, so only the PHR and payload of that frame come off the turn-around time.
+	turn_us = (int32)(inst->turnLatMax_us + TURNAROUND_MARGIN_US + inst->preamble_us);
+	if(inst->mode == ANCHOR)
+	{
+		turn_us -= (int32)inst->fl_us[POLL];
+		inst->turnSaved_us = inst->ancTurnAround_us;
+		inst->ancTurnAround_us = (turn_us < ANC_TURN_AROUND_MIN_US) ? ANC_TURN_AROUND_MIN_US : turn_us;
+	}
+	else
+	{
+		turn_us -= (int32)inst->fl_us[RESP];
+		inst->turnSaved_us = inst->tagTurnAround_us;
+		inst->tagTurnAround_us = (turn_us < TAG_TURN_AROUND_MIN_US) ? TAG_TURN_AROUND_MIN_US : turn_us;
+	}
+
+	instsetreplydelays(inst);
+}
+
+// a delayed reply was late: give up the calibrated turn-around time (it is not calibrated again)
+void instturnaroundlate(instance_data_t *inst)
+{
+	if(inst->turnSaved_us == 0)
+	{
+		return;
+	}
+
+	if(inst->mode == ANCHOR)
+	{
+		inst->ancTurnAround_us = inst->turnSaved_us;
+	}
+	else
+	{
+		inst->tagTurnAround_us = inst->turnSaved_us;
+	}
+
+	inst->turnSaved_us = 0;
+	instsetreplydelays(inst);
+}
+
+// returns the median ToF of the burst (the ranges are sorted in place)
+int64 instburstmediantof(instance_data_t *inst)
+{
+	int i, j;
+	int64 x;
+
+	for(i = 1; i < inst->burstTofNum; i++) //insertion sort - at most TAG_BURST_MAX ranges
+	{
+		x = inst->burstTof[i];
+		for(j = i; (j > 0) && (inst->burstTof[j-1] > x); j--)
+		{
+			inst->burstTof[j] = inst->burstTof[j-1];
+		}
+		inst->burstTof[j] = x;
+	}
+
+	if(inst->burstTofNum & 1)
+	{
+		return inst->burstTof[inst->burstTofNum >> 1];
+	}
+
+	return (inst->burstTof[(inst->burstTofNum >> 1) - 1] + inst->burstTof[inst->burstTofNum >> 1]) / 2;
+}
+
+// -------------------------------------------------------------------------------------------------------------------
+//
+// function to select the destination address (e.g. the address of the next anchor to poll)
+//
+// -------------------------------------------------------------------------------------------------------------------
+// returns the index of the Tag in the list (this is also its slot in the superframe) or SF_SLOTS if the list is full
 int instaddtagtolist(instance_data_t *inst, uint8 *tagAddr)
 {
-    uint8 i;
+    int i, k;
     uint8 blank[8] = {0, 0, 0, 0, 0, 0, 0, 0};
 
     inst->blinkRXcount++ ;
 
-    //add the new Tag to the list, if not already there and there is space
-    for(i=0; i<TAG_LIST_SIZE; i++)
+    for(i=0; i<inst->tagListLen; i++)
     {
-        if(memcmp(&inst->tagList[i][0], &tagAddr[0], 8) != 0)
+        if(memcmp(&inst->tagList[i][0], &tagAddr[0], 8) == 0)
         {
-            if(memcmp(&inst->tagList[i][0], &blank[0], 8) == 0) //blank entry
+            return i; //we already have this Tag in the list
+        }
+    }
+
+    //add the new Tag to the first blank entry, going round the partitions so that they fill evenly
+    for(k=0; k<SF_SLOTS; k++)
+    {
+        i = ((k % RX_PARTITIONS) * TAG_LIST_SIZE) + (k / RX_PARTITIONS);
+
+        if(memcmp(&inst->tagList[i][0], &blank[0], 8) == 0) //blank entry
+        {
+            memcpy(&inst->tagList[i][0], &tagAddr[0], 8) ;
+            if(i >= inst->tagListLen)
             {
-                memcpy(&inst->tagList[i][0], &tagAddr[0], 8) ;
                 inst->tagListLen = i + 1 ;
-                break;
             }
-        }
-        else
-        {
-            break; //we already have this Tag in the list
+            return i;
         }
     }
 
-    return 0;
+    return SF_SLOTS;
 }
 
 int istaginlist(instance_data_t *inst, uint8 *tagAddr)
@@ -220,7 +495,7 @@ int istaginlist(instance_data_t *inst, uint8 *tagAddr)
     inst->blinkRXcount++ ;
 
     //add the new Tag to the list, if not already there and there is space
-    for(i=0; i<TAG_LIST_SIZE; i++)
+    for(i=0; i<SF_SLOTS; i++)
     {
         if(memcmp(&inst->tagList[i][0], &tagAddr[0], 8) != 0)
         {
@@ -235,31 +510,449 @@ int istaginlist(instance_data_t *inst, uint8 *tagAddr)
         }
     }
 
-    return 0;
+    return 0;
+}
+
+// -------------------------------------------------------------------------------------------------------------------
+//
+// function to find the superframe slot of a Tag from the source address of its ranging messages
+// returns SF_SLOTS if the Tag has not been registered
+//
+// -------------------------------------------------------------------------------------------------------------------
+//
+int insttagslot(instance_data_t *inst, uint8 *srcAddr, int addrLen)
+{
+#if (USING_64BIT_ADDR==1)
+    uint8 i;
+
+    if(addrLen == ADDR_BYTE_SIZE_L)
+    {
+        for(i=0; i<inst->tagListLen; i++)
+        {
+            if(memcmp(&inst->tagList[i][0], &srcAddr[0], 8) == 0)
+            {
+                return i;
+            }
+        }
+
+        return SF_SLOTS;
+    }
+#endif
+#if (BROADCAST_POLL == 1)
+    //the short address given in the ranging init message is the 2 LSBs of the Tag's EUI (see BC_COORD_INDEX)
+    {
+        int k;
+
+        for(k=0; k<inst->tagListLen; k++)
+        {
+            if((inst->tagList[k][0] == srcAddr[0]) && (inst->tagList[k][1] == srcAddr[1]))
+            {
+                return k;
+            }
+        }
+    }
+#else
+    //the short address given in the ranging init message is the anchor part ID (high byte) and the Tag's slot (low byte)
+    if((srcAddr[1] == (dwt_getpartid() & 0xFF)) && (srcAddr[0] < inst->tagListLen))
+    {
+        return srcAddr[0];
+    }
+#endif
+
+    return SF_SLOTS;
+}
+
+// -------------------------------------------------------------------------------------------------------------------
+// random number (xorshift32), seeded on first use from the EUI and the DW1000 system time (which differs between
+// devices powered up together as it depends on their crystal start-up)
+uint32 instrand(instance_data_t *inst)
+{
+    uint32 x = inst->randSeed;
+
+    if(x == 0)
+    {
+        x = dwt_readsystimestamphi32() ^ (inst->eui64[0] | (inst->eui64[1] << 8) | (inst->eui64[2] << 16) | (inst->eui64[3] << 24));
+        if(x == 0)
+        {
+            x = 0xDECA;
+        }
+    }
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    inst->randSeed = x;
+
+    return x;
+}
+
+// -------------------------------------------------------------------------------------------------------------------
+// time to the next blink (ms): the blink period plus a random jitter, the jitter window doubles with each blink
+// that has not been answered
+int instblinkperiod(instance_data_t *inst)
+{
+    int exp = (inst->blinkAttempts > BLINK_BACKOFF_MAX_EXP) ? BLINK_BACKOFF_MAX_EXP : inst->blinkAttempts;
+
+    return inst->tagBlinkSleepTime_ms + (instrand(inst) % ((BLINK_JITTER_MS << exp) + 1));
+}
+
+// -------------------------------------------------------------------------------------------------------------------
+// anchor admission queue
+//
+// drop the Tags not heard for ADMIT_HOLD_MS (they have given up or found another anchor)
+static void instadmitexpire(instance_data_t *inst, uint32 now)
+{
+    int i, j = 0;
+
+    for(i = 0; i < inst->admitQueueLen; i++)
+    {
+        if((now - inst->admitQueue[i].lastHeard) <= ADMIT_HOLD_MS)
+        {
+            inst->admitQueue[j++] = inst->admitQueue[i];
+        }
+    }
+    inst->admitQueueLen = j;
+}
+
+static int instadmitfind(instance_data_t *inst, uint8 *tagAddr)
+{
+    int i;
+
+    for(i = 0; i < inst->admitQueueLen; i++)
+    {
+        if(memcmp(&inst->admitQueue[i].tagAddr[0], tagAddr, BLINK_FRAME_SOURCE_ADDRESS) == 0)
+        {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+// add a Tag we could not answer to the queue (or refresh it if already there)
+void instadmitqueue(instance_data_t *inst, uint8 *tagAddr)
+{
+    uint32 now = portGetTickCount();
+    int i;
+
+    instadmitexpire(inst, now);
+
+    i = instadmitfind(inst, tagAddr);
+    if(i < 0)
+    {
+        if(inst->admitQueueLen == ADMIT_QUEUE_SIZE) //full - the Tag will be queued on a later blink
+        {
+            return;
+        }
+        i = inst->admitQueueLen++;
+        memcpy(&inst->admitQueue[i].tagAddr[0], tagAddr, BLINK_FRAME_SOURCE_ADDRESS);
+        inst->admitQueue[i].firstHeard = now;
+
+        if(inst->admitQueueLen > inst->admitQueuePeak)
+        {
+            inst->admitQueuePeak = inst->admitQueueLen;
+        }
+    }
+    inst->admitQueue[i].lastHeard = now;
+}
+
+// returns 1 if the blinking Tag can be sent a ranging init now: nobody is waiting or it is the first in the queue,
+// otherwise it is queued behind the Tags already waiting
+int instadmitcanreply(instance_data_t *inst, uint8 *tagAddr)
+{
+    instadmitexpire(inst, portGetTickCount());
+
+    if((inst->admitQueueLen == 0) || (instadmitfind(inst, tagAddr) == 0))
+    {
+        return 1;
+    }
+
+    instadmitqueue(inst, tagAddr);
+    return 0;
+}
+
+// the ranging init has been sent to this Tag - remove it from the queue and record how long it waited
+void instadmitdone(instance_data_t *inst, uint8 *tagAddr)
+{
+    int i = instadmitfind(inst, tagAddr);
+
+    inst->admitCount++;
+
+    if(i < 0)
+    {
+        return;
+    }
+
+    if((portGetTickCount() - inst->admitQueue[i].firstHeard) > inst->admitWaitMax_ms)
+    {
+        inst->admitWaitMax_ms = portGetTickCount() - inst->admitQueue[i].firstHeard;
+    }
+
+    inst->admitQueueLen--;
+    for(; i < inst->admitQueueLen; i++)
+    {
+        inst->admitQueue[i] = inst->admitQueue[i+1];
+    }
+}
+
+// -------------------------------------------------------------------------------------------------------------------
+// get the anchor superframe phase (ms since the start of the current superframe)
+uint16 instgetsfphase(instance_data_t *inst)
+{
+    if(inst->sfPeriod_ms == 0)
+    {
+        return 0;
+    }
+
+    return (uint16) ((portGetTickCount() - inst->sfStartTime) % inst->sfPeriod_ms);
+}
+
+// -------------------------------------------------------------------------------------------------------------------
+// count a completed range in the current superframe (used to measure the anchor range rate)
+void instcountsfrange(instance_data_t *inst)
+{
+    uint32 sfIndex;
+
+    if(inst->sfPeriod_ms == 0)
+    {
+        return;
+    }
+
+    sfIndex = (portGetTickCount() - inst->sfStartTime) / inst->sfPeriod_ms;
+
+    if(sfIndex != inst->sfIndex)
+    {
+        //only keep the count if the previous superframe is the one just finished
+        inst->sfRangeCountLast = (sfIndex == (inst->sfIndex + 1)) ? inst->sfRangeCount : 0;
+        inst->sfRangeCount = 0;
+        inst->sfIndex = sfIndex;
+    }
+
+    inst->sfRangeCount++;
+}
+
+// -------------------------------------------------------------------------------------------------------------------
+// measure the SPI cost (transactions, bytes and elapsed time) of the register accesses done between these two calls
+void instspicostbegin(instance_data_t *inst)
+{
+    dwt_getspistats(&inst->spiCostStart);
+    inst->spiCostCycles = portGetCycleCount();
+}
+
+void instspicostend(instance_data_t *inst, spi_cost_t *cost)
+{
+    dwt_spistats_t stats;
+
+    dwt_getspistats(&stats);
+    cost->transactions = stats.transactions - inst->spiCostStart.transactions;
+    cost->bytes = stats.bytes - inst->spiCostStart.bytes;
+    cost->time_us = (portGetCycleCount() - inst->spiCostCycles) / (SystemCoreClock / 1000000);
+}
+
+// -------------------------------------------------------------------------------------------------------------------
+// SPI throughput of the TX/RX buffer accesses at each prescaler (SPI_BENCH_RATES entries in result)
+// the DW1000 must be initialised and idle with its PLL locked, the SPI governor then restores its rate
+void instspibenchmark(spi_bench_t *result)
+{
+    static const uint16 prescalers[SPI_BENCH_RATES][2] = {
+        {4, SPI_BaudRatePrescaler_4}, {8, SPI_BaudRatePrescaler_8}, {16, SPI_BaudRatePrescaler_16},
+        {32, SPI_BaudRatePrescaler_32}, {64, SPI_BaudRatePrescaler_64}
+    };
+    static uint8 buffer[SPI_BENCH_LEN];
+    uint32 cycles;
+    int i;
+
+    for(i = 0; i < SPI_BENCH_RATES; i++)
+    {
+        SPI_ConfigFastRate(prescalers[i][1]);
+        result[i].prescaler = prescalers[i][0];
+
+        cycles = portGetCycleCount();
+        dwt_writetxdata(SPI_BENCH_LEN + 2, buffer, 0); //the length includes the 2 CRC bytes which are not written
+        cycles = portGetCycleCount() - cycles;
+        result[i].writeRate = (SPI_BENCH_LEN * 100 * (SystemCoreClock / 1000000)) / cycles;
+
+        cycles = portGetCycleCount();
+        dwt_readrxdata(buffer, SPI_BENCH_LEN, 0);
+        cycles = portGetCycleCount() - cycles;
+        result[i].readRate = (SPI_BENCH_LEN * 100 * (SystemCoreClock / 1000000)) / cycles;
+    }
+
+    port_SPIx_clockstate(DW_CLK_PLL); //back to the governed rate
+}
+
+#if (EV_BENCHMARK == 1)
+//reference queue: the event is passed by value, copied into the queue and then out of it (not static so that the
+//copies are not optimised away)
+event_data_t evBenchQueue[MAX_EVENT_NUMBER];
+event_data_t evBenchOut;
+#endif
+
+// -------------------------------------------------------------------------------------------------------------------
+// event queue throughput: EV_BENCH_EVENTS events produced and consumed through the queue (the DW1000 interrupt is
+// masked and the queue is cleared before and after, run it before the ranging starts)
+void instevbenchmark(ev_bench_t *result)
+{
+#if (EV_BENCHMARK == 1)
+    decaIrqStatus_t stat = decamutexon();
+    evq_stats_t stats = instance_data[INST_CURRENT].evqStats; //not counted in the telemetry
+    event_data_t *dw_event;
+    uint32 cycles;
+    int i;
+
+    instance_clearevents();
+
+    cycles = portGetCycleCount();
+    for(i = 0; i < EV_BENCH_EVENTS; i++)
+    {
+        dw_event = instance_reserveevent(); //the frame would be prefetched in place
+        dw_event->rxLength = i;
+        dw_event->type2 = DWT_SIG_RX_OKAY;
+        instance_commitevent(dw_event, DWT_SIG_RX_OKAY);
+
+        dw_event = instance_getevent(0);
+        instance_releaseevent();
+    }
+    cycles = portGetCycleCount() - cycles;
+    result->eventRate = ((uint64)EV_BENCH_EVENTS * SystemCoreClock) / cycles;
+    result->bytesPerEvent = 0;
+
+    cycles = portGetCycleCount();
+    for(i = 0; i < EV_BENCH_EVENTS; i++)
+    {
+        dw_sinkevent.rxLength = i;
+        evBenchQueue[i % MAX_EVENT_NUMBER] = dw_sinkevent;
+        evBenchOut = evBenchQueue[i % MAX_EVENT_NUMBER];
+    }
+    cycles = portGetCycleCount() - cycles;
+    result->copyRate = ((uint64)EV_BENCH_EVENTS * SystemCoreClock) / cycles;
+    result->bytesPerEventCopy = 2 * sizeof(event_data_t); //the argument copy of the by-value call not counted
+
+    instance_clearevents();
+    instance_data[INST_CURRENT].evqStats = stats;
+
+    decamutexoff(stat);
+#endif
+}
+
+// -------------------------------------------------------------------------------------------------------------------
+// get the channel/preamble code partition of a superframe slot (each partition has its own TAG_LIST_SIZE slots)
+int instslotpartition(int slot)
+{
+    return slot / TAG_LIST_SIZE;
+}
+
+// -------------------------------------------------------------------------------------------------------------------
+// re-tune the device to a channel/preamble code partition, only the channel dependent registers and the TX spectrum
+// (power and PG delay) are re-programmed, the transceiver is turned off
+void instsetpartition(instance_data_t *inst, int partition)
+{
+    dwt_config_t config = inst->configData;
+    uint32 power;
+    int step = partition >> 1;
+
+    if(partition == inst->rxPartition)
+    {
+        return;
+    }
+
+    //odd partitions move between channels 2 and 5 (other channels stay on the configured channel)
+    if(partition & 1)
+    {
+        if(config.chan == 2)
+        {
+            config.chan = 5;
+        }
+        else if(config.chan == 5)
+        {
+            config.chan = 2;
+        }
+    }
+
+    //each channel has 2 preamble codes at 16 MHz PRF (e.g. 3 and 4) and 4 at 64 MHz PRF (e.g. 9 to 12, 17 to 20)
+    if(config.rxCode >= 17)
+    {
+        config.rxCode = 17 + ((config.rxCode - 17 + step) & 3);
+    }
+    else if(config.rxCode >= 9)
+    {
+        config.rxCode = 9 + ((config.rxCode - 9 + step) & 3);
+    }
+    else
+    {
+        config.rxCode = ((config.rxCode - 1) & ~1) + 1 + ((config.rxCode - 1 + step) & 1);
+    }
+    config.txCode = config.rxCode;
+
+    dwt_forcetrxoff();
+    inst->rxOn = 0;
+
+    dwt_setchannel(&config);
+
+    power = dwt_getotptxpower(config.prf, config.chan);
+    if((power == 0x0) || (power == 0xFFFFFFFF)) //if there are no calibrated values... need to use defaults
+    {
+        power = txSpectrumConfig[config.chan].txPwr[config.prf - DWT_PRF_16M];
+    }
+    inst->configTX.PGdly = txSpectrumConfig[config.chan].PGdelay;
+    inst->configTX.power = power;
+    dwt_configuretxrf(&inst->configTX);
+
+    inst->rxPartition = partition;
+}
+
+// -------------------------------------------------------------------------------------------------------------------
+// anchor: keep the receiver on the partition of the current superframe slot (partition 0 during the free slots, this
+// is where the Tags blink), called from the main loop - the receiver is only re-tuned while it is waiting for a frame
+void instanchorpartition(instance_data_t *inst)
+{
+    uint8 blank[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+    int slot;
+    int partition = 0;
+
+    if((inst->sfPeriod_ms == 0) || (inst->slotDuration_ms == 0)
+       || (inst->testAppState != TA_RX_WAIT_DATA) || (instance_peekevent() != 0))
+    {
+        return;
+    }
+
+    slot = ((instgetsfphase(inst) + RX_PARTITION_LEAD_MS) % inst->sfPeriod_ms) / inst->slotDuration_ms;
+    if((slot < inst->tagListLen) && (memcmp(&inst->tagList[slot][0], &blank[0], 8) != 0)) //the slot has a Tag
+    {
+        partition = instslotpartition(slot);
+    }
+
+    if(partition != inst->rxPartition)
+    {
+        instsetpartition(inst, partition);
+        inst->partSwitchCount++;
+        inst->testAppState = TA_RXE_WAIT; //turn the receiver back on
+    }
 }
 
 
 // -------------------------------------------------------------------------------------------------------------------
-#if (NUM_INST != 1)
-#error These functions assume one instance only
-#else
 
 void instcleartaglist(void)
 {
-    int instance = 0 ;
+    int instance = INST_CURRENT;
+    int i;
     uint8 blank[8] = {0, 0, 0, 0, 0, 0, 0, 0};
 
     instance_data[instance].tagListLen = 0 ;
     instance_data[instance].blinkRXcount = 0 ;
     instance_data[instance].tagToRangeWith = 0;
 
-    memcpy(&instance_data[instance].tagList[0][0], &blank[0], 8);
+    for(i=0; i<SF_SLOTS; i++)
+    {
+        memcpy(&instance_data[instance].tagList[i][0], &blank[0], 8);
+    }
 }
 
 
 uint32 instgetblinkrxcount(void)
 {
-    int instance = 0 ;
+    int instance = INST_CURRENT;
     return instance_data[instance].blinkRXcount ;
 }
 
@@ -271,19 +964,31 @@ uint32 instgetblinkrxcount(void)
 void instancesetrole(int inst_mode)
 {
     // assume instance 0, for this
-    instance_data[0].mode =  inst_mode;                   // set the role
+    instance_data[INST_CURRENT].mode =  inst_mode;                   // set the role
 }
 
 int instancegetrole(void)
 {
-    return instance_data[0].mode;
+    return instance_data[INST_CURRENT].mode;
+}
+
+// -------------------------------------------------------------------------------------------------------------------
+// Set the index of this anchor (it gives the response slot used after a broadcast poll)
+void instancesetanchorindex(int index)
+{
+    if(index >= ANCHOR_LIST_SIZE)
+    {
+        index = ANCHOR_LIST_SIZE - 1;
+    }
+
+    instance_data[INST_CURRENT].anchorIndex = index;
 }
 
 int instancenewrange(void)
 {
-    if(instance_data[0].newrange)
+    if(instance_data[INST_CURRENT].newrange)
     {
-        instance_data[0].newrange = 0;
+        instance_data[INST_CURRENT].newrange = 0;
         return 1;
     }
 
@@ -293,10 +998,10 @@ int instancenewrange(void)
 int instancenorange(void)
 {
 	int x = 0;
-    if(instance_data[0].norange)
+    if(instance_data[INST_CURRENT].norange)
     {
-        x = instance_data[0].norange ;
-        instance_data[0].norange = 0;
+        x = instance_data[INST_CURRENT].norange ;
+        instance_data[INST_CURRENT].norange = 0;
     }
 
     return x;
@@ -304,24 +1009,24 @@ int instancenorange(void)
 
 int instancenewrangeancadd(void)
 {
-    return instance_data[0].newrangeancaddress;
+    return instance_data[INST_CURRENT].newrangeancaddress;
 }
 
 int instancenewrangetagadd(void)
 {
-    return instance_data[0].newrangetagaddress;
+    return instance_data[INST_CURRENT].newrangetagaddress;
 }
 
 int instanceanchorwaiting(void)
 {
-	return instance_data[0].canprintinfo;
+	return instance_data[INST_CURRENT].canprintinfo;
 }
 
 int instancesleeping(void)
 {
-	if(instance_data[0].canprintinfo == 1)
+	if(instance_data[INST_CURRENT].canprintinfo == 1)
 	{
-		instance_data[0].canprintinfo = 0; //clear flag
+		instance_data[INST_CURRENT].canprintinfo = 0; //clear flag
 		return 1;
 	}
 
@@ -332,7 +1037,7 @@ int instancesleeping(void)
 //
 void instanceclearcounts(void)
 {
-    int instance = 0 ;
+    int instance = INST_CURRENT;
 
     instance_data[instance].rxTimeouts = 0 ;
 
@@ -349,6 +1054,9 @@ void instanceclearcounts(void)
     instance_data[instance].rxmsgcount = 0;
     instance_data[instance].lateTX = 0;
     instance_data[instance].lateRX = 0;
+    instance_data[instance].evQueueOverflows = 0;
+    memset(&instance_data[instance].evqStats, 0, sizeof(evq_stats_t));
+    instance_data[instance].rxForeignCount = 0;
 
     instance_data[instance].longTermRangeSum  = 0;
     instance_data[instance].longTermRangeCount  = 0;
@@ -367,26 +1075,29 @@ void instanceclearcounts(void)
 // Returns 0 on success and -1 on error
 int instance_init(void)
 {
-    int instance = 0 ;
     int result;
     //uint16 temp = 0;
 
-    instance_data[instance].mode =  ANCHOR;                                // assume listener,
-
-    instance_data[instance].instToSleep = 0;
-
-    instance_data[instance].tofindex = 0;
-    instance_data[instance].tofcount = 0;
-    instance_data[instance].tof = 0;
-
     // Reset the IC (might be needed if not getting here from POWER ON)
     // ARM code: Remove soft reset here as using hard reset in the inittestapplication() in the main.c file
     //dwt_softreset();
 
 
+    //the OTP calibration words are read once and kept in the MCU data EEPROM, the next initialisations use the copy
+    dwt_setotpsnapshot((const dwt_otpsnapshot_t *) PORT_NVM_OTPSNAP_ADDR);
+
 	//we can enable any configuration loding from OTP/ROM on initialisation
     result = dwt_initialise(DWT_LOADUCODE | DWT_LOADLDOTUNE | DWT_LOADTXCONFIG | DWT_LOADANTDLY| DWT_LOADXTALTRIM) ;
 
+    if (DWT_SUCCESS == result)
+    {
+        dwt_otpsnapshot_t otpSnapshot;
+
+        dwt_getotpsnapshot(&otpSnapshot);
+        //store the snapshot of a new part (only the words which differ are written)
+        portNvmWrite(PORT_NVM_OTPSNAP_ADDR, (const uint32_t *) &otpSnapshot, sizeof(otpSnapshot) / sizeof(uint32_t));
+    }
+
     //temp = dwt_readtempvbat();
 	//  temp formula is: 1.13 * reading - 113.0
 	// Temperature (C )= (SAR_LTEMP - (OTP_READ(Vtemp @ 23 C )) x 1.14) + 23
@@ -402,6 +1113,28 @@ int instance_init(void)
         return (-1) ;   // device initialise has failed
     }
 
+    uint8 EUI64[8]={0xfa,0xfa,0xfa,0xfa,0xfa,0xfa,0xfa,0xfa}; // adrese pour test /
+    dwt_seteui(&EUI64);
+
+    return instance_reinit() ;
+}
+
+// -------------------------------------------------------------------------------------------------------------------
+// function to re-initialise the instance structures of a device initialised with instance_init(), the DW1000 is not
+// reset (fast mode switch, see instance_config())
+//
+// Returns 0 on success and -1 on error
+int instance_reinit(void)
+{
+    int instance = INST_CURRENT;
+
+    instance_data[instance].mode =  ANCHOR;                                // assume listener,
+
+    instance_data[instance].instToSleep = 0;
+
+    instance_data[instance].tofindex = 0;
+    instance_data[instance].tofcount = 0;
+    instance_data[instance].tof = 0;
 
     instanceclearcounts() ;
 
@@ -413,9 +1146,6 @@ int instance_init(void)
 
     instance_clearevents();
 
-    uint8 EUI64[8]={0xfa,0xfa,0xfa,0xfa,0xfa,0xfa,0xfa,0xfa}; // adrese pour test /
-    dwt_seteui(&EUI64);
-
     dwt_geteui(instance_data[instance].eui64);
 
     instance_localdata[instance].testapprun_fn = NULL;
@@ -550,9 +1280,11 @@ void dwt_dumpregisters(char *str, size_t strSize)
 //
 void instance_config(instanceConfig_t *config)
 {
-    int instance = 0 ;
+    int instance = INST_CURRENT;
     int use_otpdata = DWT_LOADANTDLY | DWT_LOADXTALTRIM;
     uint32 power = 0;
+    uint8 prevPreambLen = instance_data[instance].configData.txPreambLength;
+    int full = 0;
 
     instance_data[instance].configData.chan = config->channelNumber ;
     instance_data[instance].configData.rxCode =  config->preambleCode ;
@@ -565,9 +1297,6 @@ void instance_config(instanceConfig_t *config)
     instance_data[instance].configData.phrMode = DWT_PHRMODE_STD ;
     instance_data[instance].configData.sfdTO = config->sfdTO;
 
-    //configure the channel parameters
-    dwt_configure(&instance_data[instance].configData, use_otpdata) ;
-
     instance_data[instance].configTX.PGdly = txSpectrumConfig[config->channelNumber].PGdelay ;
 
     //firstly check if there are calibrated TX power value in the DW1000 OTP
@@ -580,8 +1309,18 @@ void instance_config(instanceConfig_t *config)
 
     instance_data[instance].configTX.power = power;
 
-    //configure the tx spectrum parameters (power and PG delay)
-    dwt_configuretxrf(&instance_data[instance].configTX);
+    //configure the channel and the tx spectrum parameters (power and PG delay), only the changed settings are written
+    //if the device has been configured before (no reset since), otherwise the full configuration is done
+    instspicostbegin(&instance_data[instance]);
+    if(dwt_reconfigure(&instance_data[instance].configData, &instance_data[instance].configTX, use_otpdata) != DWT_SUCCESS)
+    {
+        full = 1;
+        dwt_configure(&instance_data[instance].configData, use_otpdata) ;
+        dwt_configuretxrf(&instance_data[instance].configTX);
+    }
+    instspicostend(&instance_data[instance], &instance_data[instance].cfgSpiCost);
+
+    instance_data[instance].rxPartition = 0; //on the configured channel/preamble code
 
     instance_data[instance].antennaDelayChanged = 0;
 
@@ -612,13 +1351,19 @@ void instance_config(instanceConfig_t *config)
 
     }
 
-    if(config->preambleLen == DWT_PLEN_64) //if preamble length is 64
+    if(!full) //the antenna delays may have been changed since the last full configuration
+    {
+        dwt_setrxantennadelay(instance_data[instance].rxantennaDelay);
+        dwt_settxantennadelay(instance_data[instance].txantennaDelay);
+    }
+
+    if((config->preambleLen == DWT_PLEN_64) && (full || (prevPreambLen != DWT_PLEN_64))) //if preamble length is 64
 	{
-    	SPI_ConfigFastRate(SPI_BaudRatePrescaler_32); //reduce SPI to < 3MHz
+    	port_SPIx_slowbegin(); //OTP read: SPI < 3MHz
 
 		dwt_loadopsettabfromotp(0);
 
-		SPI_ConfigFastRate(SPI_BaudRatePrescaler_4); //increase SPI to max
+		port_SPIx_slowend();
     }
 
 #if (REG_DUMP == 1)
@@ -641,8 +1386,9 @@ void instance_config(instanceConfig_t *config)
 //
 void instancesettagsleepdelay(int sleepdelay, int blinksleepdelay) //sleep in ms
 {
-    int instance = 0 ;
+    int instance = INST_CURRENT;
     instance_data[instance].tagSleepTime_ms = sleepdelay ;
+    instance_data[instance].tagSleepBase_ms = sleepdelay ;
     instance_data[instance].tagBlinkSleepTime_ms = blinksleepdelay ;
 }
 
@@ -650,7 +1396,7 @@ void instancesettagsleepdelay(int sleepdelay, int blinksleepdelay) //sleep in ms
 
 int instance_get_dly(void) //get antenna delay
 {
-    int x = instance_data[0].txantennaDelay;
+    int x = instance_data[INST_CURRENT].txantennaDelay;
 
     return (x);
 }
@@ -666,11 +1412,67 @@ double instance_get_ldist(void) //get long term average range
 
 int instance_get_lcount(void) //get count of ranges used for calculation of lt avg
 {
-    int x = instance_data[0].longTermRangeCount;
+    int x = instance_data[INST_CURRENT].longTermRangeCount;
 
     return (x);
 }
 
+double instance_get_tdmarangerate(int numtags) //get guaranteed aggregate range rate (ranges/s) for numtags Tags
+{
+    if(instance_data[INST_CURRENT].sfPeriod_ms == 0)
+    {
+        return 0;
+    }
+
+    if(numtags > SF_SLOTS)
+    {
+        numtags = SF_SLOTS;
+    }
+
+    return ((double) numtags * 1000.0) / instance_data[INST_CURRENT].sfPeriod_ms;
+}
+
+double instance_get_sfrangerate(void) //get range rate (ranges/s) measured over the last superframe
+{
+    if(instance_data[INST_CURRENT].sfPeriod_ms == 0)
+    {
+        return 0;
+    }
+
+    return ((double) instance_data[INST_CURRENT].sfRangeCountLast * 1000.0) / instance_data[INST_CURRENT].sfPeriod_ms;
+}
+
+int instance_get_bcrangemask(void)
+{
+#if (BROADCAST_POLL == 1)
+    return instance_data[INST_CURRENT].anchDistMask;
+#else
+    return 0;
+#endif
+}
+
+double instance_get_bcrange(int slot)
+{
+#if (BROADCAST_POLL == 1)
+    if((slot >= 0) && (slot < ANCHOR_LIST_SIZE))
+    {
+        return instance_data[INST_CURRENT].anchDist[slot];
+    }
+#endif
+    return 0;
+}
+
+int instance_get_bcrangeaddr(int slot)
+{
+#if (BROADCAST_POLL == 1)
+    if((slot >= 0) && (slot < ANCHOR_LIST_SIZE))
+    {
+        return instance_data[INST_CURRENT].anchAddr[slot];
+    }
+#endif
+    return 0;
+}
+
 double instance_get_idist(void) //get instantaneous range
 {
     double x = inst_idist;
@@ -687,28 +1489,98 @@ double instance_get_idistraw(void) //get instantaneous range
 
 int instance_get_rxf(void) //get number of Rxed frames
 {
-    int x = instance_data[0].rxmsgcount;
+    int x = instance_data[INST_CURRENT].rxmsgcount;
 
     return (x);
 }
 
 int instance_get_txf(void) //get number of Txed frames
 {
-    int x = instance_data[0].txmsgcount;
+    int x = instance_data[INST_CURRENT].txmsgcount;
 
     return (x);
 }
 
 int instance_get_txl(void) //get number of late Tx frames
 {
-    int x = instance_data[0].lateTX;
+    int x = instance_data[INST_CURRENT].lateTX;
 
     return (x);
 }
 
+int instance_get_rxovrr(void) //get number of receiver overruns (double buffer mode)
+{
+	dwt_deviceentcnts_t counters;
+
+	dwt_readeventcounters(&counters);
+
+	return counters.OVER;
+}
+
+int instance_get_evqlost(void) //get number of events lost because the event queue was full
+{
+	int instance = INST_CURRENT;
+
+	return instance_data[instance].evQueueOverflows;
+}
+
+void instance_get_evqstats(evq_stats_t *stats) //get the event queue telemetry
+{
+	int instance = INST_CURRENT;
+	decaIrqStatus_t stat = decamutexon(); //the callbacks update it
+
+	*stats = instance_data[instance].evqStats;
+	stats->drops = instance_data[instance].evQueueOverflows;
+
+	decamutexoff(stat);
+}
+
+void instance_get_spicost(spi_cost_t *cfg, spi_cost_t *wake) //get SPI cost of the last configuration and wake-up
+{
+	int instance = INST_CURRENT;
+
+	*cfg = instance_data[instance].cfgSpiCost;
+	*wake = instance_data[instance].wakeSpiCost;
+}
+
+int instance_get_partswitch(void) //get number of receiver re-tunes between channel/preamble code partitions
+{
+	int instance = INST_CURRENT;
+
+	return instance_data[instance].partSwitchCount;
+}
+
+int instance_get_rxforeign(void) //get number of frames dropped from their header (header-first receive)
+{
+	int instance = INST_CURRENT;
+
+	return instance_data[instance].rxForeignCount;
+}
+
+int instance_get_ttfr(void) //get time from the first blink to the first range (ms)
+{
+	int instance = INST_CURRENT;
+
+	return instance_data[instance].ttfr_ms;
+}
+
+int instance_get_admitpeak(void) //get most Tags waiting for a ranging init at the same time
+{
+	int instance = INST_CURRENT;
+
+	return instance_data[instance].admitQueuePeak;
+}
+
+int instance_get_admitwaitmax(void) //get longest wait from first blink to ranging init (ms)
+{
+	int instance = INST_CURRENT;
+
+	return instance_data[instance].admitWaitMax_ms;
+}
+
 int instance_get_rxl(void) //get number of late Tx frames
 {
-    int x = instance_data[0].lateRX;
+    int x = instance_data[INST_CURRENT].lateRX;
 
     return (x);
 }
@@ -722,9 +1594,9 @@ double instance_get_adist(void) //get average range
 
 int instance_get_respPSC(void)
 {
-	int x = instance_data[0].respPSC;
+	int x = instance_data[INST_CURRENT].respPSC;
 
-	instance_data[0].respPSC = 0;
+	instance_data[INST_CURRENT].respPSC = 0;
 
 	return x;
 }
@@ -758,6 +1630,15 @@ void inst_processrxtimeout(instance_data_t *inst)
 			if(inst->previousState == TA_TXPOLL_WAIT_SEND) //no response
 			{
 				inst->norange = 1;
+#if (BROADCAST_POLL == 1)
+				if(inst->respRxMask) //at least one anchor responded to the broadcast poll - send the final
+				{
+					inst->norange = 0;
+					inst->testAppState = TA_TXFINAL_WAIT_SEND ;
+					dwt_forcetrxoff() ;
+					return;
+				}
+#endif
 			}
 			inst->nextState = TA_TXPOLL_WAIT_SEND ;
 
@@ -771,16 +1652,17 @@ void inst_processrxtimeout(instance_data_t *inst)
 
     //timeout - disable the radio (if using SW timeout the rx will not be off)
     dwt_forcetrxoff() ;
+    inst->rxOn = 0;
 }
 
 
 void instance_txcallback(const dwt_callback_data_t *txd)
 {
-	int instance = 0;
+	int instance = INST_CURRENT;
 	uint8 txTimeStamp[5] = {0, 0, 0, 0, 0};
 
 	uint8 txevent = txd->event;
-	event_data_t dw_event;
+	event_data_t *dw_event = instance_reserveevent();
 
 	if(txevent == DWT_SIG_TX_DONE)
 	{
@@ -790,18 +1672,18 @@ void instance_txcallback(const dwt_callback_data_t *txd)
 		//dwt_readtxtimestamp((uint8*) &instance_data[instance].txu.txTimeStamp);
 
 		dwt_readtxtimestamp(txTimeStamp) ;
-		dw_event.timeStamp32l = (uint32)txTimeStamp[0] + ((uint32)txTimeStamp[1] << 8) + ((uint32)txTimeStamp[2] << 16) + ((uint32)txTimeStamp[3] << 24);
-		dw_event.timeStamp = txTimeStamp[4];
-	    dw_event.timeStamp <<= 32;
-		dw_event.timeStamp += dw_event.timeStamp32l;
-		dw_event.timeStamp32h = ((uint32)txTimeStamp[4] << 24) + (dw_event.timeStamp32l >> 8);
+		dw_event->timeStamp32l = (uint32)txTimeStamp[0] + ((uint32)txTimeStamp[1] << 8) + ((uint32)txTimeStamp[2] << 16) + ((uint32)txTimeStamp[3] << 24);
+		dw_event->timeStamp = txTimeStamp[4];
+	    dw_event->timeStamp <<= 32;
+		dw_event->timeStamp += dw_event->timeStamp32l;
+		dw_event->timeStamp32h = ((uint32)txTimeStamp[4] << 24) + (dw_event->timeStamp32l >> 8);
 
 		instance_data[instance].stoptimer = 0;
 
-		dw_event.rxLength = 0;
-		dw_event.type2 = dw_event.type = DWT_SIG_TX_DONE ;
+		dw_event->rxLength = 0;
+		dw_event->type2 = DWT_SIG_TX_DONE ;
 
-		instance_putevent(dw_event);
+		instance_commitevent(dw_event, DWT_SIG_TX_DONE);
 
 #if (DEEP_SLEEP == 1)
         if (instance_data[instance].sleep_en)
@@ -814,10 +1696,10 @@ void instance_txcallback(const dwt_callback_data_t *txd)
 	else if(txevent == DWT_SIG_TX_AA_DONE)
 	{
 		//auto ACK confirmation
-		dw_event.rxLength = 0;
-		dw_event.type2 = dw_event.type = DWT_SIG_TX_AA_DONE ;
+		dw_event->rxLength = 0;
+		dw_event->type2 = DWT_SIG_TX_AA_DONE ;
 
-		instance_putevent(dw_event);
+		instance_commitevent(dw_event, DWT_SIG_TX_AA_DONE);
 
 		//printf("TX AA time %f ecount %d\n",convertdevicetimetosecu(instance_data[instance].txu.txTimeStamp), instance_data[instance].dweventCnt);
 	}
@@ -825,14 +1707,47 @@ void instance_txcallback(const dwt_callback_data_t *txd)
 	instance_data[instance].monitor = 0;
 }
 
+// -------------------------------------------------------------------------------------------------------------------
+// dwt_isr() reads a good frame and its RX timestamp in one go, before calling instance_rxcallback()
+// the anchor only gets the header of the longer frames (header-first receive), it reads the rest of the relevant ones
+void instance_setrxprefetch(int mode)
+{
+	instance_localdata[INST_CURRENT].rxPrefetchHdr = 0;
+#if (RX_HEADER_FIRST == 1)
+	if(mode == ANCHOR)
+	{
+		instance_localdata[INST_CURRENT].rxPrefetchHdr = RX_HEADER_LEN;
+	}
+#endif
+	instance_rxtarget();
+}
+
+// point the frame prefetch at the slot the next event will be built in
+// (called with the DW1000 interrupt masked or from its callbacks)
+static void instance_rxtarget(void)
+{
+	event_data_t *dw_event = instance_reserveevent();
+
+	dwt_setrxprefetch(dw_event->msgu.frame, sizeof(dw_event->msgu.frame), instance_localdata[INST_CURRENT].rxPrefetchHdr);
+}
+
 void instance_rxcallback(const dwt_callback_data_t *rxd)
 {
-	int instance = 0;
+	int instance = INST_CURRENT;
 	uint8 rxTimeStamp[5]  = {0, 0, 0, 0, 0};
 	uint8 srcAddr_index = 0;
     uint8 rxd_event = 0;
 	uint8 fcode_index  = 0;
-	event_data_t dw_event;
+	uint16 rxHave = rxd->prefetched; //frame bytes already read
+	event_data_t *dw_event = instance_reserveevent(); //the frame has been prefetched into it
+#if (TURNAROUND_CALIB == 1)
+	uint32 cbStart32h = 0;
+
+	if(instance_data[instance].turnCalibCount < TURNAROUND_CALIB_SAMPLES)
+	{
+		cbStart32h = dwt_readsystimestamphi32(); //time the callback starts (interrupt latency)
+	}
+#endif
 
 	//if we got a frame with a good CRC - RX OK
     if(rxd->event == DWT_SIG_RX_OKAY)
@@ -841,7 +1756,7 @@ void instance_rxcallback(const dwt_callback_data_t *rxd)
 
         rxd_event = DWT_SIG_RX_OKAY;
 
-		dw_event.rxLength = rxd->datalength;
+		dw_event->rxLength = rxd->datalength;
 
 		//need to process the frame control bytes to figure out what type of frame we have received
         switch(rxd->fctrl[0])
@@ -905,20 +1820,60 @@ void instance_rxcallback(const dwt_callback_data_t *rxd)
 		}
 
 
+#if (RX_HEADER_FIRST == 1)
+		//header-first: drop the data frames which are not from a Tag of the superframe, the payload is not read
+		if((rxd_event == DWT_SIG_RX_OKAY) && (instance_data[instance].mode == ANCHOR))
+		{
+			int srcAddrLen = ((rxd->fctrl[1] & 0xC0) == 0xC0) ? ADDR_BYTE_SIZE_L : ADDR_BYTE_SIZE_S;
+
+			if(rxHave < (srcAddr_index + srcAddrLen)) //no prefetch (e.g. long frame)
+			{
+				rxHave = srcAddr_index + srcAddrLen;
+				dwt_readrxdata((uint8 *)&dw_event->msgu.frame[0], rxHave, 0);
+			}
+
+			if(insttagslot(&instance_data[instance], &dw_event->msgu.frame[srcAddr_index], srcAddrLen) >= SF_SLOTS)
+			{
+				rxd_event = SIG_RX_UNKNOWN;
+				instance_data[instance].rxForeignCount++;
+			}
+		}
+#endif
+
 		//read rx timestamp
 		if((rxd_event == SIG_RX_BLINK) || (rxd_event == DWT_SIG_RX_OKAY))
 		{
-			dwt_readrxtimestamp(rxTimeStamp) ;
-			dw_event.timeStamp32l =  (uint32)rxTimeStamp[0] + ((uint32)rxTimeStamp[1] << 8) + ((uint32)rxTimeStamp[2] << 16) + ((uint32)rxTimeStamp[3] << 24);
-			dw_event.timeStamp = rxTimeStamp[4];
-			dw_event.timeStamp <<= 32;
-			dw_event.timeStamp += dw_event.timeStamp32l;
-			dw_event.timeStamp32h = ((uint32)rxTimeStamp[4] << 24) + (dw_event.timeStamp32l >> 8);
-
-			dwt_readrxdata((uint8 *)&dw_event.msgu.frame[0], rxd->datalength, 0);  // Read Data Frame
+			if(rxd->prefetched == rxd->datalength) //dwt_isr() has already read the frame and the timestamp
+			{
+				memcpy(rxTimeStamp, rxd->rxstamp, sizeof(rxTimeStamp));
+			}
+			else
+			{
+				dwt_readrxtimestamp(rxTimeStamp) ;
+			}
+			dw_event->timeStamp32l =  (uint32)rxTimeStamp[0] + ((uint32)rxTimeStamp[1] << 8) + ((uint32)rxTimeStamp[2] << 16) + ((uint32)rxTimeStamp[3] << 24);
+			dw_event->timeStamp = rxTimeStamp[4];
+			dw_event->timeStamp <<= 32;
+			dw_event->timeStamp += dw_event->timeStamp32l;
+			dw_event->timeStamp32h = ((uint32)rxTimeStamp[4] << 24) + (dw_event->timeStamp32l >> 8);
+
+#if (TURNAROUND_CALIB == 1)
+			if(cbStart32h && (SYSTIME32H_TO_US(cbStart32h - dw_event->timeStamp32h) > instance_data[instance].rxcbLatMax_us))
+			{
+				instance_data[instance].rxcbLatMax_us = SYSTIME32H_TO_US(cbStart32h - dw_event->timeStamp32h);
+			}
+#endif
+
+			if(rxHave < rxd->datalength) //read the rest of the frame (header-first) or the whole frame
+			{
+				dwt_readrxdata((uint8 *)&dw_event->msgu.frame[rxHave], rxd->datalength - rxHave, rxHave);  // Read Data Frame
+			}
 		}
 
-		dw_event.type2 = dw_event.type = rxd_event;
+		dw_event->type2 = rxd_event;
+
+		//in double buffer mode the IC has already re-enabled the receiver for the next frame
+		instance_data[instance].rxOn = rxd->dblbuff;
 
 		//----------------------------------------------------------------------------------------------
 		//TWR - here we chack if we need to respond to a TWR Poll or Response Messages
@@ -930,14 +1885,21 @@ void instance_rxcallback(const dwt_callback_data_t *rxd)
 			//check if this is a TWR message (and also which one)
 			if(instance_data[instance].tagListLen > 0)
 			{
-				switch(dw_event.msgu.frame[fcode_index])
+				switch(dw_event->msgu.frame[fcode_index])
 				{
 
 					case RTLS_DEMO_MSG_TAG_POLL:
+					case RTLS_DEMO_MSG_TAG_POLLB:
+#if (SS_TWR == 1)
+					case RTLS_DEMO_MSG_TAG_POLLSS:
+#endif
 					{
 						uint16 frameLength = 0;
+						uint8 rxAfterTx = DWT_RESPONSE_EXPECTED; //the final message is expected after the response
+						uint8 *respMsg = (uint8 *) &instance_data[instance].msg;
+						uint8 *respData = &instance_data[instance].msg.messageData[0];
 
-						instance_data[instance].tagPollRxTime = dw_event.timeStamp ; //Poll's Rx time
+						instance_data[instance].tagPollRxTime = dw_event->timeStamp ; //Poll's Rx time
 
 	#if (IMMEDIATE_RESPONSE == 0)
 						instance_data[instance].delayedReplyTime = (instance_data[instance].tagPollRxTime + instance_data[instance].responseReplyDelay) >> 8 ;  // time we should send the response
@@ -945,44 +1907,100 @@ void instance_rxcallback(const dwt_callback_data_t *rxd)
                         instance_data[instance].delayedReplyTime = 0;
 	#endif
 
+    #if (SHORT_ADDR_RANGING == 1)
+						if((rxd->fctrl[1] & 0xCC) == 0x88) //the Tag uses the 16-bit addresses given in the ranging init
+						{
+							respMsg = (uint8 *) &instance_data[instance].msg_f;
+							respData = &instance_data[instance].msg_f.messageData[0];
+							frameLength = ANCH_RESPONSE_MSG_LEN + FRAME_CRTL_AND_ADDRESS_S + FRAME_CRC;
+							memcpy(&instance_data[instance].msg_f.destAddr[0], &dw_event->msgu.frame[srcAddr_index], ADDR_BYTE_SIZE_S); //remember who to send the reply to (set destination address)
+						}
+						else
+    #endif
     #if (USING_64BIT_ADDR == 1)
-                        frameLength = ANCH_RESPONSE_MSG_LEN + FRAME_CRTL_AND_ADDRESS_L + FRAME_CRC;
-						memcpy(&instance_data[instance].msg.destAddr[0], &dw_event.msgu.frame[srcAddr_index], ADDR_BYTE_SIZE_L); //remember who to send the reply to (set destination address)
+						{
+							frameLength = ANCH_RESPONSE_MSG_LEN + FRAME_CRTL_AND_ADDRESS_L + FRAME_CRC;
+							memcpy(&instance_data[instance].msg.destAddr[0], &dw_event->msgu.frame[srcAddr_index], ADDR_BYTE_SIZE_L); //remember who to send the reply to (set destination address)
+						}
 	#else
 						frameLength = ANCH_RESPONSE_MSG_LEN + FRAME_CRTL_AND_ADDRESS_S + FRAME_CRC;
-						memcpy(&instance_data[instance].msg.destAddr[0], &dw_event.msgu.frame[srcAddr_index], ADDR_BYTE_SIZE_S); //remember who to send the reply to (set destination address)
+						memcpy(&instance_data[instance].msg.destAddr[0], &dw_event->msgu.frame[srcAddr_index], ADDR_BYTE_SIZE_S); //remember who to send the reply to (set destination address)
 	#endif
 						// Write calculated TOF into response message
-						memcpy(&(instance_data[instance].msg.messageData[TOFR]), &instance_data[instance].tof, 5);
+						memcpy(&respData[TOFR], &instance_data[instance].tof, 5);
+
+						// Write superframe phase into response message (the Tag uses it to stay aligned on its slot)
+						{
+							uint16 sf_phase = instgetsfphase(&instance_data[instance]);
+							respData[RES_R2] = sf_phase & 0xFF;
+							respData[RES_R3] = (sf_phase >> 8) & 0xFF;
+						}
+
+						// Write our index (response slot) into response message
+						respData[RES_IDX] = instance_data[instance].anchorIndex;
+						respData[RES_R1] = 0x2; // "activity"
+						respData[FCODE] = RTLS_DEMO_MSG_ANCH_RESP;
+
+#if (SS_TWR == 1)
+						if(dw_event->msgu.frame[fcode_index] == RTLS_DEMO_MSG_TAG_POLLSS)
+						{
+							uint64 anchorReplyTime;
+
+							// The response will be sent at delayedReplyTime (snapped by zeroing its low 9 bits) plus the
+							// TX antenna delay - write the reply time (response TX time - poll RX time) into the response
+							anchorReplyTime = (((uint64)(instance_data[instance].delayedReplyTime & 0xFFFFFFFE)) << 8)
+												+ instance_data[instance].txantennaDelay;
+							anchorReplyTime = (anchorReplyTime - instance_data[instance].tagPollRxTime) & MASK_40BIT;
+							memcpy(&respData[RES_RPLY], &anchorReplyTime, 5);
+
+							respData[FCODE] = RTLS_DEMO_MSG_ANCH_RESPSS;
+							frameLength += (ANCH_RESPSS_MSG_LEN - ANCH_RESPONSE_MSG_LEN);
+							rxAfterTx = 0; //no final message - the Tag computes the range from the response
+						}
+#endif
 
 						instance_data[instance].tof = 0; //clear ToF ..
 
-						instance_data[instance].msg.seqNum = instance_data[instance].frame_sn++;
+						respMsg[FRAME_CONTROL_BYTES] = instance_data[instance].frame_sn++; //sequence number
 
 						//set the delayed rx on time (the final message will be sent after this delay)
 						dwt_setrxaftertxdelay((uint32)instance_data[instance].txToRxDelayAnc_sy);  //units are 1.0256us - wait for wait4respTIM before RX on (delay RX)
 
 						//response is expected
-						instance_data[instance].wait4ack = DWT_RESPONSE_EXPECTED;
+						instance_data[instance].wait4ack = rxAfterTx;
+
+						if(rxd->dblbuff) //the receiver has been re-enabled for the next frame - turn it off before the TX
+						{
+							dwt_forcetrxoff();
+							instance_data[instance].rxOn = 0;
+						}
 
 						dwt_writetxfctrl(frameLength, 0);
-						dwt_writetxdata(frameLength, (uint8 *)  &instance_data[instance].msg, 0) ;	// write the frame data
+						dwt_writetxdata(frameLength, respMsg, 0) ;	// write the frame data
 
 	#if (IMMEDIATE_RESPONSE == 1)
 						dwt_starttx(DWT_START_TX_IMMEDIATE | DWT_RESPONSE_EXPECTED);
 	#else
-						if(instancesendpacket(frameLength, DWT_START_TX_DELAYED | DWT_RESPONSE_EXPECTED, instance_data[instance].delayedReplyTime))
+		#if (TURNAROUND_CALIB == 1)
+						if(instance_data[instance].turnCalibCount < TURNAROUND_CALIB_SAMPLES)
+						{
+							instturnaroundcalib(&instance_data[instance], dw_event->timeStamp32h);
+						}
+		#endif
+						if(instancesendpacket(frameLength, DWT_START_TX_DELAYED | rxAfterTx, instance_data[instance].delayedReplyTime))
 						{
-							dw_event.type3 = DWT_SIG_TX_ERROR ;
+							dw_event->type3 = DWT_SIG_TX_ERROR ;
 							dwt_setrxaftertxdelay(0);
 							instance_data[instance].wait4ack = 0; //clear the flag as the TX has failed the TRX is off
 							instance_data[instance].lateTX++;
-
+		#if (TURNAROUND_CALIB == 1)
+							instturnaroundlate(&instance_data[instance]);
+		#endif
 						}
 						else
 	#endif
 						{
-							dw_event.type3 = DWT_SIG_TX_PENDING ; // exit this interrupt and notify the application/instance that TX is in progress.
+							dw_event->type3 = DWT_SIG_TX_PENDING ; // exit this interrupt and notify the application/instance that TX is in progress.
 						}
 					}
 					break;
@@ -998,13 +2016,22 @@ void instance_rxcallback(const dwt_callback_data_t *rxd)
 				}
 			}
 
+#if (SS_TWR == 1)
+			//the carrier integrator is only valid until the receiver is turned on again - read it now,
+			//the Tag uses it to correct the anchor's reply time
+			if(dw_event->msgu.frame[fcode_index] == RTLS_DEMO_MSG_ANCH_RESPSS)
+			{
+				instance_data[instance].carrierIntegrator = dwt_readcarrierintegrator();
+			}
+#endif
+
 	    	instance_data[instance].stoptimer = 1;
 
-	    	instance_putevent(dw_event);
+	    	instance_commitevent(dw_event, rxd_event);
 
 			//printf("RX OK %d %x\n",instance_data[instance].testAppState, instance_data[instance].rxmsg.messageData[FCODE]);
 			//printf("RX OK %d ", instance_data[instance].testAppState);
-			//printf("RX time %f ecount %d\n",convertdevicetimetosecu(dw_event.timeStamp), instance_data[instance].dweventCnt);
+			//printf("RX time %f ecount %d\n",convertdevicetimetosecu(dw_event->timeStamp), instance_data[instance].dweventCnt);
 
 #if (DEEP_SLEEP == 1)
             if (instance_data[instance].sleep_en)
@@ -1013,7 +2040,7 @@ void instance_rxcallback(const dwt_callback_data_t *rxd)
 		}
 		else if (rxd_event == SIG_RX_BLINK)
 		{
-			instance_putevent(dw_event);
+			instance_commitevent(dw_event, rxd_event);
 
 #if (DEEP_SLEEP == 1)
             if (instance_data[instance].sleep_en)
@@ -1021,20 +2048,20 @@ void instance_rxcallback(const dwt_callback_data_t *rxd)
 #endif
 		}
 
-		if (rxd_event == SIG_RX_UNKNOWN) //need to re-enable the rx
+		if ((rxd_event == SIG_RX_UNKNOWN) && (rxd->dblbuff == 0)) //need to re-enable the rx (in double buffer mode the IC has done it)
 		{
 			instancerxon(&instance_data[instance], 0, 0); //immediate enable
 		}
 	}
 	else if (rxd->event == DWT_SIG_RX_TIMEOUT)
 	{
-		dw_event.type2 = dw_event.type = DWT_SIG_RX_TIMEOUT;
-		dw_event.rxLength = 0;
-		dw_event.timeStamp = 0;
-		dw_event.timeStamp32l = 0;
-		dw_event.timeStamp32h = 0;
+		dw_event->type2 = DWT_SIG_RX_TIMEOUT;
+		dw_event->rxLength = 0;
+		dw_event->timeStamp = 0;
+		dw_event->timeStamp32l = 0;
+		dw_event->timeStamp32h = 0;
 
-		instance_putevent(dw_event);
+		instance_commitevent(dw_event, DWT_SIG_RX_TIMEOUT);
 		//printf("RX timeout while in %d\n", instance_data[instance].testAppState);
 	}
 	else //assume other events are errors
@@ -1044,13 +2071,12 @@ void instance_rxcallback(const dwt_callback_data_t *rxd)
 		//for ranging application rx error frame is same as TO - as we are not going to get the expected frame
 		if((instance_data[instance].mode == TAG) || (instance_data[instance].mode == TAG_TDOA))
 		{
-			dw_event.type = DWT_SIG_RX_TIMEOUT;
-			dw_event.type2 = 0x40 | DWT_SIG_RX_TIMEOUT;
-			dw_event.rxLength = 0;
+			dw_event->type2 = 0x40 | DWT_SIG_RX_TIMEOUT;
+			dw_event->rxLength = 0;
 
-			instance_putevent(dw_event);
+			instance_commitevent(dw_event, DWT_SIG_RX_TIMEOUT);
 		}
-		else
+		else if(rxd->dblbuff == 0) //in double buffer mode the receiver has been re-enabled automatically
 		{
 			instancerxon(&instance_data[instance], 0, 0); //immediate enable if anchor or listener
 		}
@@ -1060,76 +2086,93 @@ void instance_rxcallback(const dwt_callback_data_t *rxd)
 
 int instance_peekevent(void)
 {
-	int instance = 0;
+	int instance = INST_CURRENT;
     return instance_data[instance].dwevent[instance_data[instance].dweventPeek].type; //return the type of event that is in front of the queue
 }
 
-void instance_putevent(event_data_t newevent)
+// -------------------------------------------------------------------------------------------------------------------
+// event queue: the producers (DW1000 callbacks, PC timeout) build the event in place in instance_reserveevent() and
+// publish it with instance_commitevent(), the state machine gets a pointer to it with instance_getevent() and the slot
+// is freed by instance_releaseevent() (or the next instance_getevent()) - nothing is copied
+
+// slot at the input of the queue, or the sink if the queue is full
+event_data_t* instance_reserveevent(void)
+{
+	int instance = INST_CURRENT;
+	event_data_t *dw_event = &instance_data[instance].dwevent[instance_data[instance].dweventIdxIn];
+
+	//the queue is full (the application has not read or released the oldest event yet) - the event is built in the
+	//sink and dropped rather than overwrite one the application may be reading; this can happen when frames arrive
+	//back to back in double buffer mode
+	if(dw_event->type != 0)
+	{
+		return &dw_sinkevent;
+	}
+
+	return dw_event;
+}
+
+// publish an event built in instance_reserveevent(), the type is set last so that instance_getevent() never sees an
+// incomplete event
+void instance_commitevent(event_data_t *dw_event, uint8 type)
 {
-	int instance = 0;
-	uint8 etype = newevent.type;
+	int instance = INST_CURRENT;
+
+	if(dw_event == &dw_sinkevent)
+	{
+		instance_data[instance].evQueueOverflows++;
+		return;
+	}
 
-	newevent.type = 0;
-	//newevent.eventtime = portGetTickCount();
-	//newevent.gotit = newevent.eventtimeclr = 0;
+	dw_event->eventtime = portGetCycleCount();
 
-	//copy event
-	instance_data[instance].dwevent[instance_data[instance].dweventIdxIn] = newevent;
+	instance_data[instance].evqStats.typeCount[(type < (EVQ_TYPE_BINS - 1)) ? type : (EVQ_TYPE_BINS - 1)]++;
+	if(++instance_data[instance].evqStats.depth > instance_data[instance].evqStats.highWater)
+	{
+		instance_data[instance].evqStats.highWater = instance_data[instance].evqStats.depth;
+	}
 
-	//set type - this makes it a new event (making sure the event data is copied before event is set as new)
-	//to make sure that the get event function does not get an incomplete event
-	instance_data[instance].dwevent[instance_data[instance].dweventIdxIn].type = etype;
+	dw_event->type = type;
 
 	instance_data[instance].dweventIdxIn++;
 
 	if(MAX_EVENT_NUMBER == instance_data[instance].dweventIdxIn)
 		instance_data[instance].dweventIdxIn = 0;
 
-	//eventIncount++;
-
-	//printf("put %d - in %d out %d @ %d\n", newevent.type, instance_data[instance].dweventCntIn, instance_data[instance].dweventCntOut, ptime);
+	instance_rxtarget();
 }
 
-event_data_t dw_event_g;
-
+// get the event at the output of the queue, it stays valid (and its slot reserved) until it is released
 //#pragma GCC optimize ("O0")
 event_data_t* instance_getevent(int x)
 {
-	int instance = 0;
-	int indexOut = instance_data[instance].dweventIdxOut;
+	int instance = INST_CURRENT;
+	int indexOut;
+	uint32 latency_us, binEnd_us;
+	int bin = 0;
 
-	//dw_event_g = instance_data[instance].dwevent[instance_data[instance].dweventCntOut]; //this holds any TX/RX events
+	instance_releaseevent(); //the state machine only holds one event at a time
 
-	//memcpy(&dw_event_g, &instance_data[instance].dwevent[instance_data[instance].dweventCntOut], sizeof(event_data_t));
+	indexOut = instance_data[instance].dweventIdxOut;
 
 	if(instance_data[instance].dwevent[indexOut].type == 0) //exit with "no event"
 	{
-		dw_event_g.type = 0;
-		dw_event_g.type2 = 0;
-		return &dw_event_g;
+		return (event_data_t *)&dw_noevent;
 	}
 
-	//copy the event
-	dw_event_g.type2 = instance_data[instance].dwevent[indexOut].type2 ;
-	dw_event_g.type3 = instance_data[instance].dwevent[indexOut].type3 ;
-	dw_event_g.rxLength = instance_data[instance].dwevent[indexOut].rxLength ;
-	dw_event_g.timeStamp = instance_data[instance].dwevent[indexOut].timeStamp ;
-	dw_event_g.timeStamp32l = instance_data[instance].dwevent[indexOut].timeStamp32l ;
-	dw_event_g.timeStamp32h = instance_data[instance].dwevent[indexOut].timeStamp32h ;
-	//dw_event_g.eventtime = instance_data[instance].dwevent[indexOut].eventtime ;
-	//dw_event_g.eventtimeclr = instance_data[instance].dwevent[indexOut].eventtimeclr ;
-	//dw_event_g.gotit = instance_data[instance].dwevent[indexOut].gotit ;
-
-	memcpy(&dw_event_g.msgu, &instance_data[instance].dwevent[indexOut].msgu, sizeof(instance_data[instance].dwevent[indexOut].msgu));
-
-	dw_event_g.type = instance_data[instance].dwevent[indexOut].type ;
+	instance_data[instance].dweventHeld = indexOut;
 
-
-	//instance_data[instance].dwevent[indexOut].gotit = x;
-
-	//instance_data[instance].dwevent[indexOut].eventtimeclr = portGetTickCount();
-
-	instance_data[instance].dwevent[indexOut].type = 0; //clear the event
+	//time the event has waited in the queue
+	latency_us = (portGetCycleCount() - instance_data[instance].dwevent[indexOut].eventtime) / (SystemCoreClock / 1000000);
+	for(binEnd_us = EVQ_LAT_BIN0_US; (latency_us >= binEnd_us) && (bin < (EVQ_LAT_BINS - 1)); binEnd_us <<= 1)
+	{
+		bin++;
+	}
+	instance_data[instance].evqStats.latency[bin]++;
+	if(latency_us > instance_data[instance].evqStats.latencyMax_us)
+	{
+		instance_data[instance].evqStats.latencyMax_us = latency_us;
+	}
 
 	instance_data[instance].dweventIdxOut++;
 	if(MAX_EVENT_NUMBER == instance_data[instance].dweventIdxOut) //wrap the counter
@@ -1139,16 +2182,36 @@ event_data_t* instance_getevent(int x)
 
 	//if(dw_event.type) printf("get %d - in %d out %d @ %d\n", dw_event.type, instance_data[instance].dweventCntIn, instance_data[instance].dweventCntOut, ptime);
 
-	//eventOutcount++;
+	return &instance_data[instance].dwevent[indexOut];
+}
+
+// free the slot of the event returned by instance_getevent()
+void instance_releaseevent(void)
+{
+	int instance = INST_CURRENT;
+	int held = instance_data[instance].dweventHeld;
+	decaIrqStatus_t stat;
+
+	if(held == MAX_EVENT_NUMBER) //none held
+	{
+		return;
+	}
+
+	stat = decamutexon();
 
+	instance_data[instance].dwevent[held].type = 0; //clear the event
+	instance_data[instance].dweventHeld = MAX_EVENT_NUMBER;
+	instance_data[instance].evqStats.depth--;
 
-	return &dw_event_g;
+	instance_rxtarget(); //the queue may have been full - the prefetch was pointing at the sink
+
+	decamutexoff(stat);
 }
 
 void instance_clearevents(void)
 {
 	int i = 0;
-	int instance = 0;
+	int instance = INST_CURRENT;
 
 	for(i=0; i<MAX_EVENT_NUMBER; i++)
 	{
@@ -1158,21 +2221,63 @@ void instance_clearevents(void)
 	instance_data[instance].dweventIdxIn = 0;
 	instance_data[instance].dweventIdxOut = 0;
 	instance_data[instance].dweventPeek = 0;
+	instance_data[instance].dweventHeld = MAX_EVENT_NUMBER;
+	instance_data[instance].evqStats.depth = 0;
 
-	//eventOutcount = 0;
-	//eventIncount = 0;
+	instance_rxtarget();
 }
 
 void instance_setapprun(int (*apprun_fn)(instance_data_t *inst, int message))
 {
-	int instance = 0 ;
+	int instance = INST_CURRENT;
 	instance_localdata[instance].testapprun_fn = apprun_fn;
 }
 
+// -------------------------------------------------------------------------------------------------------------------
+// ticks until instance_run() has something to do without a new DW1000 event: the timer (Tag sleep, PC timeout), the
+// delayed TX monitor and the anchor partition re-tune; 0 if an event is waiting
+uint32 instance_idletime(void)
+{
+    int instance = INST_CURRENT;
+    instance_data_t *inst = &instance_data[instance];
+    uint32 now = portGetTickCount();
+    int32 idle = PORT_IDLE_MAX_TICKS;
+    int32 due;
+
+    if(instance_peekevent() != 0)
+    {
+        return 0;
+    }
+
+    if((inst->instancetimer_en == 1) && (inst->stoptimer == 0))
+    {
+        due = (int32)(inst->instancetimer - now) + 1; //it expires once the tick count is past it
+        if(due < idle) idle = due;
+    }
+
+    if(inst->monitor == 1)
+    {
+        due = (int32)(inst->timeofTx + inst->finalReplyDelay_ms - now) + 1;
+        if(due < idle) idle = due;
+    }
+
+#if (RX_PARTITIONS > 1)
+    if((inst->mode == ANCHOR) && (inst->sfPeriod_ms != 0) && (inst->slotDuration_ms != 0)) //next slot boundary
+    {
+        uint32 phase = (instgetsfphase(inst) + RX_PARTITION_LEAD_MS) % inst->sfPeriod_ms;
+
+        due = inst->slotDuration_ms - (phase % inst->slotDuration_ms);
+        if(due < idle) idle = due;
+    }
+#endif
+
+    return (idle < 0) ? 0 : idle;
+}
+
 // -------------------------------------------------------------------------------------------------------------------
 int instance_run(void)
 {
-    int instance = 0 ;
+    int instance = INST_CURRENT;
     int done = INST_NOT_DONE_YET;
     int message = instance_peekevent(); //get any of the received events from ISR
 
@@ -1186,6 +2291,8 @@ int instance_run(void)
 		message = 0;
 	}
 
+	instance_releaseevent(); //free the queue slot of the event the state machine has processed
+
     if(done == INST_DONE_WAIT_FOR_NEXT_EVENT_TO) //we are in RX and need to timeout (Tag needs to send another poll if no Rx frame)
     {
         if(instance_data[instance].mode == TAG) //Tag (is either in RX or sleeping)
@@ -1195,25 +2302,33 @@ int instance_run(void)
         }
         if(instance_data[instance].mode == TAG_TDOA)
         {
-            instance_data[instance].instancetimer += instance_data[instance].tagBlinkSleepTime_ms; //set timeout time
+            instance_data[instance].instancetimer += instblinkperiod(&instance_data[instance]); //set timeout time (jittered)
             instance_data[instance].instancetimer_en = 1; //start timer
         }
         instance_data[instance].stoptimer = 0 ; //clear the flag - timer can run if instancetimer_en set (set above)
         instance_data[instance].done = INST_NOT_DONE_YET;
     }
 
+#if (RX_PARTITIONS > 1)
+    if(instance_data[instance].mode == ANCHOR) //time-slice the receiver between the channel/preamble code partitions
+    {
+        instanchorpartition(&instance_data[instance]);
+    }
+#endif
+
     //check if timer has expired
     if((instance_data[instance].instancetimer_en == 1) && (instance_data[instance].stoptimer == 0))
     {
         if(instance_data[instance].instancetimer < portGetTickCount())
         {
-			event_data_t dw_event;
+			decaIrqStatus_t stat = decamutexon(); //the DW1000 callbacks also write to the event queue
+			event_data_t *dw_event = instance_reserveevent();
             instance_data[instance].instancetimer_en = 0;
-			dw_event.rxLength = 0;
-			dw_event.type = DWT_SIG_RX_TIMEOUT;
-			dw_event.type2 = 0x80 | DWT_SIG_RX_TIMEOUT;
+			dw_event->rxLength = 0;
+			dw_event->type2 = 0x80 | DWT_SIG_RX_TIMEOUT;
 			//printf("PC timeout DWT_SIG_RX_TIMEOUT\n");
-			instance_putevent(dw_event);
+			instance_commitevent(dw_event, DWT_SIG_RX_TIMEOUT);
+			decamutexoff(stat);
         }
     }
 
@@ -1229,6 +2344,8 @@ void instance_close(void)
     Sleep(1);   //200 us to wake up then waits 5ms for DW1000 XTAL to stabilise
     port_SPIx_set_chip_select();  //CS high
     Sleep(5);
+    port_SPIx_clockstate(DW_CLK_PLL);
+    dwt_invalidateshadow(); //the device has been woken up
     dwt_entersleepaftertx(0); // clear the "enter deep sleep after tx" bit
 
     dwt_setinterrupt(0xFFFFFFFF, 0); //don't allow any interrupts
@@ -1238,41 +2355,40 @@ void instance_close(void)
 
 void instance_notify_DW1000_inIDLE(int idle)
 {
-	instance_data[0].dwIDLE = idle;
+	instance_data[INST_CURRENT].dwIDLE = idle;
 }
 
 
 void instanceconfigantennadelays(uint16 tx, uint16 rx)
 {
-	instance_data[0].txantennaDelay = tx ;
-	instance_data[0].rxantennaDelay = rx ;
+	instance_data[INST_CURRENT].txantennaDelay = tx ;
+	instance_data[INST_CURRENT].rxantennaDelay = rx ;
 
-	instance_data[0].antennaDelayChanged = 1;
+	instance_data[INST_CURRENT].antennaDelayChanged = 1;
 }
 
 void instancesetantennadelays(void)
 {
-	if(instance_data[0].antennaDelayChanged == 1)
+	if(instance_data[INST_CURRENT].antennaDelayChanged == 1)
 	{
-		dwt_setrxantennadelay(instance_data[0].rxantennaDelay);
-		dwt_settxantennadelay(instance_data[0].txantennaDelay);
+		dwt_setrxantennadelay(instance_data[INST_CURRENT].rxantennaDelay);
+		dwt_settxantennadelay(instance_data[INST_CURRENT].txantennaDelay);
 
-		instance_data[0].antennaDelayChanged = 0;
+		instance_data[INST_CURRENT].antennaDelayChanged = 0;
 	}
 }
 
 
 uint16 instancetxantdly(void)
 {
-	return instance_data[0].txantennaDelay;
+	return instance_data[INST_CURRENT].txantennaDelay;
 }
 
 uint16 instancerxantdly(void)
 {
-	return instance_data[0].rxantennaDelay;
+	return instance_data[INST_CURRENT].rxantennaDelay;
 }
 
-#endif
 
 
 /* ==========================================================
@@ -53,15 +53,39 @@ int instance_mode = ANCHOR;
 uint8 s1switch = 0;
 int chan, tagaddr, ancaddr;
 
+//set once the DW1000 has been reset and initialised, a mode switch then only re-configures it (see inittestapplication)
+static uint8 dwInitialised = 0;
+//duration (us) of the last inittestapplication() and whether it was a fast mode switch
+uint32 modeSwitch_us = 0;
+uint8 modeSwitchFast = 0;
+#if (SPI_BENCHMARK == 1)
+//SPI throughput at each prescaler, measured after initialisation
+spi_bench_t spiBench[SPI_BENCH_RATES];
+#endif
+#if (EV_BENCHMARK == 1)
+//event queue throughput, measured after initialisation
+ev_bench_t evBench;
+#endif
+
 #define LCD_BUFF_LEN (100)
 uint8 dataseq[LCD_BUFF_LEN];
 uint8 dataseq1[LCD_BUFF_LEN];
 
 #define PULSE_1 20 //Dure du pulse en ms
 #define PULSE_2 100 //Dure du pulse en ms
+#define PULSE_1_PERIOD 2000 //Priode des pulses en ms
+#define PULSE_2_PERIOD 1000 //Priode des pulses en ms
+#define DOOR_HOLD 1000 //Dure minimale d'ouverture en mode toggle, en ms
 
 int ranging = 0;
 double max_range = 0;
+
+#define IDLE_BLINK_TICKS (CLOCKS_PER_SEC / 10) //LED blink period while not ranging (100 ms)
+static uint32 idleBlinkTick = 0;
+//MCU duty cycle: time (per mille) it was not sleeping in portIdle(), and its wake ups, updated every second
+uint16 mcuDuty = 1000;
+uint32_t mcuWakeups = 0;
+static uint32 mcuDutyTick = 0;
 int n = 1000; // Number defined to read the analog value after N cycles.
 
 typedef struct
@@ -204,13 +228,14 @@ int decarangingmode(uint8 s1switch)
     return mode;
 }
 
-uint32 inittestapplication(uint8 s1switch)
+// hard reset and initialise the DW1000
+// Returns the device ID on success and -1 on error
+static uint32 initdw1000(void)
 {
     uint32 devID ;
-    instanceConfig_t instConfig;
     int result;
 
-    SPI_ConfigFastRate(SPI_BaudRatePrescaler_32);  //max SPI before PLLs configured is ~4M
+    port_SPIx_clockstate(DW_CLK_XTI);  //max SPI before PLLs configured is ~4M
 
     //this is called here to wake up the device (i.e. if it was in sleep mode before the restart)
     devID = instancereaddeviceid() ;
@@ -235,7 +260,7 @@ uint32 inittestapplication(uint8 s1switch)
     result = instance_init() ;
     if (0 > result) return(-1) ; // Some failure has occurred
 
-    SPI_ConfigFastRate(SPI_BaudRatePrescaler_4); //increase SPI to max
+    port_SPIx_clockstate(DW_CLK_PLL); //increase SPI to max
     devID = instancereaddeviceid() ;
 
     if (DWT_DEVICE_ID != devID)   // Means it is NOT MP device
@@ -244,6 +269,40 @@ uint32 inittestapplication(uint8 s1switch)
         return(-1) ;
     }
 
+    return devID;
+}
+
+uint32 inittestapplication(uint8 s1switch)
+{
+    uint32 devID = 0;
+    instanceConfig_t instConfig;
+    uint32 startCycles = portGetCycleCount();
+
+    //fast mode switch: the device is awake and has been initialised - no reset, microcode load or full configuration,
+    //instance_config() only writes the registers that depend on the changed settings
+    //(not if it is asleep or was left on its crystal, e.g. by the CW mode)
+    modeSwitchFast = 0;
+    if(dwInitialised && (port_SPIx_getclockstate() == DW_CLK_PLL))
+    {
+        devID = instancereaddeviceid() ;
+        modeSwitchFast = (DWT_DEVICE_ID == devID);
+    }
+
+    if(modeSwitchFast)
+    {
+        instance_reinit();
+    }
+    else
+    {
+        dwInitialised = 0;
+
+        devID = initdw1000();
+        if(devID == (uint32)-1)
+        {
+            return(-1) ;
+        }
+    }
+
 
     if(s1switch & SWS1_ANC_MODE)
     {
@@ -275,8 +334,20 @@ uint32 inittestapplication(uint8 s1switch)
 
     instancesettagsleepdelay(POLL_SLEEP_DELAY, BLINK_SLEEP_DELAY); //set the Tag sleep time
 
+    instancesetanchorindex(instance_anchaddr); //set the response slot used after a broadcast poll
+
     instance_init_timings();
 
+    dwInitialised = 1;
+    modeSwitch_us = (portGetCycleCount() - startCycles) / (SystemCoreClock / 1000000);
+
+#if (SPI_BENCHMARK == 1)
+    instspibenchmark(spiBench);
+#endif
+#if (EV_BENCHMARK == 1)
+    instevbenchmark(&evBench);
+#endif
+
     return devID;
 }
 /**
@@ -595,15 +666,15 @@ int main(void)
 	//if delayed TX scheduled but did not happen after expected time then it has failed... (has to be < slot period)
 	//if anchor just go into RX and wait for next message from tags/anchors
 	//if tag handle as a timeout
-	if((instance_data[0].monitor == 1) && ((portGetTickCnt() - instance_data[0].timeofTx) > instance_data[0].finalReplyDelay_ms))
+	if((instance_data[INST_CURRENT].monitor == 1) && ((portGetTickCnt() - instance_data[INST_CURRENT].timeofTx) > instance_data[INST_CURRENT].finalReplyDelay_ms))
 	{
-		instance_data[0].wait4ack = 0;
+		instance_data[INST_CURRENT].wait4ack = 0;
 
 		dwt_forcetrxoff();	//this will clear all events
 		//enable the RX
-		instance_data[0].testAppState = TA_RXE_WAIT ;
+		instance_data[INST_CURRENT].testAppState = TA_RXE_WAIT ;
 
-		instance_data[0].monitor = 0;
+		instance_data[INST_CURRENT].monitor = 0;
 	}
 
 	if(instancenewrange())
@@ -648,53 +719,48 @@ int main(void)
 		{
 			led_on(LED_PB7); // Red LED means that the anchor is not linked with any tag
 			led_off(LED_PB6);
-			GPIO_WriteBit(DOOR_GPIO, DOOR_GPIO_PIN, Bit_RESET); // Door closed in this case
+			port_DoorClose(); // Door closed in this case
 		}
 		else
 		{
 			led_on(LED_PB6); // Green LED means that the anchor is linked with one tag
 			led_off(LED_PB7);
 			n = sprintf((char*)&dataseq[0], "ia%04x t%04x %08x %08x %04x %04x %04x a", aaddr, taddr, rng, rng_raw, l, txa, rxa);
+#if (BROADCAST_POLL == 1)
+			//broadcast poll: the range with each anchor that responded (anchor address, range in mm)
+			n = sprintf((char*)&dataseq1[0], "ib");
+			for(p = 0; p < ANCHOR_LIST_SIZE; p++)
+			{
+				if(instance_get_bcrangemask() & (1 << p))
+				{
+					n += sprintf((char*)&dataseq1[n], " %04x %08x", instance_get_bcrangeaddr(p), (int) (instance_get_bcrange(p)*1000));
+				}
+			}
+#ifdef USB_SUPPORT
+			send_usbmessage(&dataseq1[0], n); //the "ib" line has the range of the "ia" line (first response slot)
+#endif
+#else
+#ifdef USB_SUPPORT
+			send_usbmessage(&dataseq[0], n);
+#endif
+#endif
 
 			//Dipswitch1 on, toggle mode
 			if(GPIO_ReadInputDataBit(DIPSWITCH_GPIO, DIPSWITCH1_GPIO_PIN))
 			{
-				GPIO_WriteBit(DOOR_GPIO, DOOR_GPIO_PIN, Bit_SET); // Door opened in this case
-				Sleep(1000);
+				port_DoorOpen(PORT_MS_TO_TICKS(DOOR_HOLD)); // Door opened in this case
 			}
 
-			//dipswitch1 off, dipswitch2 on, pulse of 0,05s every 0,5s
-			else if(!GPIO_ReadInputDataBit(DIPSWITCH_GPIO, DIPSWITCH1_GPIO_PIN) && GPIO_ReadInputDataBit(DIPSWITCH_GPIO, DIPSWITCH2_GPIO_PIN))
+			//dipswitch1 off, dipswitch2 on, pulse of 0,1s every 1s
+			else if(GPIO_ReadInputDataBit(DIPSWITCH_GPIO, DIPSWITCH2_GPIO_PIN))
 			{
-				/*p--;
-				if(p <= 100)
-				{*/
-					GPIO_WriteBit(DOOR_GPIO, DOOR_GPIO_PIN, Bit_SET);
-					Sleep(PULSE_2);
-				/*}
-				if(p == 0)
-				{*/
-					GPIO_WriteBit(DOOR_GPIO, DOOR_GPIO_PIN, Bit_RESET);
-					Sleep(1000-PULSE_2);
-					/*p = 1000;
-				}*/
+				port_DoorPulse(PORT_MS_TO_TICKS(PULSE_2), PORT_MS_TO_TICKS(PULSE_2_PERIOD));
 			}
 
-			//dipswitch1 off, dipswitch2 off, pulse of 0,05s every 2s
-			else if(!GPIO_ReadInputDataBit(DIPSWITCH_GPIO, DIPSWITCH1_GPIO_PIN) && GPIO_ReadInputDataBit(DIPSWITCH_GPIO, DIPSWITCH2_GPIO_PIN))
+			//dipswitch1 off, dipswitch2 off, pulse of 0,02s every 2s
+			else
 			{
-				/*p--;
-				if(p <= 100)
-				{*/
-					GPIO_WriteBit(DOOR_GPIO, DOOR_GPIO_PIN, Bit_SET);
-					Sleep(1000-PULSE_1);
-				/*}
-				if(p == 0)
-				{*/
-					GPIO_WriteBit(DOOR_GPIO, DOOR_GPIO_PIN, Bit_RESET);
-					Sleep(1000-PULSE_1);
-					/*p = 4000;
-				}*/
+				port_DoorPulse(PORT_MS_TO_TICKS(PULSE_1), PORT_MS_TO_TICKS(PULSE_1_PERIOD));
 			}
 		}
 
@@ -702,8 +768,12 @@ int main(void)
 
 	}
 
-	if(ranging == 0)
+	port_DoorRun();
+
+	if((ranging == 0) && ((portGetTickCount() - idleBlinkTick) >= IDLE_BLINK_TICKS))
 	{
+		idleBlinkTick = portGetTickCount();
+
 		if(GPIO_ReadOutputDataBit(GPIOB, GPIO_Pin_7))
 		{
 			led_on(LED_PB6); // Red LED means that the anchor is not linked with any tag
@@ -718,8 +788,6 @@ int main(void)
 		memcpy(&dataseq[0], (const uint8 *) "NOPE", 16);
 		LCD_GLASS_DisplayString(dataseq); //send some data*/
 
-		Sleep(100);
-
 		if(instanceanchorwaiting())
 		{
 			toggle+=2;
@@ -803,9 +871,30 @@ int main(void)
 
 */
 
+	if((portGetTickCount() - mcuDutyTick) >= CLOCKS_PER_SEC)
+	{
+		mcuDutyTick = portGetTickCount();
+		mcuDuty = portGetDutyCycle(&mcuWakeups);
+	}
+
+#if (DWINTERRUPT_EN == 1)
+	//sleep until the DW1000 (or USB) interrupts or a timer of the instance (or the LED blink) is due
+	{
+		uint32 idle = instance_idletime();
+		uint32 blink = portGetTickCount() - idleBlinkTick;
+		uint32 door = port_DoorIdleTime();
 
+		if(idle > door) idle = door;
 
+		if(ranging == 0)
+		{
+			blink = (blink >= IDLE_BLINK_TICKS) ? 0 : (IDLE_BLINK_TICKS - blink);
+			if(idle > blink) idle = blink;
+		}
 
+		portIdle(idle);
+	}
+#endif
     }
 
     return 0;
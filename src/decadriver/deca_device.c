@@ -10,6 +10,8 @@
  *
  */
 
+#include <string.h>
+
 #include "deca_types.h"
 #include "deca_param_types.h"
 #include "deca_regs.h"
@@ -46,12 +48,32 @@ uint32 _dwt_otpread(uint32 address);
 uint32 _dwt_otpprogword32(uint32 data, uint16 address);
 //upload the device configuration into always on memory
 void _dwt_aonarrayupload(void);
+//issue one SPI transaction (and count it)
+int _dwt_spiwrite(uint16 headerLength, const uint8 *headerBuffer, uint32 length, const uint8 *buffer);
+int _dwt_spiread(uint16 headerLength, const uint8 *headerBuffer, uint32 length, uint8 *buffer);
+//shadow registers: read through the cache, keep the cache in step with the writes
+uint32 _dwt_readshadow(int id);
+void _dwt_shadowupdate(uint16 recordNumber, uint16 index, uint32 length, const uint8 *buffer);
+//baseband settings shared by dwt_configure() and dwt_reconfigure()
+uint32 _dwt_chanctrl(dwt_config_t *config);
+void _dwt_configdtune1b(dwt_config_t *config);
+//queue a register access in the current batch
+int _dwt_batchqueue(uint16 recordNumber, uint16 index, uint16 headerLength, const uint8 *headerBuffer, uint32 length, const uint8 *wrBuffer, uint8 *rdBuffer);
 // -------------------------------------------------------------------------------------------------------------------
 
 /*!
  * Static data for DW1000 DecaWave Transceiver control
  */
 
+// -------------------------------------------------------------------------------------------------------------------
+// shadow registers: registers only the host changes, a read-modify-write of these does not need the SPI read
+#define DWT_SHADOW_SYS_MASK		(0)
+#define DWT_SHADOW_ACK_RESP_T	(1)
+#define DWT_SHADOW_PMSC_CTRL0	(2)
+#define DWT_SHADOW_PMSC_CTRL1	(3)
+#define DWT_SHADOW_GPIO_MODE	(4)
+#define DWT_SHADOW_NUM			(5)
+
 // -------------------------------------------------------------------------------------------------------------------
 // structure to hold device data
 typedef struct
@@ -68,10 +90,14 @@ typedef struct
     uint32      antennaDly;         // antenna delay read from OTP 64 PRF value is in high 16 bits and 16M PRF in low 16 bits
     uint8       xtrim;              // xtrim value read from OTP
     uint8       dblbuffon;          // double rx buffer mode flag
+    uint8       rxbufsync;          // set when the host/IC rx buffer pointers were re-aligned (e.g. by dwt_forcetrxoff()) inside the rx callback
     uint32      sysCFGreg ;         // local copy of system config register
     uint32      txPowCfg[12];       // stores the Tx power configuration read from OTP (6 channels consecutively with PRF16 then 64, e.g. Ch 1 PRF16 is index 0 and 64 index 1)
 
     dwt_callback_data_t cdata;      // callback data structure
+    uint8       *rxPrefetchBuf ;    // buffer the good frames are read into by dwt_isr() (see dwt_setrxprefetch())
+    uint16      rxPrefetchLen ;
+    uint16      rxPrefetchHdr ;     // header-first: only this many bytes are prefetched (0 for the whole frame)
 
     uint32      states[3] ;         //MP workaround debug states register
     uint8       statescount ;
@@ -80,12 +106,74 @@ typedef struct
 
 	uint32		ldoTune ;			//low 32 bits of LDO tune value
 
+	uint32		shadow[DWT_SHADOW_NUM] ; //copies of the registers only the host changes (see _dwt_shadowreg)
+	uint8		shadowValid ;		//bit n set when shadow[n] holds the register value
+
+	dwt_otpsnapshot_t otp ;			//calibration words read from OTP by dwt_initialise() (see dwt_getotpsnapshot())
+	const dwt_otpsnapshot_t *otpSnapshot ; //stored snapshot dwt_initialise() uses instead of the OTP (part ID match)
+
+	dwt_config_t	config ;		//configuration the device has, for dwt_reconfigure()
+	dwt_txconfig_t	txconfig ;
+	uint8		configValid ;		//DWT_CFG_VALID_xxx bits
+
     void (*dwt_txcallback)(const dwt_callback_data_t *txd);
     void (*dwt_rxcallback)(const dwt_callback_data_t *rxd);
 
 } dwt_local_data_t ;
 
-static dwt_local_data_t dw1000local ; // Static local device data
+static dwt_local_data_t dw1000local[DWT_NUM_DW_DEV] ; // Static local device data
+
+#if (DWT_NUM_DW_DEV > 1)
+static dwt_local_data_t *pdw1000local = dw1000local ; // device the API calls apply to (see dwt_setlocaldataptr())
+#else
+#define pdw1000local	dw1000local		// single device: same code as a plain static structure
+#endif
+
+#define DWT_CFG_VALID_RF	0x1		// pdw1000local->config is programmed in the device
+#define DWT_CFG_VALID_TX	0x2		// pdw1000local->txconfig is programmed in the device
+
+// registers held in pdw1000local->shadow (32-bit, in DWT_SHADOW_xxx order)
+static const struct
+{
+    uint16 recordNumber ;
+    uint16 index ;
+} _dwt_shadowreg[DWT_SHADOW_NUM] =
+{
+    {SYS_MASK_ID, 0},
+    {ACK_RESP_T_ID, 0},
+    {PMSC_ID, PMSC_CTRL0_OFFSET},
+    {PMSC_ID, PMSC_CTRL1_OFFSET},
+    {GPIO_CTRL_ID, GPIO_MODE_OFFSET}
+} ;
+
+// -------------------------------------------------------------------------------------------------------------------
+// batch of queued register accesses (see dwt_batchbegin())
+#define DWT_BATCH_MAX_OPS		(24)
+#define DWT_BATCH_BUF_LEN		(128)	// write data of the queued accesses
+
+typedef struct
+{
+    uint8       header[3] ;
+    uint8       headerLength ;
+    uint16      recordNumber ;
+    uint16      index ;
+    uint16      length ;
+    uint16      offset ;            // offset of the write data in the batch buffer
+    uint8       *rdBuffer ;         // read buffer, NULL for a write
+} dwt_batchop_t ;
+
+typedef struct
+{
+    uint8       depth ;             // nesting depth of dwt_batchbegin() calls, 0 when no batch is open
+    decaIrqStatus_t irqStat ;       // DW1000 interrupt state saved by the outermost dwt_batchbegin()
+    uint8       numOps ;
+    uint16      dataLen ;
+    dwt_batchop_t op[DWT_BATCH_MAX_OPS] ;
+    uint8       data[DWT_BATCH_BUF_LEN] ;
+} dwt_batch_t ;
+
+static dwt_batch_t dw1000batch ;
+static dwt_spistats_t dw1000spistats ;
 
 /*! ------------------------------------------------------------------------------------------------------------------
  * @fn dwt_initialise()
@@ -122,26 +210,60 @@ static dwt_local_data_t dw1000local ; // Static local device data
 #define ANTDLY_ADDRESS (0x1C)
 #define XTRIM_ADDRESS  (0x1E)
 
+#define DWT_OTPSNAP_MAGIC	(0xDECA0713)	// check word seed of a snapshot, an erased or partly written one fails the check
+
+/*! ------------------------------------------------------------------------------------------------------------------
+ * @fn _dwt_otpsnapcheck()
+ *
+ * @brief This function returns the check word of an OTP snapshot
+ *
+ * input parameters
+ * @param snapshot - pointer to the snapshot
+ *
+ * output parameters
+ *
+ * returns the check word
+ */
+static uint32 _dwt_otpsnapcheck(const dwt_otpsnapshot_t *snapshot)
+{
+    uint32 check = DWT_OTPSNAP_MAGIC ;
+    int i ;
+
+    check += snapshot->partID + snapshot->lotID + snapshot->ldoTune + snapshot->xtrim + snapshot->antennaDly ;
+
+    for(i=0; i<12; i++)
+    {
+        check += snapshot->txPowCfg[i] ;
+    }
+
+    return check ;
+}
+
 int dwt_initialise(uint16 config)
 {
     int i = 0;
 	uint8 plllockdetect = EC_CTRL_PLLLCK;
 	uint16 otp_addr = 0;
+	dwt_otpsnapshot_t *otp = &pdw1000local->otp;
 
-    dw1000local.statescount = 0;
-    dw1000local.dblbuffon = 0; //double mode off by default
-    dw1000local.prfIndex = 0; //16M
-    dw1000local.cdata.aatset = 0;
-	dw1000local.ldoTune = 0;
-    dw1000local.wait4resp = 0;
+    pdw1000local->statescount = 0;
+    pdw1000local->dblbuffon = 0; //double mode off by default
+    pdw1000local->rxbufsync = 0;
+    pdw1000local->prfIndex = 0; //16M
+    pdw1000local->cdata.aatset = 0;
+	pdw1000local->ldoTune = 0;
+    pdw1000local->wait4resp = 0;
 
-    dw1000local.dwt_txcallback = NULL ;
-    dw1000local.dwt_rxcallback = NULL ;
+    pdw1000local->dwt_txcallback = NULL ;
+    pdw1000local->dwt_rxcallback = NULL ;
 
-    dw1000local.deviceID =  dwt_readdevid() ;
+    dwt_invalidateshadow() ;
+    pdw1000local->configValid = 0 ;
+
+    pdw1000local->deviceID =  dwt_readdevid() ;
 
     // read and validate device ID return -1 if not recognized
-    if (DWT_DEVICE_ID != dw1000local.deviceID) // MP IC ONLY (i.e. DW1000) FOR THIS CODE
+    if (DWT_DEVICE_ID != pdw1000local->deviceID) // MP IC ONLY (i.e. DW1000) FOR THIS CODE
     {
         return DWT_ERROR ;
     }
@@ -151,16 +273,37 @@ int dwt_initialise(uint16 config)
 	//configure the CPLL lock detect
 	dwt_writetodevice(EXT_SYNC_ID, EC_CTRL_OFFSET, 1, &plllockdetect); //
 
+	//the calibration words are read from the OTP once, the stored snapshot of this part is used instead if there is one
+	otp->partID = _dwt_otpread(PARTID_ADDRESS);
+
+	if((pdw1000local->otpSnapshot != NULL) && (pdw1000local->otpSnapshot->partID == otp->partID)
+		&& (pdw1000local->otpSnapshot->check == _dwt_otpsnapcheck(pdw1000local->otpSnapshot)))
+	{
+		*otp = *pdw1000local->otpSnapshot;
+	}
+	else
+	{
+		otp->lotID = _dwt_otpread(LOTID_ADDRESS);
+		otp->ldoTune = _dwt_otpread(LDOTUNE_ADDRESS);
+		otp->xtrim = _dwt_otpread(XTRIM_ADDRESS);
+		otp->antennaDly = _dwt_otpread(ANTDLY_ADDRESS);
+		for(i=0; i<12; i++)
+		{
+			otp->txPowCfg[i] = _dwt_otpread(TXCFG_ADDRESS+i);
+		}
+		otp->check = _dwt_otpsnapcheck(otp);
+	}
+
 	//read OTP revision number
-	otp_addr = _dwt_otpread(XTRIM_ADDRESS) & 0xffff;        // Read 32 bit value, XTAL trim val is in low octet-0 (5 bits)
-	dw1000local.otprev = (otp_addr >> 8) & 0xff;			// OTP revision is next byte
+	otp_addr = otp->xtrim & 0xffff;        // 32 bit value, XTAL trim val is in low octet-0 (5 bits)
+	pdw1000local->otprev = (otp_addr >> 8) & 0xff;			// OTP revision is next byte
 
 	if(config & DWT_LOADLDOTUNE)
 	{
-		dw1000local.ldoTune = _dwt_otpread(LDOTUNE_ADDRESS);
+		pdw1000local->ldoTune = otp->ldoTune;
 	}
 
-	if((dw1000local.ldoTune & 0xFF) != 0) //LDO tune values are stored in the OTP
+	if((pdw1000local->ldoTune & 0xFF) != 0) //LDO tune values are stored in the OTP
 	{
 		uint8 ldok = OTP_SF_LDO_KICK;
 		//kick LDO tune
@@ -168,48 +311,48 @@ int dwt_initialise(uint16 config)
 	}
 	else
 	{
-		dw1000local.ldoTune = 0;
+		pdw1000local->ldoTune = 0;
 	}
 
-    dw1000local.partID = _dwt_otpread(PARTID_ADDRESS);
+    pdw1000local->partID = otp->partID;
 
-    dw1000local.lotID = _dwt_otpread(LOTID_ADDRESS);
+    pdw1000local->lotID = otp->lotID;
 
     if(config & DWT_LOADANTDLY)
 	{
-        dw1000local.antennaDly = _dwt_otpread(ANTDLY_ADDRESS);
+        pdw1000local->antennaDly = otp->antennaDly;
 	}
     else
 	{
-        dw1000local.antennaDly = 0;
+        pdw1000local->antennaDly = 0;
 	}
 
     if(config & DWT_LOADXTALTRIM)
     {
-        dw1000local.xtrim = otp_addr & 0x1F;
+        pdw1000local->xtrim = otp_addr & 0x1F;
 
-        if ( !dw1000local.xtrim )
+        if ( !pdw1000local->xtrim )
 		{
-        	  dw1000local.xtrim = pll2calcfg & 0x1F ; // set to mid-range if no calibration value inside
+        	  pdw1000local->xtrim = pll2calcfg & 0x1F ; // set to mid-range if no calibration value inside
     	}
     }
     else
     {
-    	dw1000local.xtrim = pll2calcfg & 0x1F ; // set to mid-range default as described in UM 8.1.1 Calibration Method
+    	pdw1000local->xtrim = pll2calcfg & 0x1F ; // set to mid-range default as described in UM 8.1.1 Calibration Method
     }
 
     if(config & DWT_LOADTXCONFIG)
     {
         for(i=0; i<12; i++)
         {
-            dw1000local.txPowCfg[i] = _dwt_otpread(TXCFG_ADDRESS+i);
+            pdw1000local->txPowCfg[i] = otp->txPowCfg[i];
         }
     }
     else
     {
         for(i=0; i<12; i++)
         {
-            dw1000local.txPowCfg[i] = 0;
+            pdw1000local->txPowCfg[i] = 0;
         }
     }
 
@@ -228,12 +371,12 @@ int dwt_initialise(uint16 config)
     _dwt_enableclocks(ENABLE_ALL_SEQ); //enable clocks for sequencing
 
     //read system register / store local copy
-    dw1000local.sysCFGreg = dwt_read32bitreg(SYS_CFG_ID) ;            // read sysconfig register
+    pdw1000local->sysCFGreg = dwt_read32bitreg(SYS_CFG_ID) ;            // read sysconfig register
 
     {
         uint32 reg;
         // Set up MFIO
-        reg = dwt_read32bitreg(GPIO_CTRL_ID);
+        reg = _dwt_readshadow(DWT_SHADOW_GPIO_MODE);
         //reg |= 0x00014000 ; //7 and 8 to mode - to be used with PA
 		reg |= 0x00050000 ; //8 and 9 to mode - RX/TX testing
         dwt_write32bitreg(GPIO_CTRL_ID,reg);
@@ -246,6 +389,43 @@ int dwt_initialise(uint16 config)
 
 } // end dwt_initialise()
 
+/*! ------------------------------------------------------------------------------------------------------------------
+ * @fn dwt_setotpsnapshot()
+ *
+ * @brief This function gives dwt_initialise() a stored snapshot of the OTP calibration words (e.g. kept in the host
+ * non-volatile memory), it is used instead of reading the OTP if its part ID is the device's one and its check word
+ * is good. The snapshot must stay valid (it is not copied).
+ *
+ * input parameters
+ * @param snapshot - pointer to the snapshot, NULL to always read the OTP
+ *
+ * output parameters
+ *
+ * no return value
+ */
+void dwt_setotpsnapshot(const dwt_otpsnapshot_t *snapshot)
+{
+    pdw1000local->otpSnapshot = snapshot ;
+}
+
+/*! ------------------------------------------------------------------------------------------------------------------
+ * @fn dwt_getotpsnapshot()
+ *
+ * @brief This function returns the snapshot of the OTP calibration words of the device (as used by the last
+ * dwt_initialise()), to be stored by the host and given back with dwt_setotpsnapshot()
+ *
+ * input parameters
+ *
+ * output parameters
+ * @param snapshot - pointer to the snapshot to fill
+ *
+ * no return value
+ */
+void dwt_getotpsnapshot(dwt_otpsnapshot_t *snapshot)
+{
+    *snapshot = pdw1000local->otp ;
+}
+
 /*! ------------------------------------------------------------------------------------------------------------------
  * Function: dwt_otprevision()
  *
@@ -259,7 +439,7 @@ int dwt_initialise(uint16 config)
  */
 uint8 dwt_otprevision(void)
 {
-	return dw1000local.otprev ;
+	return pdw1000local->otprev ;
 }
 
 /*! ------------------------------------------------------------------------------------------------------------------
@@ -275,14 +455,12 @@ uint8 dwt_otprevision(void)
  */
 void dwt_setGPIOforEXTTRX(void)
 {
-    uint8 buf[GPIO_MODE_LEN];
+    uint32 reg = _dwt_readshadow(DWT_SHADOW_GPIO_MODE);
 
     // Set the GPIO to control external PA/LNA
-    dwt_readfromdevice(GPIO_CTRL_ID, GPIO_MODE_OFFSET, GPIO_MODE_LEN, buf);
+    reg |= (uint32)(GPIO_PIN5_EXTTXE_8 + GPIO_PIN6_EXTRXE_8) << (8 * GPIO_LNA_byte_no);
 
-    buf[GPIO_LNA_byte_no] |= (GPIO_PIN5_EXTTXE_8 + GPIO_PIN6_EXTRXE_8);
-
-    dwt_writetodevice(GPIO_CTRL_ID, GPIO_MODE_OFFSET, GPIO_MODE_LEN, buf);
+    dwt_write32bitoffsetreg(GPIO_CTRL_ID, GPIO_MODE_OFFSET, reg);
 }
 
 
@@ -349,7 +527,7 @@ void dwt_setGPIOvalue(uint32 gpioNum, uint32 value)
  */
 uint32 dwt_getldotune(void)
 {
-	return dw1000local.ldoTune;
+	return pdw1000local->ldoTune;
 }
 
 /*! ------------------------------------------------------------------------------------------------------------------
@@ -365,7 +543,7 @@ uint32 dwt_getldotune(void)
  */
 uint32 dwt_getpartid(void)
 {
-    return dw1000local.partID;
+    return pdw1000local->partID;
 }
 
 /*! ------------------------------------------------------------------------------------------------------------------
@@ -381,7 +559,7 @@ uint32 dwt_getpartid(void)
  */
 uint32 dwt_getlotid(void)
 {
-    return dw1000local.lotID;
+    return pdw1000local->lotID;
 }
 
 /*! ------------------------------------------------------------------------------------------------------------------
@@ -424,6 +602,8 @@ void dwt_configuretxrf(dwt_txconfig_t *config)
     //Configure TX power
     dwt_write32bitreg(TX_POWER_ID, config->power);
 
+    pdw1000local->txconfig = *config ;
+    pdw1000local->configValid |= DWT_CFG_VALID_TX ;
 }
 
 
@@ -442,7 +622,7 @@ void dwt_configuretxrf(dwt_txconfig_t *config)
  */
 uint32 dwt_getotptxpower(uint8 prf, uint8 chan)
 {
-    return dw1000local.txPowCfg[(prf - DWT_PRF_16M) + (chan_idx[chan] * 2)];
+    return pdw1000local->txPowCfg[(prf - DWT_PRF_16M) + (chan_idx[chan] * 2)];
 }
 
 
@@ -467,15 +647,12 @@ uint32 dwt_getotptxpower(uint8 prf, uint8 chan)
  */
 int dwt_configure(dwt_config_t *config, uint8 use_otpconfigvalues)
 {
-    uint8 nsSfd_result  = 0;
-    uint8 useDWnsSFD = 0;
     uint8 chan = config->chan ;
-    uint32 regval ;
     uint16 reg16 = lde_replicaCoeff[config->rxCode];
-    uint8 prfIndex = dw1000local.prfIndex = config->prf - DWT_PRF_16M;
+    uint8 prfIndex = pdw1000local->prfIndex = config->prf - DWT_PRF_16M;
     uint8 bw = ((chan == 4) || (chan == 7)) ? 1 : 0 ; //select wide or narrow band
 
-    dw1000local.chan = config->chan ;
+    pdw1000local->chan = config->chan ;
 
 #ifdef DWT_API_ERROR_CHECK
     if (config->dataRate > DWT_BR_6M8)
@@ -528,20 +705,22 @@ int dwt_configure(dwt_config_t *config, uint8 use_otpconfigvalues)
     // for 110 kbps we need to special setup
     if(DWT_BR_110K == config->dataRate)
     {
-        dw1000local.sysCFGreg |= SYS_CFG_RXM110K ;
+        pdw1000local->sysCFGreg |= SYS_CFG_RXM110K ;
 
         reg16 >>= 3;  //div by 8
     }
     else
     {
-        dw1000local.sysCFGreg &= (~SYS_CFG_RXM110K) ;
+        pdw1000local->sysCFGreg &= (~SYS_CFG_RXM110K) ;
     }
 
-    dw1000local.longFrames = config->phrMode ;
+    pdw1000local->longFrames = config->phrMode ;
 
-    dw1000local.sysCFGreg |= (SYS_CFG_PHR_MODE_11 & (config->phrMode << 16)) ;
+    pdw1000local->sysCFGreg |= (SYS_CFG_PHR_MODE_11 & (config->phrMode << 16)) ;
 
-    dwt_write32bitreg(SYS_CFG_ID,dw1000local.sysCFGreg) ;
+    dwt_batchbegin() ; // issue the configuration writes in one pass
+
+    dwt_write32bitreg(SYS_CFG_ID,pdw1000local->sysCFGreg) ;
     //write/set the lde_replicaCoeff
     dwt_write16bitoffsetreg(LDE_IF_ID, LDE_REPC_OFFSET, reg16 ) ;
 
@@ -550,8 +729,16 @@ int dwt_configure(dwt_config_t *config, uint8 use_otpconfigvalues)
 //    config RF pll (for a given channel)
 //    configure PLL2/RF PLL block CFG
     dwt_writetodevice(FS_CTRL_ID, FS_PLLCFG_OFFSET, 5, &pll2_config[chan_idx[chan]][0]);
-    //configure PLL2/RF PLL block CAL
-    dwt_writetodevice(FS_CTRL_ID, FS_XTALT_OFFSET, 1, &pll2calcfg);
+    //configure PLL2/RF PLL block CAL (with the XTAL trim from OTP, so no read back is needed as in dwt_xtaltrim())
+    {
+        uint8 xtalt = pll2calcfg ;
+
+        if (use_otpconfigvalues & DWT_LOADXTALTRIM)
+        {
+            xtalt = (pll2calcfg & ~FS_XTALT_MASK) | (FS_XTALT_MASK & pdw1000local->xtrim) ;
+        }
+        dwt_writetodevice(FS_CTRL_ID, FS_XTALT_OFFSET, 1, &xtalt);
+    }
 
     // Configure RF RX blocks (for specified channel/badwidth)
     dwt_writetodevice(RF_CONF_ID, RF_RXCTRLH_OFFSET, 1, &rx_config[bw]);
@@ -567,25 +754,7 @@ int dwt_configure(dwt_config_t *config, uint8 use_otpconfigvalues)
     //DTUNE1
     dwt_write16bitoffsetreg(DRX_CONF_ID, DRX_TUNE1a_OFFSET, dtune1[prfIndex]);
 
-    if(config->dataRate == DWT_BR_110K)
-    {
-        dwt_write16bitoffsetreg(DRX_CONF_ID, DRX_TUNE1b_OFFSET, 0x64);
-    }
-    else
-    {
-        if(config->txPreambLength == DWT_PLEN_64) //if preamble length is 64
-        {
-            uint8 temp = 0x10;
-            dwt_write16bitoffsetreg(DRX_CONF_ID, DRX_TUNE1b_OFFSET, 0x10);
-            dwt_writetodevice(DRX_CONF_ID, 0x26, 1, &temp);
-        }
-        else
-        {
-            uint8 temp = 0x28;
-            dwt_write16bitoffsetreg(DRX_CONF_ID, DRX_TUNE1b_OFFSET, 0x20);
-            dwt_writetodevice(DRX_CONF_ID, 0x26, 1, &temp);
-        }
-    }
+    _dwt_configdtune1b(config);
 
     //DTUNE2
     dwt_write32bitoffsetreg(DRX_CONF_ID, DRX_TUNE2_OFFSET, digital_bb_config[prfIndex][config->rxPAC]);
@@ -609,209 +778,480 @@ int dwt_configure(dwt_config_t *config, uint8 use_otpconfigvalues)
     {
          //Write non standard (DW) SFD length
          dwt_writetodevice(USR_SFD_ID,0x00,1,&dwnsSFDlen[config->dataRate]);
-         nsSfd_result = 3 ;
-         useDWnsSFD = 1 ;
     }
-    regval =  (CHAN_CTRL_TX_CHAN_MASK & (chan << CHAN_CTRL_TX_CHAN_SHIFT)) |            // Transmit Channel
-              (CHAN_CTRL_RX_CHAN_MASK & (chan << CHAN_CTRL_RX_CHAN_SHIFT)) |            // Receive Channel
-              (CHAN_CTRL_RXFPRF_MASK & (config->prf << CHAN_CTRL_RXFPRF_SHIFT)) |     // RX PRF
-              ((CHAN_CTRL_TNSSFD|CHAN_CTRL_RNSSFD) & (nsSfd_result << CHAN_CTRL_TNSSFD_SHIFT)) |       // nsSFD enable RX&TX
-              (CHAN_CTRL_DWSFD & (useDWnsSFD << CHAN_CTRL_DWSFD_SHIFT)) |      // use DW nsSFD
-              (CHAN_CTRL_TX_PCOD_MASK & (config->txCode << CHAN_CTRL_TX_PCOD_SHIFT)) |  // TX Preamble Code
-              (CHAN_CTRL_RX_PCOD_MASK & (config->rxCode << CHAN_CTRL_RX_PCOD_SHIFT)) ;  // RX Preamble Code
 
-    dwt_write32bitreg(CHAN_CTRL_ID,regval) ;
+    dwt_write32bitreg(CHAN_CTRL_ID,_dwt_chanctrl(config)) ;
 
     // Set up TX Preamble Size and TX PRF
     // Set up TX Ranging Bit and Data Rate
     {
         uint32 x = (config->txPreambLength | config->prf)  <<  16;
-        dw1000local.txFCTRL = x | TX_FCTRL_TR |     /* always set ranging bit !!! */
+        pdw1000local->txFCTRL = x | TX_FCTRL_TR |     /* always set ranging bit !!! */
                                 (config->dataRate << TX_FCTRL_TXBR_SHFT) ;
 
-        dwt_write32bitoffsetreg(TX_FCTRL_ID,0,dw1000local.txFCTRL) ;
-    }
-
-    if (use_otpconfigvalues & DWT_LOADXTALTRIM)
-    {
-        dwt_xtaltrim(dw1000local.xtrim);
+        dwt_write32bitoffsetreg(TX_FCTRL_ID,0,pdw1000local->txFCTRL) ;
     }
 
     if (use_otpconfigvalues & DWT_LOADANTDLY)
     {
         //put half of the antenna delay value into tx and half into rx
-        dwt_setrxantennadelay(((dw1000local.antennaDly >> (16*prfIndex)) & 0xFFFF) >> 1);
-        dwt_settxantennadelay(((dw1000local.antennaDly >> (16*prfIndex)) & 0xFFFF) >> 1);
+        dwt_setrxantennadelay(((pdw1000local->antennaDly >> (16*prfIndex)) & 0xFFFF) >> 1);
+        dwt_settxantennadelay(((pdw1000local->antennaDly >> (16*prfIndex)) & 0xFFFF) >> 1);
     }
 
-    return DWT_SUCCESS ;
+    pdw1000local->config = *config ;
+    pdw1000local->configValid |= DWT_CFG_VALID_RF ;
+
+    return dwt_batchend() ;
 
 } // end dwt_configure()
 
 /*! ------------------------------------------------------------------------------------------------------------------
- * @fn dwt_setrxantennadelay()
+ * @fn _dwt_chanctrl()
  *
- * @brief This API function writes the antenna delay (in time units) to RX registers
+ * @brief This function returns the channel control register value (channels, PRF, SFD and preamble codes)
  *
- * input parameters:
- * @param rxDelay - this is the total (RX) antenna delay value, which
- *                          will be programmed into the RX register
+ * input parameters
+ * @param config    -   pointer to the configuration structure
  *
  * output parameters
  *
- * no return value
+ * returns the CHAN_CTRL value
  */
-void dwt_setrxantennadelay(uint16 rxDelay)
+uint32 _dwt_chanctrl(dwt_config_t *config)
 {
-    // -------------------------------------------------------------------------------------------------------------------
-    // set the antenna delay
-    dw1000local.rfrxDly = rxDelay;
-    dwt_write16bitoffsetreg(LDE_IF_ID,LDE_RXANTD_OFFSET,dw1000local.rfrxDly) ;
+    uint8 nsSfd_result = config->nsSFD ? 3 : 0 ;
+    uint8 useDWnsSFD = config->nsSFD ? 1 : 0 ;
+
+    return (CHAN_CTRL_TX_CHAN_MASK & (config->chan << CHAN_CTRL_TX_CHAN_SHIFT)) |            // Transmit Channel
+           (CHAN_CTRL_RX_CHAN_MASK & (config->chan << CHAN_CTRL_RX_CHAN_SHIFT)) |            // Receive Channel
+           (CHAN_CTRL_RXFPRF_MASK & (config->prf << CHAN_CTRL_RXFPRF_SHIFT)) |     // RX PRF
+           ((CHAN_CTRL_TNSSFD|CHAN_CTRL_RNSSFD) & (nsSfd_result << CHAN_CTRL_TNSSFD_SHIFT)) |       // nsSFD enable RX&TX
+           (CHAN_CTRL_DWSFD & (useDWnsSFD << CHAN_CTRL_DWSFD_SHIFT)) |      // use DW nsSFD
+           (CHAN_CTRL_TX_PCOD_MASK & (config->txCode << CHAN_CTRL_TX_PCOD_SHIFT)) |  // TX Preamble Code
+           (CHAN_CTRL_RX_PCOD_MASK & (config->rxCode << CHAN_CTRL_RX_PCOD_SHIFT)) ;  // RX Preamble Code
 }
 
 /*! ------------------------------------------------------------------------------------------------------------------
- * @fn dwt_settxantennadelay()
+ * @fn _dwt_configdtune1b()
  *
- * @brief This API function writes the antenna delay (in time units) to TX registers
+ * @brief This function writes the DRX_TUNE1b (and the preamble length dependent tuning) for the data rate and
+ * preamble length of the configuration
  *
- * input parameters:
- * @param txDelay - this is the total (TX) antenna delay value, which
- *                          will be programmed into the TX delay register
+ * input parameters
+ * @param config    -   pointer to the configuration structure
  *
  * output parameters
  *
  * no return value
- *
- */
-void dwt_settxantennadelay(uint16 txDelay)
-{
-    // -------------------------------------------------------------------------------------------------------------------
-    // set the tx antenna delay for auto tx timestamp adjustment
-    dw1000local.rftxDly  = txDelay;
-    dwt_write16bitoffsetreg(TX_ANTD_ID, 0x0, dw1000local.rftxDly) ;
-}
-
-
-/*! ------------------------------------------------------------------------------------------------------------------
- * @fn dwt_readantennadelay()
- *
- * @brief This API function returns the antenna delay read from the OTP memory as part of device initialisation
- * Note: the antenna delay will only be read if dwt_initialise is called with DWT_LOADANTDLY bit set in the config parameter
- *
- * input parameters:
- * @param prf   -   this is the PRF e.g. DWT_PRF_16M or DWT_PRF_64M
- *
  */
-uint16 dwt_readantennadelay(uint8 prf)
+void _dwt_configdtune1b(dwt_config_t *config)
 {
-    // 32-bit antenna delay value previously read from OTP, high 16 bits is value for 64 MHz PRF, low 16-bits for 16 MHz PRF
-    return (dw1000local.antennaDly >> (16*(prf-DWT_PRF_16M))) & 0xFFFF;
+    if(config->dataRate == DWT_BR_110K)
+    {
+        dwt_write16bitoffsetreg(DRX_CONF_ID, DRX_TUNE1b_OFFSET, 0x64);
+    }
+    else
+    {
+        if(config->txPreambLength == DWT_PLEN_64) //if preamble length is 64
+        {
+            uint8 temp = 0x10;
+            dwt_write16bitoffsetreg(DRX_CONF_ID, DRX_TUNE1b_OFFSET, 0x10);
+            dwt_writetodevice(DRX_CONF_ID, 0x26, 1, &temp);
+        }
+        else
+        {
+            uint8 temp = 0x28;
+            dwt_write16bitoffsetreg(DRX_CONF_ID, DRX_TUNE1b_OFFSET, 0x20);
+            dwt_writetodevice(DRX_CONF_ID, 0x26, 1, &temp);
+        }
+    }
 }
 
-
 /*! ------------------------------------------------------------------------------------------------------------------
- * @fn dwt_writetxdata()
+ * @fn dwt_reconfigure()
  *
- * @brief This API function writes the supplied TX data into the DW1000's
- * TX buffer.  The input parameters are the data length in bytes and a pointer
- * to those data bytes.
+ * @brief This function moves a device configured with dwt_configure() (and dwt_configuretxrf()) to a new
+ * configuration without a reset: the new configuration is compared with the one the device has and only the
+ * registers depending on the changed items are written (in one batch).
+ * The transceiver must be off.
  *
  * input parameters
- * @param txFrameLength  - This is the total frame length, including the two byte CRC.
- *                         Note: this is the length of TX message (including the 2 byte CRC) - max is 1023
- *                         standard PHR mode allows up to 127 bytes
- *                         if > 127 is programmed, DWT_PHRMODE_EXT needs to be set in the phrMode configuration
- *                         see dwt_configure function
- * @param txFrameBytes   - Pointer to the users buffer containing the data to send.
- * @param txBufferOffset - This specifies an offset in the DW1000s TX Buffer at which to start writing data.
+ * @param config    -   pointer to the new configuration
+ * @param txconfig  -   pointer to the new TX spectrum configuration (power and PG delay), NULL to keep it
+ * @param use_otpconfigvalues - as for dwt_configure(), DWT_LOADANTDLY loads the antenna delay of a new PRF
  *
  * output parameters
  *
- * returns DWT_DECA_SUCCESS for success, or DWT_DECA_ERROR for error
+ * returns DWT_SUCCESS for success, or DWT_ERROR if the device configuration is not known (e.g. after a reset, use
+ * dwt_configure() and dwt_configuretxrf())
  */
-#pragma GCC optimize ("O3")
-int dwt_writetxdata(uint16 txFrameLength, uint8 *txFrameBytes, uint16 txBufferOffset)
+int dwt_reconfigure(dwt_config_t *config, dwt_txconfig_t *txconfig, uint8 use_otpconfigvalues)
 {
+    dwt_config_t *cur = &pdw1000local->config ;
+    uint8 chan = config->chan ;
+    uint8 prfIndex = config->prf - DWT_PRF_16M ;
+    uint8 chanChg = (chan != cur->chan) ;
+    uint8 prfChg = (config->prf != cur->prf) ;
+    uint8 rateChg = (config->dataRate != cur->dataRate) ;
+    uint8 sfdChg = (config->nsSFD != cur->nsSFD) ;
+    uint8 codeChg = (config->txCode != cur->txCode) || (config->rxCode != cur->rxCode) ;
+
+    if(((pdw1000local->configValid & DWT_CFG_VALID_RF) == 0) ||
+       ((txconfig != NULL) && ((pdw1000local->configValid & DWT_CFG_VALID_TX) == 0)))
+    {
+        return DWT_ERROR ;
+    }
+
 #ifdef DWT_API_ERROR_CHECK
-    if (dw1000local.longFrames)
+    if ((chan < 1) || (chan > 7) || (6 == chan))
     {
-        if (txFrameLength > 1023)
-        {
-        	return DWT_ERROR ;
-        }
+    	return DWT_ERROR ; // validate channel number parameter
     }
-    else
+#endif
+
+    pdw1000local->chan = chan ;
+    pdw1000local->prfIndex = prfIndex ;
+
+    dwt_batchbegin() ; // issue the writes in one pass
+
+    if(rateChg || (config->phrMode != cur->phrMode))
     {
-        if (txFrameLength > 127)
+        pdw1000local->sysCFGreg &= ~(SYS_CFG_RXM110K | SYS_CFG_PHR_MODE_11) ;
+        if(DWT_BR_110K == config->dataRate)
         {
-        	return DWT_ERROR ;
+            pdw1000local->sysCFGreg |= SYS_CFG_RXM110K ;
         }
+        pdw1000local->sysCFGreg |= (SYS_CFG_PHR_MODE_11 & (config->phrMode << 16)) ;
+        pdw1000local->longFrames = config->phrMode ;
+
+        dwt_write32bitreg(SYS_CFG_ID,pdw1000local->sysCFGreg) ;
     }
-    if (txFrameLength < 2)
+
+    if(rateChg || (config->rxCode != cur->rxCode))
     {
-    	return DWT_ERROR ;
+        uint16 reg16 = lde_replicaCoeff[config->rxCode];
+
+        if(DWT_BR_110K == config->dataRate)
+        {
+            reg16 >>= 3;  //div by 8
+        }
+        dwt_write16bitoffsetreg(LDE_IF_ID, LDE_REPC_OFFSET, reg16 ) ;
     }
-#endif
 
-    if ((txBufferOffset + txFrameLength) > 1024)
+    if(prfChg)
     {
-        return DWT_ERROR ;
+        _dwt_configlde(prfIndex);
+        dwt_write16bitoffsetreg(DRX_CONF_ID, DRX_TUNE1a_OFFSET, dtune1[prfIndex]);
+        dwt_write16bitoffsetreg( AGC_CFG_STS_ID, 0x4, agc_config.target[prfIndex]);
     }
-    // write the data to the IC TX buffer, (-2 bytes for auto generated CRC)
-    dwt_writetodevice( TX_BUFFER_ID, txBufferOffset, txFrameLength-2, txFrameBytes) ;
 
+    if(chanChg)
+    {
+        uint8 bw = ((chan == 4) || (chan == 7)) ? 1 : 0 ; //select wide or narrow band
 
-    return DWT_SUCCESS ;
-} // end dwt_writetxdata()
-
-/*! ------------------------------------------------------------------------------------------------------------------
- * @fn dwt_writetxfctrl()
- *
- * @brief This API function configures the TX frame control register before the transmission of a frame
- *
- * input parameters:
- * @param txFrameLength - this is the length of TX message (including the 2 byte CRC) - max is 1023
- *                              NOTE: standard PHR mode allows up to 127 bytes
- *                              if > 127 is programmed, DWT_PHRMODE_EXT needs to be set in the phrMode configuration
- *                              see dwt_configure function
- * @param txBufferOffset - the offset in the tx buffer to start writing the data
- *
- * output parameters
- *
- * returns DWT_DECA_SUCCESS for success, or DWT_DECA_ERROR for error
- *
- */
-#pragma GCC optimize ("O3")
-int dwt_writetxfctrl(uint16 txFrameLength, uint16 txBufferOffset)
-{
+        dwt_writetodevice(FS_CTRL_ID, FS_PLLCFG_OFFSET, 5, &pll2_config[chan_idx[chan]][0]);
+        dwt_writetodevice(RF_CONF_ID, RF_RXCTRLH_OFFSET, 1, &rx_config[bw]);
+        dwt_write32bitoffsetreg(RF_CONF_ID, RF_TXCTRL_OFFSET, tx_config[chan_idx[chan]]);
+    }
 
-#ifdef DWT_API_ERROR_CHECK
-    if (dw1000local.longFrames)
+    if(rateChg || sfdChg)
     {
-        if (txFrameLength > 1023)
+        dwt_write16bitoffsetreg(DRX_CONF_ID, DRX_TUNE0b_OFFSET, sftsh[config->dataRate][config->nsSFD]);
+
+        if(config->nsSFD)
         {
-        	return DWT_ERROR ;
+            dwt_writetodevice(USR_SFD_ID,0x00,1,&dwnsSFDlen[config->dataRate]);
         }
     }
-    else
+
+    if(rateChg || (config->txPreambLength != cur->txPreambLength))
     {
-        if (txFrameLength > 127)
-        {
-        	return DWT_ERROR ;
-        }
+        _dwt_configdtune1b(config);
     }
-    if (txFrameLength < 2)
+
+    if(prfChg || (config->rxPAC != cur->rxPAC))
     {
-    	return DWT_ERROR ;
+        dwt_write32bitoffsetreg(DRX_CONF_ID, DRX_TUNE2_OFFSET, digital_bb_config[prfIndex][config->rxPAC]);
     }
-#endif
 
-    // write the frame length to the TX frame control register
-    // dw1000local.txFCTRL has kept configured bit rate information
-    uint32 reg32 = dw1000local.txFCTRL | txFrameLength | (txBufferOffset << 22);
-    dwt_write32bitoffsetreg(TX_FCTRL_ID,0,reg32) ;
+    if(config->sfdTO != cur->sfdTO)
+    {
+        //don't allow 0 - SFD timeout will always be enabled
+        dwt_write16bitoffsetreg(DRX_CONF_ID, DRX_SFDTOC_OFFSET, (config->sfdTO == 0) ? DWT_SFDTOC_DEF : config->sfdTO);
+    }
 
-    return DWT_SUCCESS ;
+    if(chanChg || prfChg || sfdChg || codeChg)
+    {
+        dwt_write32bitreg(CHAN_CTRL_ID,_dwt_chanctrl(config)) ;
+    }
+
+    if(prfChg || rateChg || (config->txPreambLength != cur->txPreambLength))
+    {
+        pdw1000local->txFCTRL = ((config->txPreambLength | config->prf) << 16) | TX_FCTRL_TR |     /* always set ranging bit !!! */
+                                (config->dataRate << TX_FCTRL_TXBR_SHFT) ;
+
+        dwt_write32bitoffsetreg(TX_FCTRL_ID,0,pdw1000local->txFCTRL) ;
+    }
+
+    if(prfChg && (use_otpconfigvalues & DWT_LOADANTDLY))
+    {
+        //put half of the antenna delay value into tx and half into rx
+        dwt_setrxantennadelay(((pdw1000local->antennaDly >> (16*prfIndex)) & 0xFFFF) >> 1);
+        dwt_settxantennadelay(((pdw1000local->antennaDly >> (16*prfIndex)) & 0xFFFF) >> 1);
+    }
+
+    if(txconfig != NULL)
+    {
+        if(txconfig->PGdly != pdw1000local->txconfig.PGdly)
+        {
+            dwt_writetodevice(TX_CAL_ID, TC_PGDELAY_OFFSET, 1, &txconfig->PGdly);
+        }
+        if(txconfig->power != pdw1000local->txconfig.power)
+        {
+            dwt_write32bitreg(TX_POWER_ID, txconfig->power);
+        }
+        pdw1000local->txconfig = *txconfig ;
+    }
+
+    *cur = *config ;
+
+    return dwt_batchend() ;
+
+} // end dwt_reconfigure()
+
+/*! ------------------------------------------------------------------------------------------------------------------
+ * @fn dwt_setchannel()
+ *
+ * @brief This function changes the channel and preamble codes of a device already configured with dwt_configure().
+ * Only the channel and preamble code dependent registers are re-programmed (RF PLL, RF RX/TX control, channel control
+ * and LDE replica coefficient), the PRF, data rate, preamble length, PAC and SFD settings must not change.
+ * The TX power and PG delay (which are channel dependent) have to be set with dwt_configuretxrf().
+ * The transceiver must be off.
+ *
+ * input parameters
+ * @param config    -   pointer to the configuration structure, only chan, txCode and rxCode are used
+ *
+ * output parameters
+ *
+ * returns DWT_SUCCESS for success, or DWT_ERROR for error
+ */
+int dwt_setchannel(dwt_config_t *config)
+{
+    uint8 chan = config->chan ;
+    uint16 reg16 = lde_replicaCoeff[config->rxCode];
+    uint8 bw = ((chan == 4) || (chan == 7)) ? 1 : 0 ; //select wide or narrow band
+    uint32 regval ;
+
+#ifdef DWT_API_ERROR_CHECK
+    if ((chan < 1) || (chan > 7) || (6 == chan))
+    {
+    	return DWT_ERROR ; // validate channel number parameter
+    }
+#endif
+
+    pdw1000local->chan = chan ;
+
+    // keep the PRF and SFD settings, change the channels and preamble codes
+    regval = dwt_read32bitreg(CHAN_CTRL_ID) ;
+    regval &= ~(CHAN_CTRL_TX_CHAN_MASK | CHAN_CTRL_RX_CHAN_MASK | CHAN_CTRL_TX_PCOD_MASK | CHAN_CTRL_RX_PCOD_MASK) ;
+    regval |= (CHAN_CTRL_TX_CHAN_MASK & (chan << CHAN_CTRL_TX_CHAN_SHIFT)) |            // Transmit Channel
+              (CHAN_CTRL_RX_CHAN_MASK & (chan << CHAN_CTRL_RX_CHAN_SHIFT)) |            // Receive Channel
+              (CHAN_CTRL_TX_PCOD_MASK & (config->txCode << CHAN_CTRL_TX_PCOD_SHIFT)) |  // TX Preamble Code
+              (CHAN_CTRL_RX_PCOD_MASK & (config->rxCode << CHAN_CTRL_RX_PCOD_SHIFT)) ;  // RX Preamble Code
+
+    if(pdw1000local->sysCFGreg & SYS_CFG_RXM110K)
+    {
+        reg16 >>= 3;  //div by 8
+    }
+
+    dwt_batchbegin() ; // issue the writes in one pass
+
+    dwt_write16bitoffsetreg(LDE_IF_ID, LDE_REPC_OFFSET, reg16 ) ;
+
+    //configure PLL2/RF PLL block CFG
+    dwt_writetodevice(FS_CTRL_ID, FS_PLLCFG_OFFSET, 5, &pll2_config[chan_idx[chan]][0]);
+
+    // Configure RF RX blocks (for specified channel/badwidth)
+    dwt_writetodevice(RF_CONF_ID, RF_RXCTRLH_OFFSET, 1, &rx_config[bw]);
+
+    // Configure RF TX blocks (for specified channel and prf)
+    dwt_write32bitoffsetreg(RF_CONF_ID, RF_TXCTRL_OFFSET, tx_config[chan_idx[chan]]);
+
+    dwt_write32bitreg(CHAN_CTRL_ID,regval) ;
+
+    pdw1000local->config.chan = chan ;
+    pdw1000local->config.txCode = config->txCode ;
+    pdw1000local->config.rxCode = config->rxCode ;
+
+    return dwt_batchend() ;
+
+} // end dwt_setchannel()
+
+/*! ------------------------------------------------------------------------------------------------------------------
+ * @fn dwt_setrxantennadelay()
+ *
+ * @brief This API function writes the antenna delay (in time units) to RX registers
+ *
+ * input parameters:
+ * @param rxDelay - this is the total (RX) antenna delay value, which
+ *                          will be programmed into the RX register
+ *
+ * output parameters
+ *
+ * no return value
+ */
+void dwt_setrxantennadelay(uint16 rxDelay)
+{
+    // -------------------------------------------------------------------------------------------------------------------
+    // set the antenna delay
+    pdw1000local->rfrxDly = rxDelay;
+    dwt_write16bitoffsetreg(LDE_IF_ID,LDE_RXANTD_OFFSET,pdw1000local->rfrxDly) ;
+}
+
+/*! ------------------------------------------------------------------------------------------------------------------
+ * @fn dwt_settxantennadelay()
+ *
+ * @brief This API function writes the antenna delay (in time units) to TX registers
+ *
+ * input parameters:
+ * @param txDelay - this is the total (TX) antenna delay value, which
+ *                          will be programmed into the TX delay register
+ *
+ * output parameters
+ *
+ * no return value
+ *
+ */
+void dwt_settxantennadelay(uint16 txDelay)
+{
+    // -------------------------------------------------------------------------------------------------------------------
+    // set the tx antenna delay for auto tx timestamp adjustment
+    pdw1000local->rftxDly  = txDelay;
+    dwt_write16bitoffsetreg(TX_ANTD_ID, 0x0, pdw1000local->rftxDly) ;
+}
+
+
+/*! ------------------------------------------------------------------------------------------------------------------
+ * @fn dwt_readantennadelay()
+ *
+ * @brief This API function returns the antenna delay read from the OTP memory as part of device initialisation
+ * Note: the antenna delay will only be read if dwt_initialise is called with DWT_LOADANTDLY bit set in the config parameter
+ *
+ * input parameters:
+ * @param prf   -   this is the PRF e.g. DWT_PRF_16M or DWT_PRF_64M
+ *
+ */
+uint16 dwt_readantennadelay(uint8 prf)
+{
+    // 32-bit antenna delay value previously read from OTP, high 16 bits is value for 64 MHz PRF, low 16-bits for 16 MHz PRF
+    return (pdw1000local->antennaDly >> (16*(prf-DWT_PRF_16M))) & 0xFFFF;
+}
+
+
+/*! ------------------------------------------------------------------------------------------------------------------
+ * @fn dwt_writetxdata()
+ *
+ * @brief This API function writes the supplied TX data into the DW1000's
+ * TX buffer.  The input parameters are the data length in bytes and a pointer
+ * to those data bytes.
+ *
+ * input parameters
+ * @param txFrameLength  - This is the total frame length, including the two byte CRC.
+ *                         Note: this is the length of TX message (including the 2 byte CRC) - max is 1023
+ *                         standard PHR mode allows up to 127 bytes
+ *                         if > 127 is programmed, DWT_PHRMODE_EXT needs to be set in the phrMode configuration
+ *                         see dwt_configure function
+ * @param txFrameBytes   - Pointer to the users buffer containing the data to send.
+ * @param txBufferOffset - This specifies an offset in the DW1000s TX Buffer at which to start writing data.
+ *
+ * output parameters
+ *
+ * returns DWT_DECA_SUCCESS for success, or DWT_DECA_ERROR for error
+ */
+#pragma GCC optimize ("O3")
+int dwt_writetxdata(uint16 txFrameLength, uint8 *txFrameBytes, uint16 txBufferOffset)
+{
+#ifdef DWT_API_ERROR_CHECK
+    if (pdw1000local->longFrames)
+    {
+        if (txFrameLength > 1023)
+        {
+        	return DWT_ERROR ;
+        }
+    }
+    else
+    {
+        if (txFrameLength > 127)
+        {
+        	return DWT_ERROR ;
+        }
+    }
+    if (txFrameLength < 2)
+    {
+    	return DWT_ERROR ;
+    }
+#endif
+
+    if ((txBufferOffset + txFrameLength) > 1024)
+    {
+        return DWT_ERROR ;
+    }
+    // write the data to the IC TX buffer, (-2 bytes for auto generated CRC)
+    dwt_writetodevice( TX_BUFFER_ID, txBufferOffset, txFrameLength-2, txFrameBytes) ;
+
+
+    return DWT_SUCCESS ;
+} // end dwt_writetxdata()
+
+/*! ------------------------------------------------------------------------------------------------------------------
+ * @fn dwt_writetxfctrl()
+ *
+ * @brief This API function configures the TX frame control register before the transmission of a frame
+ *
+ * input parameters:
+ * @param txFrameLength - this is the length of TX message (including the 2 byte CRC) - max is 1023
+ *                              NOTE: standard PHR mode allows up to 127 bytes
+ *                              if > 127 is programmed, DWT_PHRMODE_EXT needs to be set in the phrMode configuration
+ *                              see dwt_configure function
+ * @param txBufferOffset - the offset in the tx buffer to start writing the data
+ *
+ * output parameters
+ *
+ * returns DWT_DECA_SUCCESS for success, or DWT_DECA_ERROR for error
+ *
+ */
+#pragma GCC optimize ("O3")
+int dwt_writetxfctrl(uint16 txFrameLength, uint16 txBufferOffset)
+{
+
+#ifdef DWT_API_ERROR_CHECK
+    if (pdw1000local->longFrames)
+    {
+        if (txFrameLength > 1023)
+        {
+        	return DWT_ERROR ;
+        }
+    }
+    else
+    {
+        if (txFrameLength > 127)
+        {
+        	return DWT_ERROR ;
+        }
+    }
+    if (txFrameLength < 2)
+    {
+    	return DWT_ERROR ;
+    }
+#endif
+
+    // write the frame length to the TX frame control register
+    // pdw1000local->txFCTRL has kept configured bit rate information
+    uint32 reg32 = pdw1000local->txFCTRL | txFrameLength | (txBufferOffset << 22);
+    dwt_write32bitoffsetreg(TX_FCTRL_ID,0,reg32) ;
+
+    return DWT_SUCCESS ;
 
 } // end dwt_writetxfctrl()
 
@@ -975,227 +1415,674 @@ void dwt_readrxtimestamp(uint8 * timestamp)
 }
 
 /*! ------------------------------------------------------------------------------------------------------------------
- * @fn dwt_readrxtimestamphi32()
+ * @fn dwt_readrxtimestamphi32()
+ *
+ *  @brief This is used to read the high 32-bits of the RX timestamp (adjusted with the programmed antenna delay)
+ *
+ * input parameters
+ *
+ * output parameters
+ * uint32 rxtimestamp (hi 32-bits of RX timestamp)
+ */
+#pragma GCC optimize ("O3")
+uint32 dwt_readrxtimestamphi32(void)
+{
+    return dwt_read32bitoffsetreg(RX_TIME_ID, 1);
+}
+
+/*! ------------------------------------------------------------------------------------------------------------------
+ * @fn dwt_readrxtimestamplo32()
+ *
+ *  @brief This is used to read the low 32-bits of the RX timestamp (adjusted with the programmed antenna delay)
+ *
+ * input parameters
+ *
+ * output parameters
+ * uint32 rxtimestamp (lo 32-bits of RX timestamp)
+ */
+#pragma GCC optimize ("O3")
+uint32 dwt_readrxtimestamplo32(void)
+{
+    return dwt_read32bitoffsetreg(RX_TIME_ID, 0);
+}
+
+/*! ------------------------------------------------------------------------------------------------------------------
+ * @fn dwt_readsystimestamphi32()
+ *
+ *  @brief This is used to read the high 32-bits of the system time
+ *
+ * input parameters
+ *
+ * output parameters
+ *
+ * returns high 32-bits of system time timestamp
+ */
+#pragma GCC optimize ("O3")
+uint32 dwt_readsystimestamphi32(void)
+{
+    return dwt_read32bitoffsetreg(SYS_TIME_ID, 1);
+}
+
+/*! ------------------------------------------------------------------------------------------------------------------
+ * @fn dwt_readcarrierintegrator()
+ *
+ *  @brief This is used to read the receiver carrier integrator value (valid after a good frame has been received,
+ *  until the receiver is enabled again)
+ *
+ * input parameters
+ *
+ * output parameters
+ *
+ * returns the signed 21-bit carrier integrator value (sign extended to 32 bits)
+ */
+#pragma GCC optimize ("O3")
+int32 dwt_readcarrierintegrator(void)
+{
+    uint8 buffer[DRX_CAR_INT_LEN] ;
+    uint32 regval ;
+
+    dwt_readfromdevice(DRX_CONF_ID, DRX_CAR_INT_OFFSET, DRX_CAR_INT_LEN, buffer) ;
+
+    regval = ((uint32)buffer[2] << 16) + ((uint32)buffer[1] << 8) + buffer[0] ;
+
+    if(regval & DRX_CAR_INT_SIGN_BIT) //negative value - sign extend it
+    {
+        regval |= DRX_CAR_INT_SIGN_EXT ;
+    }
+    else
+    {
+        regval &= DRX_CAR_INT_MASK ;
+    }
+
+    return (int32) regval ;
+}
+
+/*! ------------------------------------------------------------------------------------------------------------------
+ * @fn dwt_readsystime()
+ *
+ *  @brief This is used to read the system time
+ *
+ * input parameters
+ * @param timestamp - a pointer to a 5-byte buffer which will store the read system time
+ *
+ * output parameters
+ * @param timestamp - the timestamp buffer will contain the value after the function call
+ *
+ * returns
+ */
+#pragma GCC optimize ("O3")
+void dwt_readsystime(uint8 * timestamp)
+{
+    dwt_readfromdevice(SYS_TIME_ID, 0, SYS_TIME_LEN, timestamp) ; //get the adjusted time of arrival
+}
+
+
+/*! ------------------------------------------------------------------------------------------------------------------
+ * @fn dwt_writetodevice()
+ *
+ * @brief  this function is used to write to the DW1000 device registers
+ * Notes:
+ *        1. Firstly we create a header (the first byte is a header byte)
+ *        a. check if sub index is used, if subindexing is used - set bit-6 to 1 to signify that the sub-index address follows the register index byte
+ *        b. set bit-7 (or with 0x80) for write operation
+ *        c. if extended sub address index is used (i.e. if index > 127) set bit-7 of the first sub-index byte following the first header byte
+ *
+ *        2. Write the header followed by the data bytes to the DW1000 device
+ *
+ *
+ * input parameters:
+ * @param recordNumber  - ID of register file or buffer being accessed
+ * @param index         - byte index into register file or buffer being accessed
+ * @param length        - number of bytes being written
+ * @param buffer        - pointer to buffer containing the 'length' bytes to be written
+ *
+ * output parameters
+ *
+ * returns DWT_DECA_SUCCESS for success, or DWT_DECA_ERROR for error
+ */
+#pragma GCC optimize ("O3")
+int dwt_writetodevice
+(
+    uint16      recordNumber,
+    uint16      index,
+    uint32      length,
+    const uint8 *buffer
+)
+{
+    uint8 header[3] ;                                       // buffer to compose header in
+    int   cnt = 0;                                          // counter for length of header
+#ifdef DWT_API_ERROR_CHECK
+    if (recordNumber > 0x3F)
+    {
+    	return DWT_ERROR ;                    // record number is limited to 6-bits.
+    }
+#endif
+    // Write message header selecting WRITE operation and addresses as appropriate (this is one to three bytes long)
+
+    if (index == 0)                                         // for index of 0, no sub-index is required
+    {
+        header[cnt++] = 0x80 | recordNumber ;               // bit-7 is WRITE operation, bit-6 zero=NO sub-addressing, bits 5-0 is reg file id
+    }
+    else
+    {
+#ifdef DWT_API_ERROR_CHECK
+        if (index > 0x7FFF)
+        {
+        	return DWT_ERROR ;                     // index is limited to 15-bits.
+        }
+        if ((index + length)> 0x7FFF)
+        {
+        	return DWT_ERROR ;           // sub-addressable area is limited to 15-bits.
+        }
+#endif
+        header[cnt++] = 0xC0 | recordNumber ;               // bit-7 is WRITE operation, bit-6 one=sub-address follows, bits 5-0 is reg file id
+
+        if (index <= 127)                                   // for non-zero index < 127, just a single sub-index byte is required
+        {
+            header[cnt++] = (uint8)index ;                  // bit-7 zero means no extension, bits 6-0 is index.
+        }
+        else
+        {
+            header[cnt++] = 0x80 | (uint8)(index) ;           // bit-7 one means extended index, bits 6-0 is low seven bits of index.
+            header[cnt++] =  (uint8) (index >> 7) ;           // 8-bit value = high eight bits of index.
+        }
+    }
+
+    _dwt_shadowupdate(recordNumber, index, length, buffer) ;
+
+    // queue it if a batch is open, or write it to the SPI
+
+    if (dw1000batch.depth)
+    {
+        return _dwt_batchqueue(recordNumber, index, cnt, header, length, buffer, NULL);
+    }
+
+    return _dwt_spiwrite(cnt,header,length,buffer);
+
+} // end dwt_writetodevice()
+
+/*! ------------------------------------------------------------------------------------------------------------------
+ * @fn dwt_readfromdevice()
+ *
+ * @brief  this function is used to read from the DW1000 device registers
+ * Notes:
+ *        1. Firstly we create a header (the first byte is a header byte)
+ *        a. check if sub index is used, if subindexing is used - set bit-6 to 1 to signify that the sub-index address follows the register index byte
+ *        b. set bit-7 (or with 0x80) for write operation
+ *        c. if extended sub address index is used (i.e. if index > 127) set bit-7 of the first sub-index byte following the first header byte
+ *
+ *        2. Write the header followed by the data bytes to the DW1000 device
+ *        3. Store the read data in the input buffer
+ *
+ * input parameters:
+ * @param recordNumber  - ID of register file or buffer being accessed
+ * @param index         - byte index into register file or buffer being accessed
+ * @param length        - number of bytes being read
+ * @param buffer        - pointer to buffer in which to return the read data.
+ *
+ * output parameters
+ *
+ * @return DWT_DECA_SUCCESS for success, or DWT_DECA_ERROR for error
+ */
+#pragma GCC optimize ("O3")
+int dwt_readfromdevice
+(
+    uint16  recordNumber,
+    uint16  index,
+    uint32  length,
+    uint8   *buffer
+)
+{
+    uint8 header[3] ;                                       // buffer to compose header in
+    int   cnt = 0;                                          // counter for length of header
+#ifdef DWT_API_ERROR_CHECK
+    if (recordNumber > 0x3F)
+    {
+    	return DWT_ERROR ;                    // record number is limited to 6-bits.
+    }
+#endif
+    // Write message header selecting READ operation and addresses as appropriate (this is one to three bytes long)
+
+    if (index == 0)                                         // for index of 0, no sub-index is required
+    {
+        header[cnt++] = (uint8) recordNumber ;              // bit-7 zero is READ operation, bit-6 zero=NO sub-addressing, bits 5-0 is reg file id
+    }
+    else
+    {
+#ifdef DWT_API_ERROR_CHECK
+        if (index > 0x7FFF)
+        {
+        	return DWT_ERROR ;                     // index is limited to 15-bits.
+        }
+        if ((index + length)> 0x7FFF)
+        {
+        	return DWT_ERROR ;           // sub-addressible area is limited to 15-bits.
+        }
+#endif
+        header[cnt++] = (uint8)(0x40 | recordNumber) ;      // bit-7 zero is READ operation, bit-6 one=sub-address follows, bits 5-0 is reg file id
+
+        if (index <= 127)                                   // for non-zero index < 127, just a single sub-index byte is required
+        {
+            header[cnt++] = (uint8) index ;                 // bit-7 zero means no extension, bits 6-0 is index.
+        }
+        else
+        {
+            header[cnt++] = 0x80 | (uint8)(index) ;           // bit-7 one means extended index, bits 6-0 is low seven bits of index.
+            header[cnt++] =  (uint8) (index >> 7) ;           // 8-bit value = high eight bits of index.
+        }
+    }
+
+    // do the read from the SPI (after the queued accesses, if in a batch)
+
+    if (dw1000batch.numOps)
+    {
+        dwt_batchflush();
+    }
+
+    return _dwt_spiread(cnt, header, length, buffer);  // result is stored in the buffer
+
+} // end dwt_readfromdevice()
+
+/*! ------------------------------------------------------------------------------------------------------------------
+ * @fn _dwt_spiwrite()
+ *
+ * @brief  this function issues one SPI write transaction and counts it in the SPI statistics
+ *
+ * input parameters:
+ * @param headerLength  - number of bytes header being written
+ * @param headerBuffer  - pointer to buffer containing the header
+ * @param length        - number of bytes data being written
+ * @param buffer        - pointer to buffer containing the data
+ *
+ * output parameters
+ *
+ * returns DWT_SUCCESS for success, or DWT_ERROR for error
+ */
+int _dwt_spiwrite(uint16 headerLength, const uint8 *headerBuffer, uint32 length, const uint8 *buffer)
+{
+    dw1000spistats.transactions++ ;
+    dw1000spistats.bytes += headerLength + length ;
+
+    return writetospi(headerLength, headerBuffer, length, buffer);
+}
+
+/*! ------------------------------------------------------------------------------------------------------------------
+ * @fn _dwt_spiread()
+ *
+ * @brief  this function issues one SPI read transaction and counts it in the SPI statistics
+ *
+ * input parameters:
+ * @param headerLength  - number of bytes header being written
+ * @param headerBuffer  - pointer to buffer containing the header
+ * @param length        - number of bytes data being read
+ * @param buffer        - pointer to buffer in which to return the read data
+ *
+ * output parameters
+ *
+ * returns DWT_SUCCESS for success, or DWT_ERROR for error
+ */
+int _dwt_spiread(uint16 headerLength, const uint8 *headerBuffer, uint32 length, uint8 *buffer)
+{
+    dw1000spistats.transactions++ ;
+    dw1000spistats.bytes += headerLength + length ;
+
+    return readfromspi(headerLength, headerBuffer, length, buffer);
+}
+
+/*! ------------------------------------------------------------------------------------------------------------------
+ * @fn _dwt_batchqueue()
+ *
+ * @brief  this function queues a register access in the current batch. A write to the bytes following the previous
+ * queued write of the same register file is merged into it (one header, one CS assertion). The queued accesses are
+ * flushed first if there is no room left, an access that does not fit in an empty batch is issued straight away.
+ *
+ * input parameters:
+ * @param recordNumber  - ID of register file or buffer being accessed
+ * @param index         - byte index into register file or buffer being accessed
+ * @param headerLength  - number of bytes of the header (already built for the access)
+ * @param headerBuffer  - pointer to the header
+ * @param length        - number of bytes being written or read
+ * @param wrBuffer      - pointer to the data to write (copied), NULL for a read
+ * @param rdBuffer      - pointer to the buffer in which to return the read data, NULL for a write
+ *
+ * output parameters
+ *
+ * returns DWT_SUCCESS for success, or DWT_ERROR for error
+ */
+int _dwt_batchqueue(uint16 recordNumber, uint16 index, uint16 headerLength, const uint8 *headerBuffer, uint32 length,
+                    const uint8 *wrBuffer, uint8 *rdBuffer)
+{
+    dwt_batchop_t *op ;
+    uint32 dataLen = (rdBuffer == NULL) ? length : 0 ;
+
+    if (dataLen > DWT_BATCH_BUF_LEN)
+    {
+        if (dw1000batch.numOps)
+        {
+            dwt_batchflush();
+        }
+        return (rdBuffer == NULL) ? _dwt_spiwrite(headerLength, headerBuffer, length, wrBuffer)
+                                  : _dwt_spiread(headerLength, headerBuffer, length, rdBuffer) ;
+    }
+
+    if ((dw1000batch.dataLen + dataLen) > DWT_BATCH_BUF_LEN)
+    {
+        dwt_batchflush();
+    }
+
+    // merge with the previous write if this one continues it
+    if ((rdBuffer == NULL) && dw1000batch.numOps)
+    {
+        op = &dw1000batch.op[dw1000batch.numOps - 1] ;
+
+        if ((op->rdBuffer == NULL) && (op->recordNumber == recordNumber) && ((op->index + op->length) == index))
+        {
+            memcpy(&dw1000batch.data[dw1000batch.dataLen], wrBuffer, length) ;
+            dw1000batch.dataLen += length ;
+            op->length += length ;
+            return DWT_SUCCESS ;
+        }
+    }
+
+    if (dw1000batch.numOps == DWT_BATCH_MAX_OPS)
+    {
+        dwt_batchflush();
+    }
+
+    op = &dw1000batch.op[dw1000batch.numOps++] ;
+    memcpy(op->header, headerBuffer, headerLength) ;
+    op->headerLength = headerLength ;
+    op->recordNumber = recordNumber ;
+    op->index = index ;
+    op->length = length ;
+    op->offset = dw1000batch.dataLen ;
+    op->rdBuffer = rdBuffer ;
+
+    if (rdBuffer == NULL)
+    {
+        memcpy(&dw1000batch.data[dw1000batch.dataLen], wrBuffer, length) ;
+        dw1000batch.dataLen += length ;
+    }
+
+    return DWT_SUCCESS ;
+}
+
+/*! ------------------------------------------------------------------------------------------------------------------
+ * @fn _dwt_readshadow()
+ *
+ * @brief  this function returns the value of a shadow register, it is read from the device only if it is not cached
+ *
+ * input parameters:
+ * @param id  - shadow register (DWT_SHADOW_xxx)
+ *
+ * output parameters
+ *
+ * returns the 32-bit register value
+ */
+uint32 _dwt_readshadow(int id)
+{
+    if ((pdw1000local->shadowValid & (1 << id)) == 0)
+    {
+        pdw1000local->shadow[id] = dwt_read32bitoffsetreg(_dwt_shadowreg[id].recordNumber, _dwt_shadowreg[id].index) ;
+        pdw1000local->shadowValid |= (1 << id) ;
+    }
+
+    return pdw1000local->shadow[id] ;
+}
+
+/*! ------------------------------------------------------------------------------------------------------------------
+ * @fn _dwt_shadowupdate()
  *
- *  @brief This is used to read the high 32-bits of the RX timestamp (adjusted with the programmed antenna delay)
+ * @brief  this function copies the bytes of a register write into the cached shadow registers it overlaps
  *
- * input parameters
+ * input parameters:
+ * @param recordNumber  - ID of register file or buffer being written
+ * @param index         - byte index into register file or buffer being written
+ * @param length        - number of bytes being written
+ * @param buffer        - pointer to the data being written
  *
  * output parameters
- * uint32 rxtimestamp (hi 32-bits of RX timestamp)
+ *
+ * no return value
  */
-#pragma GCC optimize ("O3")
-uint32 dwt_readrxtimestamphi32(void)
+void _dwt_shadowupdate(uint16 recordNumber, uint16 index, uint32 length, const uint8 *buffer)
 {
-    return dwt_read32bitoffsetreg(RX_TIME_ID, 1);
+    int id ;
+    int i ;
+
+    if (pdw1000local->shadowValid == 0)
+    {
+        return ;
+    }
+
+    for (id = 0 ; id < DWT_SHADOW_NUM ; id++)
+    {
+        if ((_dwt_shadowreg[id].recordNumber != recordNumber) || ((pdw1000local->shadowValid & (1 << id)) == 0))
+        {
+            continue ;
+        }
+
+        for (i = 0 ; i < 4 ; i++)
+        {
+            uint32 j = _dwt_shadowreg[id].index + i ;
+
+            if ((j >= index) && (j < (index + length)))
+            {
+                pdw1000local->shadow[id] &= ~(0xFFUL << (8 * i)) ;
+                pdw1000local->shadow[id] |= (uint32)buffer[j - index] << (8 * i) ;
+            }
+        }
+    }
 }
 
 /*! ------------------------------------------------------------------------------------------------------------------
- * @fn dwt_readrxtimestamplo32()
+ * @fn dwt_invalidateshadow()
  *
- *  @brief This is used to read the low 32-bits of the RX timestamp (adjusted with the programmed antenna delay)
+ * @brief  this function drops the cached shadow registers, they are read from the device on their next use
  *
- * input parameters
+ * input parameters:
  *
  * output parameters
- * uint32 rxtimestamp (lo 32-bits of RX timestamp)
+ *
+ * no return value
  */
-#pragma GCC optimize ("O3")
-uint32 dwt_readrxtimestamplo32(void)
+void dwt_invalidateshadow(void)
 {
-    return dwt_read32bitoffsetreg(RX_TIME_ID, 0);
+    pdw1000local->shadowValid = 0 ;
 }
 
 /*! ------------------------------------------------------------------------------------------------------------------
- * @fn dwt_readsystimestamphi32()
+ * @fn dwt_batchbegin()
  *
- *  @brief This is used to read the high 32-bits of the system time
+ * @brief  this function starts (or nests) a batch of register accesses, see dwt_batchend()
  *
- * input parameters
+ * input parameters:
  *
  * output parameters
  *
- * returns high 32-bits of system time timestamp
+ * no return value
  */
-#pragma GCC optimize ("O3")
-uint32 dwt_readsystimestamphi32(void)
+void dwt_batchbegin(void)
 {
-    return dwt_read32bitoffsetreg(SYS_TIME_ID, 1);
+#if (DWT_SPI_BATCH == 1)
+    // the DW1000 interrupt stays masked until the outermost batch ends, so dwt_isr() cannot flush or extend
+    // a half-built batch
+    decaIrqStatus_t stat = decamutexon() ;
+
+    if (dw1000batch.depth++ == 0)
+    {
+        dw1000batch.irqStat = stat ;
+    }
+#endif
 }
 
 /*! ------------------------------------------------------------------------------------------------------------------
- * @fn dwt_readsystime()
+ * @fn dwt_batchend()
  *
- *  @brief This is used to read the system time
+ * @brief  this function ends a batch of register accesses, the queued accesses are issued when the outermost batch ends
  *
- * input parameters
- * @param timestamp - a pointer to a 5-byte buffer which will store the read system time
+ * input parameters:
  *
  * output parameters
- * @param timestamp - the timestamp buffer will contain the value after the function call
  *
- * returns
+ * returns DWT_SUCCESS for success, or DWT_ERROR for error
  */
-#pragma GCC optimize ("O3")
-void dwt_readsystime(uint8 * timestamp)
+int dwt_batchend(void)
 {
-    dwt_readfromdevice(SYS_TIME_ID, 0, SYS_TIME_LEN, timestamp) ; //get the adjusted time of arrival
-}
+    int result ;
+
+    if (dw1000batch.depth == 0)
+    {
+        return DWT_SUCCESS ;
+    }
 
+    if (--dw1000batch.depth)
+    {
+        return DWT_SUCCESS ;
+    }
+
+    result = dwt_batchflush() ;
+
+    decamutexoff(dw1000batch.irqStat) ;
+
+    return result ;
+}
 
 /*! ------------------------------------------------------------------------------------------------------------------
- * @fn dwt_writetodevice()
- *
- * @brief  this function is used to write to the DW1000 device registers
- * Notes:
- *        1. Firstly we create a header (the first byte is a header byte)
- *        a. check if sub index is used, if subindexing is used - set bit-6 to 1 to signify that the sub-index address follows the register index byte
- *        b. set bit-7 (or with 0x80) for write operation
- *        c. if extended sub address index is used (i.e. if index > 127) set bit-7 of the first sub-index byte following the first header byte
- *
- *        2. Write the header followed by the data bytes to the DW1000 device
+ * @fn dwt_batchflush()
  *
+ * @brief  this function issues the queued register accesses in order, in one pass under one mutex
  *
  * input parameters:
- * @param recordNumber  - ID of register file or buffer being accessed
- * @param index         - byte index into register file or buffer being accessed
- * @param length        - number of bytes being written
- * @param buffer        - pointer to buffer containing the 'length' bytes to be written
  *
  * output parameters
  *
- * returns DWT_DECA_SUCCESS for success, or DWT_DECA_ERROR for error
+ * returns DWT_SUCCESS for success, or DWT_ERROR for error
  */
-#pragma GCC optimize ("O3")
-int dwt_writetodevice
-(
-    uint16      recordNumber,
-    uint16      index,
-    uint32      length,
-    const uint8 *buffer
-)
+int dwt_batchflush(void)
 {
-    uint8 header[3] ;                                       // buffer to compose header in
-    int   cnt = 0;                                          // counter for length of header
-#ifdef DWT_API_ERROR_CHECK
-    if (recordNumber > 0x3F)
-    {
-    	return DWT_ERROR ;                    // record number is limited to 6-bits.
-    }
-#endif
-    // Write message header selecting WRITE operation and addresses as appropriate (this is one to three bytes long)
+    decaIrqStatus_t stat ;
+    dwt_batchop_t *op ;
+    int result = DWT_SUCCESS ;
+    int i ;
 
-    if (index == 0)                                         // for index of 0, no sub-index is required
+    if (dw1000batch.numOps == 0)
     {
-        header[cnt++] = 0x80 | recordNumber ;               // bit-7 is WRITE operation, bit-6 zero=NO sub-addressing, bits 5-0 is reg file id
+        return DWT_SUCCESS ;
     }
-    else
+
+    stat = decamutexon() ;
+
+    for (i = 0 ; i < dw1000batch.numOps ; i++)
     {
-#ifdef DWT_API_ERROR_CHECK
-        if (index > 0x7FFF)
-        {
-        	return DWT_ERROR ;                     // index is limited to 15-bits.
-        }
-        if ((index + length)> 0x7FFF)
-        {
-        	return DWT_ERROR ;           // sub-addressable area is limited to 15-bits.
-        }
-#endif
-        header[cnt++] = 0xC0 | recordNumber ;               // bit-7 is WRITE operation, bit-6 one=sub-address follows, bits 5-0 is reg file id
+        op = &dw1000batch.op[i] ;
 
-        if (index <= 127)                                   // for non-zero index < 127, just a single sub-index byte is required
+        if (op->rdBuffer == NULL)
         {
-            header[cnt++] = (uint8)index ;                  // bit-7 zero means no extension, bits 6-0 is index.
+            if (_dwt_spiwrite(op->headerLength, op->header, op->length, &dw1000batch.data[op->offset]))
+            {
+                result = DWT_ERROR ;
+            }
         }
         else
         {
-            header[cnt++] = 0x80 | (uint8)(index) ;           // bit-7 one means extended index, bits 6-0 is low seven bits of index.
-            header[cnt++] =  (uint8) (index >> 7) ;           // 8-bit value = high eight bits of index.
+            if (_dwt_spiread(op->headerLength, op->header, op->length, op->rdBuffer))
+            {
+                result = DWT_ERROR ;
+            }
         }
     }
 
-    // write it to the SPI
+    decamutexoff(stat) ;
 
-    return writetospi(cnt,header,length,buffer);
+    dw1000batch.numOps = 0 ;
+    dw1000batch.dataLen = 0 ;
+    dw1000spistats.batches++ ;
 
-} // end dwt_writetodevice()
+    return result ;
+}
 
 /*! ------------------------------------------------------------------------------------------------------------------
- * @fn dwt_readfromdevice()
- *
- * @brief  this function is used to read from the DW1000 device registers
- * Notes:
- *        1. Firstly we create a header (the first byte is a header byte)
- *        a. check if sub index is used, if subindexing is used - set bit-6 to 1 to signify that the sub-index address follows the register index byte
- *        b. set bit-7 (or with 0x80) for write operation
- *        c. if extended sub address index is used (i.e. if index > 127) set bit-7 of the first sub-index byte following the first header byte
+ * @fn dwt_batchread()
  *
- *        2. Write the header followed by the data bytes to the DW1000 device
- *        3. Store the read data in the input buffer
+ * @brief  this function queues a register read in the current batch (or reads straight away if no batch is open),
+ * the buffer holds the data once the batch has been flushed
  *
  * input parameters:
  * @param recordNumber  - ID of register file or buffer being accessed
  * @param index         - byte index into register file or buffer being accessed
  * @param length        - number of bytes being read
- * @param buffer        - pointer to buffer in which to return the read data.
+ * @param buffer        - pointer to buffer in which to return the read data
  *
  * output parameters
  *
- * @return DWT_DECA_SUCCESS for success, or DWT_DECA_ERROR for error
+ * returns DWT_SUCCESS for success, or DWT_ERROR for error
  */
-#pragma GCC optimize ("O3")
-int dwt_readfromdevice
-(
-    uint16  recordNumber,
-    uint16  index,
-    uint32  length,
-    uint8   *buffer
-)
+int dwt_batchread(uint16 recordNumber, uint16 index, uint32 length, uint8 *buffer)
 {
-    uint8 header[3] ;                                       // buffer to compose header in
-    int   cnt = 0;                                          // counter for length of header
-#ifdef DWT_API_ERROR_CHECK
-    if (recordNumber > 0x3F)
+    uint8 header[3] ;
+    int   cnt = 0;
+
+    if (dw1000batch.depth == 0)
     {
-    	return DWT_ERROR ;                    // record number is limited to 6-bits.
+        return dwt_readfromdevice(recordNumber, index, length, buffer) ;
     }
-#endif
-    // Write message header selecting READ operation and addresses as appropriate (this is one to three bytes long)
 
-    if (index == 0)                                         // for index of 0, no sub-index is required
+    // same header as dwt_readfromdevice()
+    if (index == 0)
     {
-        header[cnt++] = (uint8) recordNumber ;              // bit-7 zero is READ operation, bit-6 zero=NO sub-addressing, bits 5-0 is reg file id
+        header[cnt++] = (uint8) recordNumber ;
     }
     else
     {
-#ifdef DWT_API_ERROR_CHECK
-        if (index > 0x7FFF)
-        {
-        	return DWT_ERROR ;                     // index is limited to 15-bits.
-        }
-        if ((index + length)> 0x7FFF)
-        {
-        	return DWT_ERROR ;           // sub-addressible area is limited to 15-bits.
-        }
-#endif
-        header[cnt++] = (uint8)(0x40 | recordNumber) ;      // bit-7 zero is READ operation, bit-6 one=sub-address follows, bits 5-0 is reg file id
+        header[cnt++] = (uint8)(0x40 | recordNumber) ;
 
-        if (index <= 127)                                   // for non-zero index < 127, just a single sub-index byte is required
+        if (index <= 127)
         {
-            header[cnt++] = (uint8) index ;                 // bit-7 zero means no extension, bits 6-0 is index.
+            header[cnt++] = (uint8) index ;
         }
         else
         {
-            header[cnt++] = 0x80 | (uint8)(index) ;           // bit-7 one means extended index, bits 6-0 is low seven bits of index.
-            header[cnt++] =  (uint8) (index >> 7) ;           // 8-bit value = high eight bits of index.
+            header[cnt++] = 0x80 | (uint8)(index) ;
+            header[cnt++] =  (uint8) (index >> 7) ;
         }
     }
 
-    // do the read from the SPI
+    return _dwt_batchqueue(recordNumber, index, cnt, header, length, NULL, buffer) ;
+}
 
-    return readfromspi(cnt, header, length, buffer);  // result is stored in the buffer
+/*! ------------------------------------------------------------------------------------------------------------------
+ * @fn dwt_getspistats()
+ *
+ * @brief  this function returns the SPI transaction and byte counts
+ *
+ * input parameters:
+ * @param stats - pointer to the dwt_spistats_t structure which will hold the counts
+ *
+ * output parameters
+ *
+ * no return value
+ */
+void dwt_getspistats(dwt_spistats_t *stats)
+{
+    *stats = dw1000spistats ;
+}
 
-} // end dwt_readfromdevice()
+/*! ------------------------------------------------------------------------------------------------------------------
+ * @fn dwt_clearspistats()
+ *
+ * @brief  this function clears the SPI transaction and byte counts
+ *
+ * input parameters:
+ *
+ * output parameters
+ *
+ * no return value
+ */
+void dwt_clearspistats(void)
+{
+    memset(&dw1000spistats, 0, sizeof(dw1000spistats)) ;
+}
 
 
 
@@ -1346,7 +2233,7 @@ int dwt_write32bitoffsetreg(int regFileID,int regOffset,uint32 regval)
  */
 void dwt_enableframefilter(uint16 enable)
 {
-    uint32 sysconfig = SYS_CFG_MASK & dwt_read32bitreg(SYS_CFG_ID) ;    // read sysconfig register
+    uint32 sysconfig = SYS_CFG_MASK & pdw1000local->sysCFGreg ;    // local copy of the sysconfig register
 
     if(enable)
     {
@@ -1359,7 +2246,7 @@ void dwt_enableframefilter(uint16 enable)
         sysconfig &= ~(SYS_CFG_FFE);
     }
 
-    dw1000local.sysCFGreg = sysconfig ;
+    pdw1000local->sysCFGreg = sysconfig ;
     dwt_write32bitreg(SYS_CFG_ID,sysconfig) ;
 }
 
@@ -1782,6 +2669,8 @@ void dwt_entersleep(void)
 {
     //copy config to AON - upload the new configuration
     _dwt_aonarrayupload();
+
+    dwt_invalidateshadow(); //the registers have to be read again after the wake up
 }
 
 /*! ------------------------------------------------------------------------------------------------------------------
@@ -1974,7 +2863,7 @@ void dwt_configuresleep(uint16 mode, uint8 wake)
  */
 void dwt_entersleepaftertx(int enable)
 {
-    uint32 reg = dwt_read32bitoffsetreg(PMSC_ID, PMSC_CTRL1_OFFSET);
+    uint32 reg = _dwt_readshadow(DWT_SHADOW_PMSC_CTRL1);
     //set the auto TX -> sleep bit
     if(enable)
     {
@@ -2013,6 +2902,8 @@ int dwt_spicswakeup(uint8 *buff, uint16 length)
         //need 5ms for XTAL to start and stabilise (could wait for PLL lock IRQ status bit !!!)
         //NOTE: Polling of the STATUS register is not possible unless freq is < 3MHz
         Sleep(5);
+
+        dwt_invalidateshadow(); //the registers not restored from the AON are back to their reset values
     }
     else
     {
@@ -2133,20 +3024,17 @@ void dwt_loadopsettabfromotp(uint8 gtab_sel)
  */
 void dwt_setsmarttxpower(int enable)
 {
-    //config system register
-    dw1000local.sysCFGreg = dwt_read32bitreg(SYS_CFG_ID) ;            // read sysconfig register
-
-    //disable smart power configuration
+    //disable smart power configuration (in the local copy of the sysconfig register)
     if(enable)
     {
-        dw1000local.sysCFGreg &= ~(SYS_CFG_DIS_STXP) ;
+        pdw1000local->sysCFGreg &= ~(SYS_CFG_DIS_STXP) ;
     }
     else
     {
-        dw1000local.sysCFGreg |= SYS_CFG_DIS_STXP ;
+        pdw1000local->sysCFGreg |= SYS_CFG_DIS_STXP ;
     }
 
-    dwt_write32bitreg(SYS_CFG_ID,dw1000local.sysCFGreg) ;
+    dwt_write32bitreg(SYS_CFG_ID,pdw1000local->sysCFGreg) ;
 }
 
 
@@ -2166,11 +3054,11 @@ void dwt_setsmarttxpower(int enable)
 void dwt_enableautoack(uint8 responseDelayTime)
 {
     //enable auto ACK - needs to have frame filtering enabled as well
-    dw1000local.sysCFGreg |= SYS_CFG_AUTOACK;
+    pdw1000local->sysCFGreg |= SYS_CFG_AUTOACK;
     // auto ACK reply delay
     dwt_write16bitoffsetreg(ACK_RESP_T_ID, 0x2, (responseDelayTime << 8) ) ; //in symbols
 
-    dwt_write32bitreg(SYS_CFG_ID,dw1000local.sysCFGreg) ;
+    dwt_write32bitreg(SYS_CFG_ID,pdw1000local->sysCFGreg) ;
 }
 
 /*! ------------------------------------------------------------------------------------------------------------------
@@ -2190,17 +3078,17 @@ void dwt_setdblrxbuffmode(int enable)
     if(enable)
     {
         //enable double rx buffer mode
-        dw1000local.sysCFGreg &= ~SYS_CFG_DIS_DRXB;
-        dw1000local.dblbuffon = 1;
+        pdw1000local->sysCFGreg &= ~SYS_CFG_DIS_DRXB;
+        pdw1000local->dblbuffon = 1;
     }
     else
     {
         //disable double rx buffer mode
-        dw1000local.sysCFGreg |= SYS_CFG_DIS_DRXB;
-        dw1000local.dblbuffon = 0;
+        pdw1000local->sysCFGreg |= SYS_CFG_DIS_DRXB;
+        pdw1000local->dblbuffon = 0;
     }
 
-    dwt_write32bitreg(SYS_CFG_ID,dw1000local.sysCFGreg) ;
+    dwt_write32bitreg(SYS_CFG_ID,pdw1000local->sysCFGreg) ;
 }
 
 /*! ------------------------------------------------------------------------------------------------------------------
@@ -2222,15 +3110,15 @@ void dwt_setautorxreenable(int enable)
     if(enable)
     {
         //enable auto re-enable of the receiver
-		dw1000local.sysCFGreg |= SYS_CFG_RXAUTR;
+		pdw1000local->sysCFGreg |= SYS_CFG_RXAUTR;
     }
     else
     {
         //disable auto re-enable of the receiver
-        dw1000local.sysCFGreg &= ~SYS_CFG_RXAUTR;
+        pdw1000local->sysCFGreg &= ~SYS_CFG_RXAUTR;
     }
 
-	byte = dw1000local.sysCFGreg >> 24;
+	byte = pdw1000local->sysCFGreg >> 24;
 
     dwt_writetodevice(SYS_CFG_ID, 3, 1, &byte) ;
 }
@@ -2249,7 +3137,7 @@ void dwt_setautorxreenable(int enable)
  */
 void dwt_setrxaftertxdelay(uint32 rxDelayTime)
 {
-    uint32 val = dwt_read32bitreg(ACK_RESP_T_ID) ;          // read ACK_RESP_T_ID register
+    uint32 val = _dwt_readshadow(DWT_SHADOW_ACK_RESP_T) ;          // ACK_RESP_T_ID register
 
     val &= ~(ACK_RESP_T_W4R_TIM_MASK) ; //clear the timer (19:0)
 
@@ -2258,6 +3146,33 @@ void dwt_setrxaftertxdelay(uint32 rxDelayTime)
     dwt_write32bitreg(ACK_RESP_T_ID, val) ;
 }
 
+#if (DWT_NUM_DW_DEV > 1)
+/*! ------------------------------------------------------------------------------------------------------------------
+ * @fn dwt_setlocaldataptr()
+ *
+ *  @brief This function selects the device the following API calls apply to (its local data, callbacks and prefetch
+ *  buffer). The SPI batch is shared between the devices, so the device cannot be changed while a batch is open.
+ *
+ * input parameters
+ * @param index - device index, 0 to DWT_NUM_DW_DEV - 1
+ *
+ * output parameters
+ *
+ * returns DWT_SUCCESS for success, or DWT_ERROR for error
+ */
+int dwt_setlocaldataptr(unsigned int index)
+{
+    if((index >= DWT_NUM_DW_DEV) || (dw1000batch.depth != 0))
+    {
+        return DWT_ERROR ;
+    }
+
+    pdw1000local = &dw1000local[index] ;
+
+    return DWT_SUCCESS ;
+}
+#endif
+
 /*! ------------------------------------------------------------------------------------------------------------------
  * @fn dwt_setcallbacks()
  *
@@ -2273,9 +3188,37 @@ void dwt_setrxaftertxdelay(uint32 rxDelayTime)
  */
 void dwt_setcallbacks(void (*txcallback)(const dwt_callback_data_t *), void (*rxcallback)(const dwt_callback_data_t *))
 {
-    dw1000local.dwt_txcallback = txcallback;
+    pdw1000local->dwt_txcallback = txcallback;
+
+    pdw1000local->dwt_rxcallback = rxcallback;
+}
+
+/*! ------------------------------------------------------------------------------------------------------------------
+ * @fn dwt_setrxprefetch()
+ *
+ *  @brief This function sets the buffer dwt_isr() reads a good frame into before calling the RX callback.
+ *  The frame (up to length bytes) and its RX timestamp are read back to back under one mutex, the callback finds them
+ *  in the buffer and in cdata.rxstamp (cdata.prefetched is the frame length) and does not have to read them again.
+ *  Header-first (headerLength not 0): only the first headerLength bytes of a longer frame are prefetched, so that the
+ *  callback can reject a foreign frame from its header, it reads the rest of the frame and the timestamp itself.
+ *  Frames longer than the buffer are not prefetched (cdata.prefetched is 0).
+ *
+ * input parameters
+ * @param buffer - the pointer to the buffer, NULL disables the prefetch
+ * @param length - the size of the buffer
+ * @param headerLength - number of bytes prefetched for the header-first mode, 0 to prefetch the whole frame
+ *
+ * output parameters
+ *
+ * no return value
+ */
+void dwt_setrxprefetch(uint8 *buffer, uint16 length, uint16 headerLength)
+{
+    pdw1000local->rxPrefetchBuf = buffer;
 
-    dw1000local.dwt_rxcallback = rxcallback;
+    pdw1000local->rxPrefetchLen = (buffer == NULL) ? 0 : length;
+
+    pdw1000local->rxPrefetchHdr = headerLength;
 }
 
 
@@ -2319,7 +3262,7 @@ uint8 dwt_checkIRQ(void)
  */
 #define DEBUGx 0
 
-void dwt_isr(void) // assume interrupt can supply context
+static void _dwt_isrprocess(void)
 {
     uint32  status = 0;
     uint32  clear = 0; // will clear any events seen
@@ -2330,10 +3273,10 @@ void dwt_isr(void) // assume interrupt can supply context
     uint32 states1 = 0;
     uint8 buffer[2] = {0, 0};
 #endif
-    dw1000local.cdata.event = 0;
-	dw1000local.cdata.dblbuff = dw1000local.dblbuffon ;
+    pdw1000local->cdata.event = 0;
+	pdw1000local->cdata.dblbuff = pdw1000local->dblbuffon ;
 
-	status = dw1000local.cdata.status = dwt_read32bitreg(SYS_STATUS_ID) ;            // read status register low 32bits
+	status = pdw1000local->cdata.status = dwt_read32bitreg(SYS_STATUS_ID) ;            // read status register low 32bits
 
     //NOTES:
     //1. TX Event - if DWT_INT_TFRS is enabled, then when the frame has completed transmission the interrupt will be triggered.
@@ -2359,7 +3302,7 @@ void dwt_isr(void) // assume interrupt can supply context
 #endif
 
 	//fix for bug 622 - LDE done flag gets latched on a bad frame
-	if((status & SYS_STATUS_LDEDONE) && (dw1000local.dblbuffon == 0))
+	if((status & SYS_STATUS_LDEDONE) && (pdw1000local->dblbuffon == 0))
 	{
 		if((status & (SYS_STATUS_LDEDONE | SYS_STATUS_RXPHD | SYS_STATUS_RXSFDD)) != (SYS_STATUS_LDEDONE | SYS_STATUS_RXPHD | SYS_STATUS_RXSFDD))
 		{
@@ -2372,16 +3315,16 @@ void dwt_isr(void) // assume interrupt can supply context
 			//we can get into here before the TX frame done has been processed, when we are polling (i.e. slow to process the TX)
 			status &= CLEAR_ALLTX_EVENTS;
 			//re-enable the receiver - if auto rx re-enable set
-			if(dw1000local.sysCFGreg & SYS_CFG_RXAUTR)
+			if(pdw1000local->sysCFGreg & SYS_CFG_RXAUTR)
 			{
 				dwt_write16bitoffsetreg(SYS_CTRL_ID,0,(uint16)SYS_CTRL_RXENAB) ;
 			}
 			else
 			{
-				dw1000local.cdata.event = DWT_SIG_RX_ERROR  ;
+				pdw1000local->cdata.event = DWT_SIG_RX_ERROR  ;
 
-				if(dw1000local.dwt_rxcallback != NULL)
-					dw1000local.dwt_rxcallback(&dw1000local.cdata);
+				if(pdw1000local->dwt_rxcallback != NULL)
+					pdw1000local->dwt_rxcallback(&pdw1000local->cdata);
 			}
 		}
 	}
@@ -2409,17 +3352,17 @@ void dwt_isr(void) // assume interrupt can supply context
 				
 				dwt_rxreset();	
 
-				if(dw1000local.sysCFGreg & SYS_CFG_RXAUTR) //re-enable of RX is ON, then re-enable here (ignore error)
+				if(pdw1000local->sysCFGreg & SYS_CFG_RXAUTR) //re-enable of RX is ON, then re-enable here (ignore error)
 				{
 					dwt_write16bitoffsetreg(SYS_CTRL_ID,0,(uint16)SYS_CTRL_RXENAB) ;
 				}
 				else //the RX will be re-enabled by the application, report an error
 				{
-					dw1000local.cdata.event = DWT_SIG_RX_ERROR  ;
+					pdw1000local->cdata.event = DWT_SIG_RX_ERROR  ;
 
-					if(dw1000local.dwt_rxcallback != NULL)
+					if(pdw1000local->dwt_rxcallback != NULL)
 					{
-						dw1000local.dwt_rxcallback(&dw1000local.cdata);
+						pdw1000local->dwt_rxcallback(&pdw1000local->cdata);
 					}
 				}
 
@@ -2429,32 +3372,57 @@ void dwt_isr(void) // assume interrupt can supply context
 			{
 
 			len = dwt_read16bitoffsetreg(RX_FINFO_ID, 0) & 0x3FF;
-	        dwt_readfromdevice(RX_BUFFER_ID,0,2,dw1000local.cdata.fctrl) ;
-	        if (dw1000local.longFrames==0)
+	        if (pdw1000local->longFrames==0)
 	        {
 	            len &= 0x7F ;
 	        }
 
+	        if((len >= 2) && (len <= pdw1000local->rxPrefetchLen))
+	        {
+	        	if((pdw1000local->rxPrefetchHdr != 0) && (len > pdw1000local->rxPrefetchHdr)) //header-first
+	        	{
+	        		dwt_readfromdevice(RX_BUFFER_ID, 0, pdw1000local->rxPrefetchHdr, pdw1000local->rxPrefetchBuf) ;
+	        		pdw1000local->cdata.prefetched = pdw1000local->rxPrefetchHdr;
+	        	}
+	        	else
+	        	{
+	        		//read the whole frame and its timestamp back to back (2 CS cycles, one mutex section)
+	        		dwt_batchbegin();
+	        		dwt_batchread(RX_BUFFER_ID, 0, len, pdw1000local->rxPrefetchBuf) ;
+	        		dwt_batchread(RX_TIME_ID, RX_TIME_RX_STAMP_OFFSET, RX_TIME_RX_STAMP_LEN, pdw1000local->cdata.rxstamp) ;
+	        		dwt_batchend();
+	        		pdw1000local->cdata.prefetched = len;
+	        	}
+
+	        	pdw1000local->cdata.fctrl[0] = pdw1000local->rxPrefetchBuf[0];
+	        	pdw1000local->cdata.fctrl[1] = pdw1000local->rxPrefetchBuf[1];
+	        }
+	        else
+	        {
+	        	dwt_readfromdevice(RX_BUFFER_ID,0,2,pdw1000local->cdata.fctrl) ;
+	        	pdw1000local->cdata.prefetched = 0;
+	        }
+
 			// Standard frame length up to 127, extended frame length up to 1023 bytes
-	        dw1000local.cdata.datalength = len ;
+	        pdw1000local->cdata.datalength = len ;
 
 	        //bug 627 workaround - clear the AAT bit if the ACK request bit in the FC is not set
 	        if((status & SYS_STATUS_AAT) //AAT bit is set (ACK has been requested)
-	            && (((dw1000local.cdata.fctrl[0] & 0x20) == 0) || (dw1000local.cdata.fctrl[0] == 0x02)) //but the data frame has it clear or it is an ACK frame
+	            && (((pdw1000local->cdata.fctrl[0] & 0x20) == 0) || (pdw1000local->cdata.fctrl[0] == 0x02)) //but the data frame has it clear or it is an ACK frame
 	            )
 	        {
 	            clear |= SYS_STATUS_AAT ;
-	            dw1000local.cdata.aatset = 0 ; //ACK request is not set
-	            dw1000local.wait4resp = 0;
+	            pdw1000local->cdata.aatset = 0 ; //ACK request is not set
+	            pdw1000local->wait4resp = 0;
 	        }
 	        else //the AAT is correctly set for a frame that requested the ACK
 	        {
-					dw1000local.cdata.aatset = (status & SYS_STATUS_AAT) ; //check if ACK request is set
+					pdw1000local->cdata.aatset = (status & SYS_STATUS_AAT) ; //check if ACK request is set
 	        }
 
-			dw1000local.cdata.event = DWT_SIG_RX_OKAY ;
+			pdw1000local->cdata.event = DWT_SIG_RX_OKAY ;
 
-			if(dw1000local.dblbuffon == 0) //if no double buffering
+			if(pdw1000local->dblbuffon == 0) //if no double buffering
 			{
 		        //clear all receive status bits (as we are finished with this receive event)
 		        clear |= status & CLEAR_ALLRXGOOD_EVENTS  ;
@@ -2463,9 +3431,9 @@ void dwt_isr(void) // assume interrupt can supply context
 		        //NOTE: clear the event which caused interrupt means once the rx is enabled or tx is started
 		        //new events can trigger and give rise to new interrupts
 		        //call the RX call-back function to process the RX event
-		        if(dw1000local.dwt_rxcallback != NULL)
+		        if(pdw1000local->dwt_rxcallback != NULL)
 				{
-		            dw1000local.dwt_rxcallback(&dw1000local.cdata);
+		            pdw1000local->dwt_rxcallback(&pdw1000local->cdata);
 				}
 			}
 			else //double buffer
@@ -2486,19 +3454,27 @@ void dwt_isr(void) // assume interrupt can supply context
 				}
 				//if they are not aligned then there is a new frame in the other buffer, so we just need to toggle...
 
-				if((dw1000local.sysCFGreg & SYS_CFG_RXAUTR) == 0) //double buffer is on but no auto rx re-enable RX
+				if((pdw1000local->sysCFGreg & SYS_CFG_RXAUTR) == 0) //double buffer is on but no auto rx re-enable RX
 				{
 					dwt_write16bitoffsetreg(SYS_CTRL_ID,0,(uint16)SYS_CTRL_RXENAB) ;
 				}
 
+				pdw1000local->rxbufsync = 0;
+
 				//call the RX call-back function to process the RX event
-				if(dw1000local.dwt_rxcallback != NULL)
+				if(pdw1000local->dwt_rxcallback != NULL)
+				{
+					pdw1000local->dwt_rxcallback(&pdw1000local->cdata);
+				}
+				//if the call-back turned the receiver off (e.g. to transmit a response) the buffer pointers have already
+				//been re-aligned and the receiver will be re-enabled by the application - toggling now would misalign them
+				if(pdw1000local->rxbufsync)
 				{
-					dw1000local.dwt_rxcallback(&dw1000local.cdata);
+					//nothing to do
 				}
 				//if overrun, then reset the reciver - RX bug, when overruns cannot guarantee the last frame's data was not corrupted
 				//if no overrun all is good, toggle the pointer
-				if(dwt_checkoverrun() == 0)
+				else if(dwt_checkoverrun() == 0)
 				{
 	            	//toggle the host side Receive Buffer Pointer by writing one to the register
 	            	dwt_writetodevice(SYS_CTRL_ID, SYS_CTRL_HRBT_OFFSET, 1, &hsrb) ;       // we need to swap rx buffer status reg (write one to toggle internally)
@@ -2511,7 +3487,7 @@ void dwt_isr(void) // assume interrupt can supply context
 
 					dwt_rxreset();
 
-					if(dw1000local.sysCFGreg & SYS_CFG_RXAUTR) //re-enable of RX is ON, then re-enable here
+					if(pdw1000local->sysCFGreg & SYS_CFG_RXAUTR) //re-enable of RX is ON, then re-enable here
 					{
 						dwt_write16bitoffsetreg(SYS_CTRL_ID,0,(uint16)SYS_CTRL_RXENAB) ;
 					}
@@ -2523,16 +3499,16 @@ void dwt_isr(void) // assume interrupt can supply context
 		else //no LDE_DONE ?
 		{
 			//printf("NO LDE done or LDE error\n");
-			if(!(dw1000local.sysCFGreg & SYS_CFG_RXAUTR))
+			if(!(pdw1000local->sysCFGreg & SYS_CFG_RXAUTR))
 			{
 				dwt_forcetrxoff();
 			}
 			dwt_rxreset();	//reset the RX
-			dw1000local.wait4resp = 0;
-			dw1000local.cdata.event = DWT_SIG_RX_ERROR  ;
-			if(dw1000local.dwt_rxcallback != NULL)
+			pdw1000local->wait4resp = 0;
+			pdw1000local->cdata.event = DWT_SIG_RX_ERROR  ;
+			if(pdw1000local->dwt_rxcallback != NULL)
 			{
-				dw1000local.dwt_rxcallback(&dw1000local.cdata);
+				pdw1000local->dwt_rxcallback(&pdw1000local->cdata);
 			}
 		}
     } // end if CRC is good
@@ -2546,12 +3522,12 @@ void dwt_isr(void) // assume interrupt can supply context
         dwt_write32bitreg(SYS_STATUS_ID,clear) ;         // write status register to clear event bits we have seen
         //NOTE: clear the event which caused interrupt means once the rx is enabled or tx is started
         //new events can trigger and give rise to new interrupts
-        if(dw1000local.cdata.aatset)
+        if(pdw1000local->cdata.aatset)
         {
-            dw1000local.cdata.aatset = 0; //the ACK has been sent
-            if(dw1000local.dblbuffon == 0) //if not double buffered
+            pdw1000local->cdata.aatset = 0; //the ACK has been sent
+            if(pdw1000local->dblbuffon == 0) //if not double buffered
             {
-            	if(dw1000local.wait4resp) //wait4response was set with the last TX start command
+            	if(pdw1000local->wait4resp) //wait4response was set with the last TX start command
             	{
             		//if using wait4response and the ACK has been sent as the response requested it
             		//the receiver will be re-enabled, so issue a TRXOFF command to disable and prevent any
@@ -2561,12 +3537,12 @@ void dwt_isr(void) // assume interrupt can supply context
             }
         }
 
-        dw1000local.cdata.event = DWT_SIG_TX_DONE ;  // signal TX completed
+        pdw1000local->cdata.event = DWT_SIG_TX_DONE ;  // signal TX completed
 
         //call the TX call-back function to process the TX event
-        if(dw1000local.dwt_txcallback != NULL)
+        if(pdw1000local->dwt_txcallback != NULL)
         {
-        	dw1000local.dwt_txcallback(&dw1000local.cdata);
+        	pdw1000local->dwt_txcallback(&pdw1000local->cdata);
         }
 
     }
@@ -2574,12 +3550,12 @@ void dwt_isr(void) // assume interrupt can supply context
     {
         clear |= status & SYS_STATUS_RXRFTO ;
         dwt_write32bitreg(SYS_STATUS_ID,clear) ;         // write status register to clear event bits we have seen
-        dw1000local.cdata.event = DWT_SIG_RX_TIMEOUT  ;
-        if(dw1000local.dwt_rxcallback != NULL)
+        pdw1000local->cdata.event = DWT_SIG_RX_TIMEOUT  ;
+        if(pdw1000local->dwt_rxcallback != NULL)
         {
-            dw1000local.dwt_rxcallback(&dw1000local.cdata);
+            pdw1000local->dwt_rxcallback(&pdw1000local->cdata);
         }
-        dw1000local.wait4resp = 0;
+        pdw1000local->wait4resp = 0;
 
     }
     else if(status & CLEAR_ALLRXERROR_EVENTS)//catches all other error events
@@ -2587,12 +3563,12 @@ void dwt_isr(void) // assume interrupt can supply context
         clear |= status & CLEAR_ALLRXERROR_EVENTS;
         dwt_write32bitreg(SYS_STATUS_ID,clear) ;         // write status register to clear event bits we have seen
 
-        dw1000local.wait4resp = 0;
+        pdw1000local->wait4resp = 0;
         //NOTE: clear the event which caused interrupt means once the rx is enabled or tx is started
         //new events can trigger and give rise to new interrupts
 
 		//fix for bug 622 - LDE done flag gets latched on a bad frame / reset receiver
-		if(!(dw1000local.sysCFGreg & SYS_CFG_RXAUTR))
+		if(!(pdw1000local->sysCFGreg & SYS_CFG_RXAUTR))
 		{
 			dwt_forcetrxoff(); //this will clear all events
 		}
@@ -2602,34 +3578,47 @@ void dwt_isr(void) // assume interrupt can supply context
 
         if(status & SYS_STATUS_RXPHE)
         {
-            dw1000local.cdata.event = DWT_SIG_RX_PHR_ERROR  ;
+            pdw1000local->cdata.event = DWT_SIG_RX_PHR_ERROR  ;
         }
         else if(status & SYS_STATUS_RXFCE)
         {
-            dw1000local.cdata.event = DWT_SIG_RX_ERROR  ;
+            pdw1000local->cdata.event = DWT_SIG_RX_ERROR  ;
         }
         else if(status & SYS_STATUS_RXRFSL)
         {
-            dw1000local.cdata.event = DWT_SIG_RX_SYNCLOSS  ;
+            pdw1000local->cdata.event = DWT_SIG_RX_SYNCLOSS  ;
         }
         else if(status & SYS_STATUS_RXSFDTO)
         {
-            dw1000local.cdata.event = DWT_SIG_RX_SFDTIMEOUT  ;
+            pdw1000local->cdata.event = DWT_SIG_RX_SFDTIMEOUT  ;
         }
         else if(status & SYS_STATUS_RXPTO)
         {
-            dw1000local.cdata.event = DWT_SIG_RX_PTOTIMEOUT  ;
+            pdw1000local->cdata.event = DWT_SIG_RX_PTOTIMEOUT  ;
         }
         else
         {
-            dw1000local.cdata.event = DWT_SIG_RX_ERROR  ;
+            pdw1000local->cdata.event = DWT_SIG_RX_ERROR  ;
         }
-        if(dw1000local.dwt_rxcallback != NULL)
+        if(pdw1000local->dwt_rxcallback != NULL)
         {
-            dw1000local.dwt_rxcallback(&dw1000local.cdata);
+            pdw1000local->dwt_rxcallback(&pdw1000local->cdata);
         }
 		status &= CLEAR_ALLTX_EVENTS;
     }
+}  // end _dwt_isrprocess()
+
+void dwt_isr(void) // assume interrupt can supply context
+{
+    // the DW1000 interrupt is masked while a batch is open (see dwt_batchbegin()), so the ISR only runs with an
+    // empty batch, the depth is cleared in case it is called from polled code with a batch open
+    uint8 batchDepth = dw1000batch.depth ;
+
+    dw1000batch.depth = 0 ;
+
+    _dwt_isrprocess() ;
+
+    dw1000batch.depth = batchDepth ;
 }  // end dwt_isr()
 
 /*! ------------------------------------------------------------------------------------------------------------------
@@ -2654,13 +3643,13 @@ void dwt_setleds(uint8 test)
     if(test & 0x1)
     {
         // Set up MFIO for LED output
-        dwt_readfromdevice(GPIO_CTRL_ID,0x00,2,buf);
+        buf[1] = (uint8)(_dwt_readshadow(DWT_SHADOW_GPIO_MODE) >> 8);
         buf[1] &= ~0x3C; //clear the bits
         buf[1] |= 0x14;
         dwt_writetodevice(GPIO_CTRL_ID,0x01,1,&buf[1]);
 
         // Enable LP Oscillator to run from counter, turn on debounce clock
-        dwt_readfromdevice(PMSC_ID,0x02,1,buf);
+        buf[0] = (uint8)(_dwt_readshadow(DWT_SHADOW_PMSC_CTRL0) >> 16);
         buf[0] |= 0x84; //
         dwt_writetodevice(PMSC_ID,0x02,1,buf);
 
@@ -2673,7 +3662,9 @@ void dwt_setleds(uint8 test)
     else if ((test & 0x1)== 0)
     {
         // Clear the GPIO bits that are used for LED control
-        dwt_readfromdevice(GPIO_CTRL_ID,0x00,2,buf);
+        uint32 reg = _dwt_readshadow(DWT_SHADOW_GPIO_MODE);
+        buf[0] = (uint8)reg;
+        buf[1] = (uint8)(reg >> 8);
         buf[1] &= ~(0x14);
         dwt_writetodevice(GPIO_CTRL_ID,0x00,2,buf);
     }
@@ -2698,8 +3689,10 @@ void dwt_setleds(uint8 test)
 void _dwt_enableclocks(int clocks)
 {
     uint8 reg[2];
+    uint32 ctrl0 = _dwt_readshadow(DWT_SHADOW_PMSC_CTRL0);
 
-    dwt_readfromdevice(PMSC_ID, PMSC_CTRL0_OFFSET, 2, reg);
+    reg[0] = (uint8)ctrl0;
+    reg[1] = (uint8)(ctrl0 >> 8);
     switch(clocks)
     {
         case ENABLE_ALL_SEQ:
@@ -2823,7 +3816,7 @@ int dwt_starttx(uint8 mode)
     {
         temp = (uint8)SYS_CTRL_WAIT4RESP ; //set wait4response bit
         dwt_writetodevice(SYS_CTRL_ID,0,1,&temp) ;
-        dw1000local.wait4resp = 1;
+        pdw1000local->wait4resp = 1;
     }
 
     if (mode & DWT_START_TX_DELAYED)
@@ -2852,7 +3845,7 @@ int dwt_starttx(uint8 mode)
 
             // clear the "auto TX to sleep" bit
             dwt_entersleepaftertx(0);
-            dw1000local.wait4resp = 0;
+            pdw1000local->wait4resp = 0;
             retval = DWT_ERROR ;                                            // Failed !
 
         }
@@ -2889,7 +3882,7 @@ void dwt_forcetrxoff(void)
 
     temp = (uint8)SYS_CTRL_TRXOFF ;                       // this assumes the bit is in the lowest byte
 
-	mask = dwt_read32bitreg(SYS_MASK_ID) ;  //read set interrupt mask
+	mask = _dwt_readshadow(DWT_SHADOW_SYS_MASK) ;  //set interrupt mask
 
 	// need to beware of interrupts occurring in the middle of following read modify write cycle
 	// we can disable the radio, but before the status is cleared an interrupt can be set (e.g. the
@@ -2910,7 +3903,7 @@ void dwt_forcetrxoff(void)
 
 	//enable/restore interrupts again...
 	decamutexoff(stat) ;
-    dw1000local.wait4resp = 0;
+    pdw1000local->wait4resp = 0;
 
 } // end deviceforcetrxoff()
 
@@ -2932,6 +3925,8 @@ void dwt_syncrxbufptrs(void)
     //need to make sure that the host/IC buffer pointers are aligned before starting RX
     dwt_readfromdevice(SYS_STATUS_ID, 3, 1, &buff);
 
+    pdw1000local->rxbufsync = 1;
+
     if((buff & (SYS_STATUS_ICRBP>>24) ) !=              /* IC side Receive Buffer Pointer */
             ((buff & (SYS_STATUS_HSRBP>>24) ) << 1) )   /* Host Side Receive Buffer Pointer */
     {
@@ -3034,9 +4029,7 @@ int dwt_rxenable(int delayed)
  */
 void dwt_setrxtimeout(uint16 time)
 {
-    uint8 temp ;
-
-    dwt_readfromdevice(SYS_CFG_ID,3,1,&temp) ;           // read register
+    uint8 temp = (uint8)(pdw1000local->sysCFGreg >> 24) ;           // local copy of the register
 
     if(time > 0)
     {
@@ -3044,7 +4037,7 @@ void dwt_setrxtimeout(uint16 time)
 
         temp |= (uint8)(SYS_CFG_RXWTOE>>24);
         // OR in 32bit value (1 bit set), I know this is in high byte.
-        dw1000local.sysCFGreg |= SYS_CFG_RXWTOE;
+        pdw1000local->sysCFGreg |= SYS_CFG_RXWTOE;
 
         dwt_writetodevice(SYS_CFG_ID,3,1,&temp) ;
     }
@@ -3052,7 +4045,7 @@ void dwt_setrxtimeout(uint16 time)
     {
         temp &= ~((uint8)(SYS_CFG_RXWTOE>>24));
         // AND in inverted 32bit value (1 bit clear), I know this is in high byte.
-        dw1000local.sysCFGreg &= ~(SYS_CFG_RXWTOE);
+        pdw1000local->sysCFGreg &= ~(SYS_CFG_RXWTOE);
 
         dwt_writetodevice(SYS_CFG_ID,3,1,&temp) ;
 
@@ -3113,7 +4106,7 @@ void dwt_setinterrupt(uint32 bitmask, uint8 enable)
     // need to beware of interrupts occurring in the middle of following read modify write cycle
     stat = decamutexon() ;
 
-    mask = dwt_read32bitreg(SYS_MASK_ID) ;           // read register
+    mask = _dwt_readshadow(DWT_SHADOW_SYS_MASK) ;           // current mask
 
     if(enable)
     {
@@ -3256,7 +4249,9 @@ void dwt_softreset(void)
     temp[0] |= 0xF0;
     dwt_writetodevice(PMSC_ID, 0x3, 1, &temp[0]) ;
 
-    dw1000local.wait4resp = 0;
+    pdw1000local->wait4resp = 0;
+    dwt_invalidateshadow(); //the registers are back to their reset values
+    pdw1000local->configValid = 0 ;
 
 }
 
@@ -3311,6 +4306,7 @@ int dwt_configcwmode(uint8 chan)
     //
     //  disable TX/RX RF block sequencing (needed for cw frame mode)
     //
+    pdw1000local->configValid = 0 ; //test mode, the device has to be reset and configured again afterwards
     _dwt_disablesequencing();
 
     //config RF pll (for a given channel)
@@ -3369,6 +4365,7 @@ void dwt_configcontinuousframemode(uint32 framerepetitionrate)
     //
     //  disable TX/RX RF block sequencing (needed for continuous frame mode)
     //
+    pdw1000local->configValid = 0 ; //test mode, the device has to be reset and configured again afterwards
 
     _dwt_disablesequencing();
 
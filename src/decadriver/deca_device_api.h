@@ -61,6 +61,8 @@ typedef signed long int32;
 #endif
 
 #define REG_DUMP (0) //set to 1 to enable register dump functions
+#define DWT_SPI_BATCH (1) //set to 0 to issue the batched register accesses (e.g. in dwt_configure()) one at a time
+#define DWT_NUM_DW_DEV (1) //number of devices the driver keeps state for (see dwt_setlocaldataptr())
 #if (REG_DUMP == 1)
 #include "string.h"
 #endif
@@ -70,6 +72,16 @@ typedef signed long int32;
 
 #define DWT_TIME_UNITS          (1.0/499.2e6/128.0) //!< = 15.65e-12 s
 
+//! multipliers to convert the carrier integrator value (see dwt_readcarrierintegrator()) to a frequency offset in Hz
+#define DWT_FREQ_OFFSET_MULTIPLIER          (998.4e6/2.0/1024.0/131072.0)
+#define DWT_FREQ_OFFSET_MULTIPLIER_110KB    (998.4e6/2.0/8192.0/131072.0)
+
+//! multipliers to convert a frequency offset in Hz to a clock offset in ppm (the carrier frequency depends on the channel)
+#define DWT_HERTZ_TO_PPM_MULTIPLIER_CHAN_1  (-1.0e6/3494.4e6)
+#define DWT_HERTZ_TO_PPM_MULTIPLIER_CHAN_2  (-1.0e6/3993.6e6)
+#define DWT_HERTZ_TO_PPM_MULTIPLIER_CHAN_3  (-1.0e6/4492.8e6)
+#define DWT_HERTZ_TO_PPM_MULTIPLIER_CHAN_5  (-1.0e6/6489.6e6)
+
 #define DWT_DEVICE_ID   (0xDECA0130) 		//!< DW1000 MP device ID
 
 //! constants for selecting the bit rate for data TX (and RX)
@@ -185,6 +197,8 @@ typedef struct{
 	uint16 datalength;	//length of frame
 	uint8  fctrl[2];	//frame control bytes
 	uint8  dblbuff ;	//set if double buffer is enabled
+	uint16 prefetched ;	//number of frame bytes in the prefetch buffer (see dwt_setrxprefetch())
+	uint8  rxstamp[5] ;	//RX timestamp, valid when the whole frame is prefetched (prefetched == datalength)
 
 }dwt_callback_data_t;
 
@@ -231,6 +245,19 @@ typedef struct
 #pragma pack()
 
 
+// OTP calibration words read by dwt_initialise(), see dwt_getotpsnapshot()
+typedef struct
+{
+	uint32	partID ;
+	uint32	lotID ;
+	uint32	ldoTune ;
+	uint32	xtrim ;			// XTAL trim (bits 4:0) and OTP revision (bits 15:8)
+	uint32	antennaDly ;
+	uint32	txPowCfg[12] ;
+	uint32	check ;			// check word (see dwt_setotpsnapshot())
+}
+dwt_otpsnapshot_t ;
+
 typedef struct
 {
 	uint8	PGdly;
@@ -278,6 +305,14 @@ typedef struct
 
 } dwt_deviceentcnts_t ;
 
+typedef struct
+{
+	uint32 transactions ;			//number of SPI transactions (one CS assertion each)
+	uint32 bytes ;					//number of bytes clocked (header and data)
+	uint32 batches ;				//number of batches flushed
+
+} dwt_spistats_t ;
+
 /*! ------------------------------------------------------------------------------------------------------------------
  * @fn dwt_getldotune()
  *
@@ -417,6 +452,37 @@ void dwt_setGPIOvalue(uint32 gpioNum, uint32 value);
  */
 int dwt_initialise(uint16 config) ;
 
+/*! ------------------------------------------------------------------------------------------------------------------
+ * Function: dwt_setotpsnapshot()
+ *
+ * Description: This function gives dwt_initialise() a stored snapshot of the OTP calibration words, it is used
+ * instead of reading the OTP (only the part ID is read) if it was taken from the same part and its check word is good.
+ * The snapshot is not copied, it must stay valid (e.g. in the host non-volatile memory).
+ *
+ * input parameters
+ * @param snapshot - pointer to the snapshot, NULL to always read the OTP
+ *
+ * output parameters
+ *
+ * no return value
+ */
+void dwt_setotpsnapshot(const dwt_otpsnapshot_t *snapshot) ;
+
+/*! ------------------------------------------------------------------------------------------------------------------
+ * Function: dwt_getotpsnapshot()
+ *
+ * Description: This function returns the snapshot of the OTP calibration words used by the last dwt_initialise(),
+ * the host stores it and gives it back with dwt_setotpsnapshot() on the next initialisations
+ *
+ * input parameters
+ *
+ * output parameters
+ * @param snapshot - pointer to the snapshot to fill
+ *
+ * no return value
+ */
+void dwt_getotpsnapshot(dwt_otpsnapshot_t *snapshot) ;
+
 /*! ------------------------------------------------------------------------------------------------------------------
  * Function: dwt_configure()
  *
@@ -438,6 +504,42 @@ int dwt_initialise(uint16 config) ;
  */
 int dwt_configure(dwt_config_t *configData, uint8 useotp) ;
 
+/*! ------------------------------------------------------------------------------------------------------------------
+ * Function: dwt_reconfigure()
+ *
+ * Description: This function moves a device configured with dwt_configure() (and dwt_configuretxrf()) to a new
+ * configuration without a reset, only the registers depending on the changed items (PLL, RF, AGC, DRX, LDE, ...) are
+ * written. The transceiver must be off.
+ *
+ * input parameters
+ * @param config    -   pointer to the new configuration
+ * @param txconfig  -   pointer to the new TX spectrum configuration, NULL to keep it
+ * @param useotp    -   as for dwt_configure(), DWT_LOADANTDLY loads the antenna delay of a new PRF
+ *
+ * output parameters
+ *
+ * returns DWT_SUCCESS for success, or DWT_ERROR if the device configuration is not known (after dwt_initialise() or
+ * dwt_softreset()), then dwt_configure() and dwt_configuretxrf() have to be used
+ */
+int dwt_reconfigure(dwt_config_t *config, dwt_txconfig_t *txconfig, uint8 useotp) ;
+
+/*! ------------------------------------------------------------------------------------------------------------------
+ * Function: dwt_setchannel()
+ *
+ * Description: This function changes the channel and preamble codes of a device already configured with
+ * dwt_configure(), only the channel/preamble code dependent registers are re-programmed (PRF, data rate, preamble
+ * length, PAC and SFD settings are kept). The TX power and PG delay have to be set with dwt_configuretxrf().
+ * The transceiver must be off.
+ *
+ * input parameters
+ * @param config    -   pointer to the configuration structure, only chan, txCode and rxCode are used
+ *
+ * output parameters
+ *
+ * returns DWT_SUCCESS for success, or DWT_ERROR for error
+ */
+int dwt_setchannel(dwt_config_t *config) ;
+
 
 /*! ------------------------------------------------------------------------------------------------------------------
  * Function: dwt_configuretxrf()
@@ -702,6 +804,23 @@ uint32 dwt_readrxtimestamplo32(void);
  */
 uint32 dwt_readsystimestamphi32(void);
 
+/*! ------------------------------------------------------------------------------------------------------------------
+ * Function: dwt_readcarrierintegrator()
+ *
+ *  Description: This is used to read the receiver carrier integrator value (DRX_CAR_INT register). It is only valid
+ *  after a good frame has been received and until the receiver is enabled again. Multiply it by
+ *  DWT_FREQ_OFFSET_MULTIPLIER (DWT_FREQ_OFFSET_MULTIPLIER_110KB at 110 kb/s) to get the frequency offset of the
+ *  remote transmitter in Hz, and then by DWT_HERTZ_TO_PPM_MULTIPLIER_CHAN_x to get its clock offset in ppm
+ *  (positive when the remote clock is faster than the local one).
+ *
+ * input parameters
+ *
+ * output parameters
+ *
+ * returns the signed 21-bit carrier integrator value
+ */
+int32 dwt_readcarrierintegrator(void);
+
 /*! ------------------------------------------------------------------------------------------------------------------
  * Function: dwt_readsystime()
  *
@@ -984,6 +1103,27 @@ void dwt_entersleepaftertx(int enable);
  */
 int dwt_spicswakeup(uint8 *buff, uint16 length);
 
+/*! ------------------------------------------------------------------------------------------------------------------
+ * Function: dwt_setlocaldataptr()
+ *
+ * Description: This function selects the device the following API calls apply to. The driver keeps the state of
+ * DWT_NUM_DW_DEV devices (e.g. many simulated devices in one host process); with a single device this is a constant
+ * check and the driver code is the same as without it.
+ * The SPI batch is shared: the device cannot be changed while a batch is open.
+ *
+ * input parameters
+ * @param index - device index, 0 to DWT_NUM_DW_DEV - 1
+ *
+ * output parameters
+ *
+ * returns DWT_SUCCESS for success, or DWT_ERROR for error (index out of range or batch open)
+ */
+#if (DWT_NUM_DW_DEV > 1)
+int dwt_setlocaldataptr(unsigned int index);
+#else
+#define dwt_setlocaldataptr(index)	(((index) == 0) ? DWT_SUCCESS : DWT_ERROR)
+#endif
+
 /*! ------------------------------------------------------------------------------------------------------------------
  * Function: dwt_setcallbacks()
  *
@@ -999,6 +1139,25 @@ int dwt_spicswakeup(uint8 *buff, uint16 length);
  */
 void dwt_setcallbacks(void (*txcallback)(const dwt_callback_data_t *), void (*rxcallback)(const dwt_callback_data_t *));
 
+/*! ------------------------------------------------------------------------------------------------------------------
+ * Function: dwt_setrxprefetch()
+ *
+ *  Description: This function sets the buffer dwt_isr() reads a good frame (and its RX timestamp into
+ *  cdata.rxstamp) into before calling the RX callback, so the callback does not have to read them again.
+ *  In the header-first mode only the header of a longer frame is prefetched (and not the timestamp), the callback
+ *  reads the rest if the frame is relevant
+ *
+ * input parameters
+ * @param buffer - the pointer to the buffer, NULL disables the prefetch
+ * @param length - the size of the buffer, longer frames are not prefetched (cdata.prefetched is 0)
+ * @param headerLength - header-first: number of bytes prefetched from a longer frame, 0 to prefetch the whole frame
+ *
+ * output parameters
+ *
+ * no return value
+ */
+void dwt_setrxprefetch(uint8 *buffer, uint16 length, uint16 headerLength);
+
 /*! ------------------------------------------------------------------------------------------------------------------
  * @fn dwt_checkIRQ()
  *
@@ -1555,6 +1714,112 @@ int dwt_write16bitoffsetreg(int regFileID, int regOffset, uint16 regval) ;
 #define dwt_write32bitreg(x,y)	dwt_write32bitoffsetreg(x,0,y)
 #define dwt_read32bitreg(x)		dwt_read32bitoffsetreg(x,0)
 
+/*! ------------------------------------------------------------------------------------------------------------------
+ * Function: dwt_invalidateshadow()
+ *
+ * Description: The driver keeps a copy of the registers only the host changes (interrupt mask, ACK/response time,
+ * PMSC control, GPIO mode) so that changing a few of their bits is a single SPI write. This function drops the copies,
+ * the registers are read again on their next use. It is called by the driver on reset, sleep and wake up (through
+ * dwt_spicswakeup()), it must be called by the application when it wakes up the device itself.
+ *
+ * input parameters
+ *
+ * output parameters
+ *
+ * no return value
+ */
+void dwt_invalidateshadow(void) ;
+
+/*! ------------------------------------------------------------------------------------------------------------------
+ * Function: dwt_batchbegin()
+ *
+ * Description: This function starts a batch of register accesses: the following register writes (and the reads queued
+ * with dwt_batchread()) are queued and issued in one pass (under one mutex, writes to consecutive bytes of the same
+ * register file merged into one SPI transaction) by dwt_batchend() or dwt_batchflush().
+ * A read with dwt_readfromdevice() during the batch flushes the queued accesses first so the order is kept.
+ * Batches can be nested, the accesses are issued when the outermost batch ends.
+ * The DW1000 interrupt is masked (decamutexon()) from the outermost dwt_batchbegin() to its dwt_batchend().
+ *
+ * input parameters
+ *
+ * output parameters
+ *
+ * no return value
+ */
+void dwt_batchbegin(void) ;
+
+/*! ------------------------------------------------------------------------------------------------------------------
+ * Function: dwt_batchend()
+ *
+ * Description: This function ends a batch started with dwt_batchbegin(), the queued accesses are issued when the
+ * outermost batch ends.
+ *
+ * input parameters
+ *
+ * output parameters
+ *
+ * returns DWT_SUCCESS for success, or DWT_ERROR for error
+ */
+int dwt_batchend(void) ;
+
+/*! ------------------------------------------------------------------------------------------------------------------
+ * Function: dwt_batchflush()
+ *
+ * Description: This function issues the register accesses queued in the current batch, the batch stays open.
+ *
+ * input parameters
+ *
+ * output parameters
+ *
+ * returns DWT_SUCCESS for success, or DWT_ERROR for error
+ */
+int dwt_batchflush(void) ;
+
+/*! ------------------------------------------------------------------------------------------------------------------
+ * Function: dwt_batchread()
+ *
+ * Description: This function queues a register read in the current batch, the buffer holds the data once the batch
+ * has been flushed (the read is done straight away if no batch is open).
+ *
+ * input parameters
+ * @param recordNumber  - ID of register file or buffer being accessed
+ * @param index         - byte index into register file or buffer being accessed
+ * @param length        - number of bytes being read
+ * @param buffer        - pointer to buffer in which to return the read data (must stay valid until the flush)
+ *
+ * output parameters
+ *
+ * returns DWT_SUCCESS for success, or DWT_ERROR for error
+ */
+int dwt_batchread(uint16 recordNumber, uint16 index, uint32 length, uint8 *buffer) ;
+
+/*! ------------------------------------------------------------------------------------------------------------------
+ * Function: dwt_getspistats()
+ *
+ * Description: This function returns the SPI transaction and byte counts since the last dwt_clearspistats()
+ *
+ * input parameters
+ * @param stats - pointer to the dwt_spistats_t structure which will hold the counts
+ *
+ * output parameters
+ *
+ * no return value
+ */
+void dwt_getspistats(dwt_spistats_t *stats) ;
+
+/*! ------------------------------------------------------------------------------------------------------------------
+ * Function: dwt_clearspistats()
+ *
+ * Description: This function clears the SPI transaction and byte counts
+ *
+ * input parameters
+ *
+ * output parameters
+ *
+ * no return value
+ */
+void dwt_clearspistats(void) ;
+
 
 /*! ------------------------------------------------------------------------------------------------------------------
  * Function: writetospi()
@@ -862,6 +862,13 @@ extern "C" {
 #define DRX_DRX_TUNE4H_LEN      (2)
 #define DRX_DRX_TUNE4H_MASK     0xFFFF
 
+/* offset from DRX_CONF_ID in bytes */
+#define DRX_CAR_INT_OFFSET      0x28    /* 7.2.40.11 Sub-Register 0x27:28 - DRX_CAR_INT, carrier recovery integrator */
+#define DRX_CAR_INT_LEN         (3)
+#define DRX_CAR_INT_MASK        0x001FFFFFUL    /* 21-bit signed value */
+#define DRX_CAR_INT_SIGN_BIT    0x00100000UL
+#define DRX_CAR_INT_SIGN_EXT    0xFFE00000UL
+
 
 
 /****************************************************************************//**
@@ -56,6 +56,156 @@ int closespi(void)
 
 } // end closespi()
 
+/*! ------------------------------------------------------------------------------------------------------------------
+ * Function: _spi_pipeline8()
+ *
+ * Pipelined 8-bit byte loop: the next byte is written as soon as TXE is set instead of after the previous byte has been
+ * received, so the clock runs back to back instead of idling while the CPU polls.
+ * txBuffer == NULL sends dummy zeros. rxBuffer == NULL discards what is received: only TXE is followed and the RX side
+ * (RXNE and the overrun it leaves behind) is cleared once the last byte is out (TXE then BSY, as in the reference manual).
+ * When reading, at most two bytes are in flight (one in the shift register, one in DR) and the caller must keep
+ * interrupts off: a preemption longer than a byte time would overrun RX and lose a byte. Nothing is in flight once the
+ * function returns, the master only clocks what it writes, so a long read can be split into interrupts-off chunks.
+ */
+#pragma GCC optimize ("O3")
+static inline void _spi_pipeline8(const uint8 *txBuffer, uint8 *rxBuffer, uint32 length)
+{
+	uint32 sent = 0, recv = 0;
+
+	if(rxBuffer == NULL)
+	{
+		while(sent < length)
+		{
+			if(SPIx->SR & SPI_I2S_FLAG_TXE)
+			{
+				SPIx->DR = (txBuffer != NULL) ? txBuffer[sent] : 0;
+				sent++;
+			}
+		}
+
+		while(!(SPIx->SR & SPI_I2S_FLAG_TXE));
+		while(SPIx->SR & SPI_I2S_FLAG_BSY);
+
+		SPIx->DR ;
+		SPIx->SR ; // DR then SR read clears OVR
+		return;
+	}
+
+	while(recv < length)
+	{
+		if((sent < length) && ((sent - recv) < 2) && (SPIx->SR & SPI_I2S_FLAG_TXE))
+		{
+			SPIx->DR = (txBuffer != NULL) ? txBuffer[sent] : 0;
+			sent++;
+		}
+
+		if(SPIx->SR & SPI_I2S_FLAG_RXNE)
+		{
+			rxBuffer[recv++] = SPIx->DR ; // this clears RXNE bit
+		}
+	}
+}
+
+#if (SPI_WORD_FRAMES == 1)
+/*! ------------------------------------------------------------------------------------------------------------------
+ * Function: _spi_setdff()
+ *
+ * Switch SPIx between 8 and 16-bit frames. DFF may only be changed with the peripheral disabled, which is safe here
+ * because the previous loop has drained RXNE and we wait for BSY to drop; CS is a GPIO so the DW1000 stays selected.
+ */
+static inline void _spi_setdff(int word)
+{
+	while(SPIx->SR & SPI_I2S_FLAG_BSY);
+
+	SPIx->CR1 &= (uint16_t)~SPI_CR1_SPE;
+	if(word)
+	{
+		SPIx->CR1 |= SPI_CR1_DFF;
+	}
+	else
+	{
+		SPIx->CR1 &= (uint16_t)~SPI_CR1_DFF;
+	}
+	SPIx->CR1 |= SPI_CR1_SPE;
+}
+
+/*! ------------------------------------------------------------------------------------------------------------------
+ * Function: _spi_pipeline16()
+ *
+ * Same pipeline as _spi_pipeline8() but on 16-bit frames: halves the number of DR accesses and status polls for the
+ * body. With MSB first the high byte of each word goes out first, so the byte order on the wire is unchanged.
+ * words is the number of 16-bit frames (2 bytes each)
+ */
+#pragma GCC optimize ("O3")
+static inline void _spi_pipeline16(const uint8 *txBuffer, uint8 *rxBuffer, uint32 words)
+{
+	uint32 sent = 0, recv = 0;
+
+	if(rxBuffer == NULL)
+	{
+		while(sent < words)
+		{
+			if(SPIx->SR & SPI_I2S_FLAG_TXE)
+			{
+				SPIx->DR = (txBuffer != NULL) ? (uint16_t)((txBuffer[2*sent] << 8) | txBuffer[2*sent + 1]) : 0;
+				sent++;
+			}
+		}
+
+		while(!(SPIx->SR & SPI_I2S_FLAG_TXE));
+		while(SPIx->SR & SPI_I2S_FLAG_BSY);
+
+		SPIx->DR ;
+		SPIx->SR ;
+		return;
+	}
+
+	while(recv < words)
+	{
+		if((sent < words) && ((sent - recv) < 2) && (SPIx->SR & SPI_I2S_FLAG_TXE))
+		{
+			SPIx->DR = (txBuffer != NULL) ? (uint16_t)((txBuffer[2*sent] << 8) | txBuffer[2*sent + 1]) : 0;
+			sent++;
+		}
+
+		if(SPIx->SR & SPI_I2S_FLAG_RXNE)
+		{
+			uint16_t w = SPIx->DR ;
+
+			rxBuffer[2*recv] = (uint8)(w >> 8);
+			rxBuffer[2*recv + 1] = (uint8)w;
+			recv++;
+		}
+	}
+}
+#endif
+
+/*! ------------------------------------------------------------------------------------------------------------------
+ * Function: _spi_body()
+ *
+ * Clock the body of a transaction (after the header): long bodies use 16-bit frames for their even part when
+ * SPI_WORD_FRAMES is enabled, anything left over (or everything, for short bodies) goes through the 8-bit pipeline
+ */
+static inline void _spi_body(const uint8 *txBuffer, uint8 *rxBuffer, uint32 length)
+{
+#if (SPI_WORD_FRAMES == 1)
+	if(length >= SPI_WORD_MIN_LENGTH)
+	{
+		uint32 words = length >> 1;
+
+		_spi_setdff(1);
+		_spi_pipeline16(txBuffer, rxBuffer, words);
+		_spi_setdff(0);
+
+		words <<= 1;
+		length -= words;
+		if(txBuffer != NULL) txBuffer += words;
+		if(rxBuffer != NULL) rxBuffer += words;
+	}
+#endif
+	_spi_pipeline8(txBuffer, rxBuffer, length);
+}
+
 /*! ------------------------------------------------------------------------------------------------------------------
  * Function: writetospi()
  *
@@ -72,32 +222,15 @@ int writetospi_serial
     const uint8 *bodyBuffer
 )
 {
-
-	int i=0;
-
     decaIrqStatus_t  stat ;
 
     stat = decamutexon() ;
 
     SPIx_CS_GPIO->BSRRH = SPIx_CS;
 
-    for(i=0; i<headerLength; i++)
-    {
-    	SPIx->DR = headerBuffer[i];
+    _spi_pipeline8(headerBuffer, NULL, headerLength);
 
-    	while ((SPIx->SR & SPI_I2S_FLAG_RXNE) == (uint16_t)RESET);
-
-    	SPIx->DR ;
-    }
-
-    for(i=0; i<bodylength; i++)
-    {
-     	SPIx->DR = bodyBuffer[i];
-
-    	while((SPIx->SR & SPI_I2S_FLAG_RXNE) == (uint16_t)RESET);
-
-		SPIx->DR ;
-	}
+    _spi_body(bodyBuffer, NULL, bodylength);
 
     SPIx_CS_GPIO->BSRRL = SPIx_CS;
 
@@ -124,34 +257,31 @@ int readfromspi_serial
     uint8       *readBuffer
 )
 {
-
-	int i=0;
-
     decaIrqStatus_t  stat ;
+    uint32 primask ;
+    uint32 chunk ;
 
     stat = decamutexon() ;
 
-    /* Wait for SPIx Tx buffer empty */
-    //while (port_SPIx_busy_sending());
-
     SPIx_CS_GPIO->BSRRH = SPIx_CS;
 
-    for(i=0; i<headerLength; i++)
+    _spi_pipeline8(headerBuffer, NULL, headerLength); // header bytes clocked back are discarded
+
+    // no preemption while bytes are in flight (see _spi_pipeline8), but only for SPI_IRQ_CHUNK bytes at a time so
+    // long reads (frames, accumulator) do not hold off SysTick, USB and the EXTI lines for the whole transfer
+    while(readlength)
     {
-    	SPIx->DR = headerBuffer[i];
+        chunk = (readlength > SPI_IRQ_CHUNK) ? SPI_IRQ_CHUNK : readlength;
 
-     	while((SPIx->SR & SPI_I2S_FLAG_RXNE) == (uint16_t)RESET);
+        primask = __get_PRIMASK();
+        __disable_irq();
 
-     	readBuffer[0] = SPIx->DR ; // Dummy read as we write the header
-    }
+        _spi_body(NULL, readBuffer, chunk); // dummy zeros are written as we read the message body
 
-    for(i=0; i<readlength; i++)
-    {
-    	SPIx->DR = 0;  // Dummy write as we read the message body
+        __set_PRIMASK(primask);
 
-    	while((SPIx->SR & SPI_I2S_FLAG_RXNE) == (uint16_t)RESET);
- 
-	   	readBuffer[i] = SPIx->DR ;//port_SPIx_receive_data(); //this clears RXNE bit
+        readBuffer += chunk;
+        readlength -= chunk;
     }
 
     SPIx_CS_GPIO->BSRRL = SPIx_CS;
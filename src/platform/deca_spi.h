@@ -22,6 +22,9 @@ extern "C" {
 
 #define DECA_MAX_SPI_HEADER_LENGTH      (3)                     // max number of bytes in header (for formating & sizing)
 #define EVB1000_LCD_SUPPORT				(1)
+#define SPI_WORD_FRAMES					(1)						// clock long bodies as 16-bit frames (serial path only)
+#define SPI_WORD_MIN_LENGTH				(16)					// shorter bodies stay on 8-bit frames (DFF switch costs more than it saves)
+#define SPI_IRQ_CHUNK					(32)					// bytes read per interrupts-off section, even and >= SPI_WORD_MIN_LENGTH
 /*! ------------------------------------------------------------------------------------------------------------------
  * Function: openspi()
  *
@@ -1,6 +1,7 @@
 /*! ----------------------------------------------------------------------------
  * @file	dma_spi.c
- * @brief	realize fast dma spi read/write; in "safe" mode it used extra RAM buffer
+ * @brief	asynchronous zero-copy dma spi read/write (transaction queue, completion callbacks); blocking read/write
+ * 			wrappers
  *
  * @attention
  *
@@ -16,17 +17,16 @@
 #include "deca_device_api.h"
 #include "port.h"
 
+#if (DMA_ENABLE == 1)
+
 /***************************************************************************//**
  * Local variables, private define
 **/
-// Two options of DMA_SPI - with tmp_buf buffer and without
-// use  SAFE_DMA_AND_BUFF if you unsure that DMA_SPI works properly
-#define SAFE_DMA_AND_BUFF
-
-#ifdef	SAFE_DMA_AND_BUFF
- #define MAX_DMABUF_SIZE	4096
-static uint8 __align4 	tmp_buf[MAX_DMABUF_SIZE];
-#endif
+// zero-copy: the body is transferred from/to the caller's buffer, the unused direction of the full duplex transfer
+// is a single byte (dummy TX byte for a read, RX sink for a write) with memory increment disabled
+ #define MAX_DMA_BODY_SIZE	0xFFFF		/* CNDTR is 16-bit */
+static uint8 dmaSink;
+static const uint8 dmaDummy = 0;
 
 /*
  * 	do not use library function cause they are slow
@@ -41,6 +41,23 @@ static uint8 __align4 	tmp_buf[MAX_DMABUF_SIZE];
 #define PORT_SPI_CLEAR_CS_FAST	{SPIx_CS_GPIO->BSRRH = SPIx_CS;}
 #define PORT_SPI_SET_CS_FAST	{SPIx_CS_GPIO->BSRRL = SPIx_CS;}
 
+/***************************************************************************//**
+ * Asynchronous engine: the transactions are queued, the header of the active one is sent by polling (up to 3 bytes,
+ * cheaper than a DMA run and its IRQ) then its body is clocked full duplex by the TX and RX DMA channels, the RX
+ * transfer-complete interrupt ends it (all bytes are on the wire when the last one has been received), starts the next
+ * queued transaction and then calls the completion callback.
+**/
+#define SPI_DMA_QUEUE_LEN	(8)
+#define DMA_RX_IRQn			DMA1_Channel2_IRQn
+#define DMA_RX_FLAG_TC		DMA1_FLAG_TC2
+#define DMA_RXTX_FLAGS_CLR	(DMA1_FLAG_GL2 | DMA1_FLAG_GL3)
+
+static spi_xfer_t *spiQueue[SPI_DMA_QUEUE_LEN];
+static uint8 spiQueueIn;
+static uint8 spiQueueOut;
+static uint8 spiQueueLen;
+static spi_xfer_t * volatile spiActive;
+
 /***************************************************************************//**
  * Exported function prototypes
  */
@@ -60,213 +77,401 @@ int readfromspi_dma( uint16	headerLength,
 /***************************************************************************//**
  * @fn		dma_init()
  * @brief
- * 			init of dma module. we will not use IRQ for DMA transaction
+ * 			init of dma module, the RX channel transfer-complete IRQ ends the transactions
  * 			spi_init should be executed first
  *
 **/
 void dma_init(void)
 {
+	NVIC_InitTypeDef NVIC_InitStructure;
+
 	RCC_AHBPeriphClockCmd(RCC_AHBPeriph_DMA1, ENABLE);		/* connect DMA1 clock */
 	RCC_APB2PeriphClockCmd(RCC_APB2Periph_SPI1, ENABLE);	/* connect SPI1 clock if not enable yet */
 
     DMA_DeInit(DMA_TX_CH);
     DMA_DeInit(DMA_RX_CH);
 
-
 /* do not use library function cause it slow */
-/* connect SPI to DMA in write/read functions
- * SPI_I2S_DMACmd(SPIx, SPI_I2S_DMAReq_Tx , ENABLE);
- * SPI_I2S_DMACmd(SPIx, SPI_I2S_DMAReq_Rx , ENABLE);
-**/
-    SPIx->CR2 |= SPI_I2S_DMAReq_Tx;	//connect Tx DMA_SPI
-    SPIx->CR2 &= ~SPI_I2S_DMAReq_Rx;//Disconnect Rx DMA_SPI by default
+/* SPI_Tx & SPI_Rx are connected to DMA for each transaction (see _spi_dma_start) */
+    SPIx->CR2 &= ~(SPI_I2S_DMAReq_Tx | SPI_I2S_DMAReq_Rx);
 
 /* DMA Channel SPI_TX Configuration */
     DMA_TX_CH->CCR =DMA_DIR_PeripheralDST | DMA_PeripheralInc_Disable | DMA_MemoryInc_Enable |\
     				DMA_PeripheralDataSize_Byte | DMA_MemoryDataSize_Byte | DMA_Mode_Normal |\
-    				DMA_Priority_High | DMA_M2M_Disable ;
+    				DMA_Priority_High | DMA_M2M_Disable ;	/* memory increment set per transaction */
 
-/* Default DMA Channel SPI_RX Configuration */
+/* DMA Channel SPI_RX Configuration (transfer complete interrupt) */
 	DMA_RX_CH->CCR =DMA_DIR_PeripheralSRC | DMA_PeripheralInc_Disable | DMA_MemoryInc_Enable |\
 					DMA_PeripheralDataSize_Byte | DMA_MemoryDataSize_Byte | DMA_Mode_Normal |\
-					DMA_Priority_High | DMA_M2M_Disable ;
-}
+					DMA_Priority_VeryHigh | DMA_M2M_Disable | DMA_IT_TC ;
+
+	DMA_TX_CH->CPAR = DMA_RX_CH->CPAR = (uint32) &(SPIx->DR);
 
+	spiQueueIn = spiQueueOut = spiQueueLen = 0;
+	spiActive = NULL;
+
+	/* higher priority than the DW1000 IRQ, so a transaction queued from dwt_isr() can complete */
+	NVIC_InitStructure.NVIC_IRQChannel = DMA_RX_IRQn;
+	NVIC_InitStructure.NVIC_IRQChannelPreemptionPriority = 14;
+	NVIC_InitStructure.NVIC_IRQChannelSubPriority = 0;
+	NVIC_InitStructure.NVIC_IRQChannelCmd = ENABLE;
+	NVIC_Init(&NVIC_InitStructure);
+}
 
 /***************************************************************************//**
- * @fn	writetospi()
- * @brief
- * 		  Low level function to write to the SPI
- * 		  Takes two separate byte buffers for write header and write data
- * 		  Source data will be transfered from buf to spi via DMA
- *
- * @return
- * 			DWT_SUCCESS or DWT_ERROR
+ * @fn		_spi_dma_start()
+ * @brief	assert CS, send the header of a transaction and start the DMA channels on the caller's body buffer
  *
 **/
 #pragma GCC optimize ("O3")
-int writetospi_dma
-(
-	uint16 headerLength,
-	const uint8 *headerBuffer,
-	uint32 bodylength,
-	const uint8 *bodyBuffer
-)
+static void _spi_dma_start(spi_xfer_t *xfer)
 {
-    int stat ;
+	uint32 i;
 
-#ifdef SAFE_DMA_AND_BUFF
-    if ((headerLength + bodylength) > MAX_DMABUF_SIZE)
-    {
-    	return DWT_ERROR;
-    }
-#endif
+	xfer->status = SPI_XFER_ACTIVE;
 
-    stat = decamutexon() ;
+	PORT_SPI_CLEAR_CS_FAST	// give extra time for SPI slave device
 
-/* check spi_transaction finished */
-//    while((SPIx->SR & SPI_I2S_FLAG_BSY) !=0 );
+	SPIx->DR;	/* clear a byte left in the SPI RX register */
 
-    PORT_SPI_CLEAR_CS_FAST	// give extra time for SPI slave device
+	for (i = 0; i < xfer->headerLength; i++)
+	{
+		SPIx->DR = xfer->header[i];
 
-    DMA_TX_CH->CPAR =(uint32) &(SPIx->DR) ;
+		while ((SPIx->SR & SPI_I2S_FLAG_RXNE) == (uint16_t)RESET);
 
-    /*header*/
-    DMA_TX_CH->CMAR = (uint32)(headerBuffer) ;
-    DMA_TX_CH->CNDTR = headerLength ;
+		SPIx->DR ;
+	}
 
-    PORT_DMA_START_TX_FAST		  /* Start transfer */
-    while((DMA_TX_CH->CNDTR) !=0);/* pool until last clock from SPI_TX register done */
-    PORT_DMA_STOP_TX_FAST	/* do not wait SPI finished cause SPI slow. perform switching on next buffer while spi transaction in wire */
+	if (xfer->rxBuffer == NULL)	/* write: body from the caller, received bytes to the sink */
+	{
+		DMA_TX_CH->CCR |= DMA_MemoryInc_Enable;
+		DMA_RX_CH->CCR &= ~DMA_MemoryInc_Enable;
+		DMA_TX_CH->CMAR = (uint32)xfer->txBuffer;
+		DMA_RX_CH->CMAR = (uint32)&dmaSink;
+	}
+	else						/* read: dummy bytes out, body to the caller */
+	{
+		DMA_TX_CH->CCR &= ~DMA_MemoryInc_Enable;
+		DMA_RX_CH->CCR |= DMA_MemoryInc_Enable;
+		DMA_TX_CH->CMAR = (uint32)&dmaDummy;
+		DMA_RX_CH->CMAR = (uint32)xfer->rxBuffer;
+	}
+	DMA_TX_CH->CNDTR = DMA_RX_CH->CNDTR = xfer->length;
 
-    /*data*/
-    DMA_TX_CH->CMAR = (uint32)(bodyBuffer);
-    DMA_TX_CH->CNDTR = bodylength ;
+	SPIx->CR2 |= (SPI_I2S_DMAReq_Tx | SPI_I2S_DMAReq_Rx);	/* connect SPI_Tx & SPI_Rx to DMA */
 
-    PORT_DMA_START_TX_FAST		  /* Start transfer */
-    while((DMA_TX_CH->CNDTR) !=0);/* pool until last clock from SPI_TX register done */
-    while((SPIx->SR & SPI_I2S_FLAG_BSY) !=0 );/* Wait until last byte of transmission will leave SPI wire */
-    PORT_DMA_STOP_TX_FAST
+	PORT_DMA_START_RX_FAST
+	PORT_DMA_START_TX_FAST
+}
 
-    /* finish */
-    PORT_SPI_SET_CS_FAST
+/***************************************************************************//**
+ * @fn		dma_spi_irq()
+ * @brief	end the active transaction if its last byte has been received (called from the DMA RX channel IRQ,
+ * 			or by spi_dma_poll()): release CS, start the next queued transaction and call the
+ * 			completion callback
+ *
+**/
+#pragma GCC optimize ("O3")
+void dma_spi_irq(void)
+{
+	spi_xfer_t *xfer = spiActive;
 
-    SPIx->DR;	// perform a dummy read operation to clear OverRun &  RxNe flags in SPI SR register
+	if ((DMA1->ISR & DMA_RX_FLAG_TC) == 0)
+	{
+		return;
+	}
 
-    decamutexoff(stat);
+	DMA1->IFCR = DMA_RXTX_FLAGS_CLR;
+	PORT_DMA_STOP_TX_FAST
+	PORT_DMA_STOP_RX_FAST
 
-    return DWT_SUCCESS;
+	PORT_SPI_SET_CS_FAST
+
+	SPIx->CR2 &= ~(SPI_I2S_DMAReq_Tx | SPI_I2S_DMAReq_Rx) ;	//Disconnect from DMA_SPI !
+
+	xfer->status = SPI_XFER_DONE;
+
+	/* keep the wire busy while the callback runs */
+	if (spiQueueLen)
+	{
+		spiActive = spiQueue[spiQueueOut];
+		spiQueueOut = (spiQueueOut + 1) % SPI_DMA_QUEUE_LEN;
+		spiQueueLen--;
+		_spi_dma_start(spiActive);
+	}
+	else
+	{
+		spiActive = NULL;
+	}
+
+	if (xfer->callback != NULL)
+	{
+		xfer->callback(xfer);
+	}
 }
 
+/***************************************************************************//**
+ * @fn		spi_dma_poll()
+ * @brief	end the active transaction if it has completed, without waiting for the IRQ (e.g. when the caller
+ * 			runs at a higher priority or with the interrupts disabled)
+ *
+**/
+void spi_dma_poll(void)
+{
+	NVIC_DisableIRQ(DMA_RX_IRQn);
+	dma_spi_irq();
+	NVIC_EnableIRQ(DMA_RX_IRQn);
+}
 
 /***************************************************************************//**
- * @fn	readfromspi()
- * @brief Source data will be transfered from buf to spi via DMA
- * 		  Low level abstract function to write to the SPI
- * 		  Takes two separate byte buffers for write header and write data
+ * @fn		spi_dma_submit()
+ * @brief	queue a transaction, it is started straight away if the SPI is idle. The header is copied, the body
+ * 			(write) or read buffer is used in place and must stay valid until the transaction is done (status
+ * 			SPI_XFER_DONE, callback)
  *
  * @return
- * Low level abstract function to read from the SPI
- * Takes two separate byte buffers for write header and read data
- * returns the offset into read buffer where first byte of read data may be found,
- * or returns -1 if there was an error
- * 			DWT_SUCCESS or DWT_ERROR
+ * 			DWT_SUCCESS or DWT_ERROR (empty or too long body, header too long or queue full)
+ *
+**/
+int spi_dma_submit(spi_xfer_t *xfer)
+{
+	uint32 primask;
+
+	if ((xfer->length == 0) || (xfer->length > MAX_DMA_BODY_SIZE) || (xfer->headerLength > sizeof(xfer->header)))
+	{
+		return DWT_ERROR;
+	}
+
+	primask = __get_PRIMASK();
+	__disable_irq();
+
+	if (spiActive == NULL)
+	{
+		spiActive = xfer;
+		_spi_dma_start(xfer);
+	}
+	else if (spiQueueLen < SPI_DMA_QUEUE_LEN)
+	{
+		xfer->status = SPI_XFER_QUEUED;
+		spiQueue[spiQueueIn] = xfer;
+		spiQueueIn = (spiQueueIn + 1) % SPI_DMA_QUEUE_LEN;
+		spiQueueLen++;
+	}
+	else
+	{
+		__set_PRIMASK(primask);
+		return DWT_ERROR;
+	}
+
+	__set_PRIMASK(primask);
+
+	return DWT_SUCCESS;
+}
+
+/***************************************************************************//**
+ * @fn		spi_dma_abort()
+ * @brief	give up a transaction that has not completed (e.g. after a timeout): stop the DMA channels if it is on
+ * 			the wire, or take it out of the queue, and mark it SPI_XFER_ERROR. Its callback is not called, the next
+ * 			queued transaction is started.
+ *
+**/
+void spi_dma_abort(spi_xfer_t *xfer)
+{
+	uint32 primask;
+	uint8 i, n;
+
+	primask = __get_PRIMASK();
+	__disable_irq();
+
+	if (spiActive == xfer)
+	{
+		PORT_DMA_STOP_TX_FAST
+		PORT_DMA_STOP_RX_FAST
+		DMA1->IFCR = DMA_RXTX_FLAGS_CLR;
+
+		SPIx->CR2 &= ~(SPI_I2S_DMAReq_Tx | SPI_I2S_DMAReq_Rx) ;	//Disconnect from DMA_SPI !
+
+		while (SPIx->SR & SPI_I2S_FLAG_BSY);
+		SPIx->DR ;
+		SPIx->SR ;	/* DR then SR read clears OVR */
+
+		PORT_SPI_SET_CS_FAST
+
+		if (spiQueueLen)
+		{
+			spiActive = spiQueue[spiQueueOut];
+			spiQueueOut = (spiQueueOut + 1) % SPI_DMA_QUEUE_LEN;
+			spiQueueLen--;
+			_spi_dma_start(spiActive);
+		}
+		else
+		{
+			spiActive = NULL;
+		}
+	}
+	else
+	{
+		/* keep the order of the other queued transactions */
+		for (i = 0, n = 0; i < spiQueueLen; i++)
+		{
+			spi_xfer_t *q = spiQueue[(spiQueueOut + i) % SPI_DMA_QUEUE_LEN];
+
+			if (q != xfer)
+			{
+				spiQueue[(spiQueueOut + n++) % SPI_DMA_QUEUE_LEN] = q;
+			}
+		}
+		spiQueueLen = n;
+		spiQueueIn = (spiQueueOut + n) % SPI_DMA_QUEUE_LEN;
+	}
+
+	if (xfer->status != SPI_XFER_DONE)
+	{
+		xfer->status = SPI_XFER_ERROR;
+	}
+
+	__set_PRIMASK(primask);
+}
+
+/***************************************************************************//**
+ * @fn		spi_dma_busy()
+ * @brief	check if a transaction is on the wire or queued
+ *
+**/
+int spi_dma_busy(void)
+{
+	return (spiActive != NULL);
+}
+
+/***************************************************************************//**
+ * @fn		_spi_dma_transfer()
+ * @brief	blocking transaction: queue it and wait until it is done. A header-only transaction (no DMA run to end
+ * 			it) is clocked by the serial loop once the queue is empty
  *
 **/
 #pragma GCC optimize ("O3")
-int readfromspi_dma
-(
-	uint16       headerLength,
-	const uint8 *headerBuffer,
-	uint32       readlength,
-	uint8       *readBuffer
-)
+static int _spi_dma_transfer(spi_xfer_t *xfer)
 {
     int stat ;
 
-#ifdef	SAFE_DMA_AND_BUFF
-    uint16 	count;
-    count = (uint16)(headerLength + readlength);
+    xfer->callback = NULL;
 
-    if (count > MAX_DMABUF_SIZE )
+    if (xfer->length > MAX_DMA_BODY_SIZE)
     {
     	return DWT_ERROR;
     }
-#endif
 
     stat = decamutexon() ;
 
-/* check any spi_transaction finished */
-//    while((SPIx->SR & SPI_I2S_FLAG_BSY) !=0 );
-
-// do not use library function cause it slow
-    PORT_SPI_CLEAR_CS_FAST	// give extra time for SPI slave device
-
-    DMA_TX_CH->CMAR =  (uint32)(headerBuffer); // no matter what we send to spi after header when perform a reading operation
-    DMA_RX_CH->CPAR  = DMA_TX_CH->CPAR = (uint32)&(SPIx->DR);
-
-#ifdef	SAFE_DMA_AND_BUFF
-
-    SPIx->CR2 |= (SPI_I2S_DMAReq_Tx | SPI_I2S_DMAReq_Rx) ;	/* connect SPI_Tx & SPI_Rx to DMA */
-    DMA_RX_CH->CMAR = (uint32)(&tmp_buf) ;	/* read buffer */
+    if (xfer->length == 0)
+    {
+    	while (spi_dma_busy())
+    	{
+    		spi_dma_poll();
+    	}
+    	writetospi_serial(xfer->headerLength, xfer->header, 0, NULL);
 
-    DMA_RX_CH->CNDTR = DMA_TX_CH->CNDTR = count ;	//length
+    	decamutexoff(stat);
 
-    /* Start write/read transfer*/
-    /* read data */
-    PORT_DMA_START_RX_FAST
-    PORT_DMA_START_TX_FAST
-    while(DMA_RX_CH->CNDTR !=0);	/* pool until last clock from SPI_RX */
-    PORT_DMA_STOP_TX_FAST
-    PORT_DMA_STOP_RX_FAST
+    	return DWT_SUCCESS;
+    }
 
-    /* result of read operation*/
-    for (count=headerLength; count<(headerLength+readlength); count++)
+    while (spi_dma_submit(xfer) != DWT_SUCCESS)	/* queue full */
     {
-    	*readBuffer++ = tmp_buf[count];
+    	spi_dma_poll();
+    }
+    while (xfer->status != SPI_XFER_DONE)
+    {
+    	spi_dma_poll();
     }
-
-#else
-
-    SPIx->CR2 |= (SPI_I2S_DMAReq_Tx | SPI_I2S_DMAReq_Rx) ;	/* connect SPI_Tx & SPI_Rx to DMA */
-
-    DMA_RX_CH->CMAR = (uint32) readBuffer ;	/* read buffer addr */
-
-    DMA_TX_CH->CNDTR = headerLength+readlength;
-    DMA_RX_CH->CNDTR = headerLength;
-
-    /* Start. write command */
-
-    /* DMA_RX Disable Memory increment and Start */
-	DMA_RX_CH->CCR = DMA_CCR1_EN |	/* start Rx */
-					DMA_DIR_PeripheralSRC | DMA_PeripheralInc_Disable | DMA_MemoryInc_Disable |\
-					DMA_PeripheralDataSize_Byte | DMA_MemoryDataSize_Byte | DMA_Mode_Normal |\
-					DMA_Priority_High | DMA_M2M_Disable ;
-
-    PORT_DMA_START_TX_FAST
-    while(DMA_RX_CH->CNDTR !=0);	/* pool until last clock from SPI_RX */
-    PORT_DMA_STOP_RX_FAST
-
-    DMA_RX_CH->CNDTR = readlength;	/* read data length */
-
-	DMA_RX_CH->CCR |= (DMA_MemoryInc_Enable);	 /* DMA_Rx Enable Memory increment */
-/* DMA_Rx should be started after new readlength and changing of Memory increment mode */
-	PORT_DMA_START_RX_FAST
-	while(DMA_RX_CH->CNDTR !=0);	/* pool until last clock from SPI_RX */
-	PORT_DMA_STOP_TX_FAST
-	PORT_DMA_STOP_RX_FAST
-
-#endif
-
-    PORT_SPI_SET_CS_FAST
-
-    SPIx->CR2 &= ~(SPI_I2S_DMAReq_Rx) ;	//Disconnect Rx from DMA_SPI !
 
     decamutexoff(stat);
 
     return DWT_SUCCESS;
 }
 
-/* eof dma_spi */
+/***************************************************************************//**
+ * @fn	writetospi()
+ * @brief
+ * 		  Low level function to write to the SPI
+ * 		  Takes two separate byte buffers for write header and write data
+ * 		  Blocking wrapper of the asynchronous engine
+ *
+ * @return
+ * 			DWT_SUCCESS or DWT_ERROR
+ *
+**/
+#pragma GCC optimize ("O3")
+int writetospi_dma
+(
+	uint16 headerLength,
+	const uint8 *headerBuffer,
+	uint32 bodylength,
+	const uint8 *bodyBuffer
+)
+{
+	spi_xfer_t xfer;
+	uint16 i;
+
+	if (headerLength > sizeof(xfer.header))
+	{
+		return DWT_ERROR;
+	}
+
+	for (i = 0; i < headerLength; i++)
+	{
+		xfer.header[i] = headerBuffer[i];
+	}
+	xfer.headerLength = headerLength;
+	xfer.txBuffer = bodyBuffer;
+	xfer.rxBuffer = NULL;
+	xfer.length = bodylength;
+
+	return _spi_dma_transfer(&xfer);
+}
 
 
+/***************************************************************************//**
+ * @fn	readfromspi()
+ * @brief
+ * 		  Low level abstract function to read from the SPI
+ * 		  Takes two separate byte buffers for write header and read data
+ * 		  Blocking wrapper of the asynchronous engine
+ *
+ * @return
+ * 			DWT_SUCCESS or DWT_ERROR
+ *
+**/
+#pragma GCC optimize ("O3")
+int readfromspi_dma
+(
+	uint16       headerLength,
+	const uint8 *headerBuffer,
+	uint32       readlength,
+	uint8       *readBuffer
+)
+{
+	spi_xfer_t xfer;
+	uint16 i;
+
+	if (headerLength > sizeof(xfer.header))
+	{
+		return DWT_ERROR;
+	}
+
+	for (i = 0; i < headerLength; i++)
+	{
+		xfer.header[i] = headerBuffer[i];
+	}
+	xfer.headerLength = headerLength;
+	xfer.txBuffer = NULL;
+	xfer.rxBuffer = readBuffer;
+	xfer.length = readlength;
+
+	return _spi_dma_transfer(&xfer);
+}
+
+#endif /* DMA_ENABLE */
+
+/* eof dma_spi */
@@ -33,6 +33,23 @@ extern __IO unsigned long time32_incr;
 
 int instanceMode = 0; // 1 = TAG , 0 = ANCHOR
 
+static uint16_t spiPrescaler = SPIx_PRESCALER;		// SPIx BR bits currently set
+static dw_clk_state_e dwClockState = DW_CLK_XTI;	// DW1000 clock state declared to the SPI governor
+static int spiSlowCount = 0;						// nested port_SPIx_slowbegin()
+
+static volatile uint8_t portWake = 0;				// set by the interrupt handlers the main loop has to serve
+static uint32_t sysTickCycles = 0;					// SysTick counts per tick (SysTick_Configuration())
+static uint64_t idleCycles = 0;						// SysTick counts spent in WFI in portIdle()
+static uint32_t idleWakeups = 0;					// WFI exits in portIdle()
+static uint32_t dutyStartTick = 0;					// start of the portGetDutyCycle() window
+
+static uint8_t doorOpen = 0;						// DOOR_GPIO is set
+static uint8_t doorCloseReq = 0;					// close once doorHoldTicks have elapsed since doorOpenTick
+static uint8_t doorPulsed = 0;						// doorPulseTick is valid
+static uint32_t doorOpenTick = 0;
+static uint32_t doorHoldTicks = 0;
+static uint32_t doorPulseTick = 0;					// start of the last pulse
+
 
 int No_Configuration(void)
 {
@@ -44,9 +61,196 @@ unsigned long portGetTickCnt(void)
 	return time32_incr;
 }
 
+void portCycleCntInit(void)
+{
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk; //enable the trace block for the cycle counter
+	PORT_DWT_CYCCNT = 0;
+	PORT_DWT_CTRL |= PORT_DWT_CTRL_CYCCNTENA;
+}
+
+// restart the stopped SysTick from load
+static inline void _systick_start(uint32_t load)
+{
+	SysTick->LOAD = load;
+	SysTick->VAL = 0;
+	SysTick->CTRL = SysTick_CTRL_CLKSOURCE_Msk | SysTick_CTRL_TICKINT_Msk | SysTick_CTRL_ENABLE_Msk;
+}
+
+// sleep until an interrupt handler calls portIdleWake() or for at most ticks (SysTick periods)
+// tickless: for each WFI the SysTick is reloaded to expire once at the end of the sleep instead of every tick, the ticks
+// slept through are added to time32_incr when it wakes up (the scheme of the FreeRTOS Cortex-M3 port). The SysTick is
+// stopped for a few cycles around each sleep, so the tick count loses that much against real time.
+void portIdle(uint32_t ticks)
+{
+	uint32_t start = time32_incr;
+	uint32_t sleep, left, reload, count, slept, done;
+
+	if(ticks > PORT_IDLE_MAX_TICKS)
+	{
+		ticks = PORT_IDLE_MAX_TICKS;
+	}
+
+	//with the interrupts masked, the wake flag cannot be set between its check and the WFI: a pending interrupt still
+	//ends the WFI, its handler runs when they are unmasked
+	__disable_irq();
+	while((portWake == 0) && ((time32_incr - start) < ticks))
+	{
+		sleep = ticks - (time32_incr - start);
+		if(sleep > (SysTick_LOAD_RELOAD_Msk / sysTickCycles))
+		{
+			sleep = SysTick_LOAD_RELOAD_Msk / sysTickCycles;
+		}
+
+		//the current tick ends in left counts, the sleep sleep - 1 ticks after it
+		SysTick->CTRL = SysTick_CTRL_CLKSOURCE_Msk | SysTick_CTRL_TICKINT_Msk;
+		left = SysTick->VAL;
+		reload = left + (sysTickCycles * (sleep - 1));
+
+		if(reload < 2) //the tick is about to expire: let it run and its interrupt in
+		{
+			SysTick->CTRL = SysTick_CTRL_CLKSOURCE_Msk | SysTick_CTRL_TICKINT_Msk | SysTick_CTRL_ENABLE_Msk;
+			__enable_irq();
+			__disable_irq();
+			continue;
+		}
+
+		_systick_start(reload);
+
+		__WFI();
+
+		SysTick->CTRL = SysTick_CTRL_CLKSOURCE_Msk | SysTick_CTRL_TICKINT_Msk;
+		count = reload - SysTick->VAL; //counts since the end of the sleep if it expired, since its start otherwise
+
+		if(SysTick->CTRL & SysTick_CTRL_COUNTFLAG_Msk)
+		{
+			//woken by the SysTick: its pending interrupt adds the last tick, count counts of the next one are gone
+			slept = reload + count;
+			done = sleep - 1;
+			count = (count < (sysTickCycles - 2)) ? (sysTickCycles - count) : 2;
+		}
+		else
+		{
+			//woken by another interrupt: count the ticks completed since the current one began
+			slept = count;
+			count += sysTickCycles - left;
+			done = count / sysTickCycles;
+			count = sysTickCycles - (count % sysTickCycles);
+			count = (count < 2) ? 2 : count;
+		}
+
+		//finish the current tick, then back to one tick per period
+		_systick_start(count - 1);
+		SysTick->LOAD = sysTickCycles - 1;
+		time32_incr += done;
+
+		idleCycles += slept;
+		idleWakeups++;
+
+		__enable_irq();
+		__disable_irq();
+	}
+	portWake = 0;
+	__enable_irq();
+}
+
+void portIdleWake(void)
+{
+	portWake = 1;
+}
+
+uint16_t portGetDutyCycle(uint32_t *wakeups)
+{
+	uint32_t window = time32_incr - dutyStartTick;
+	uint16_t duty = 1000;
+
+	//only the time spent in WFI is idle: the handlers run after each wake up count as active
+	if((window > 0) && (idleCycles < ((uint64_t)window * sysTickCycles)))
+	{
+		duty = (uint16_t)(1000 - ((idleCycles * 1000) / ((uint64_t)window * sysTickCycles)));
+	}
+	else if(window > 0)
+	{
+		duty = 0;
+	}
+
+	if(wakeups != NULL)
+	{
+		*wakeups = idleWakeups;
+	}
+
+	dutyStartTick += window;
+	idleCycles = 0;
+	idleWakeups = 0;
+
+	return duty;
+}
+
+static void _door_set(uint32_t holdTicks)
+{
+	GPIO_WriteBit(DOOR_GPIO, DOOR_GPIO_PIN, Bit_SET);
+	doorOpen = 1;
+	doorOpenTick = time32_incr;
+	doorHoldTicks = holdTicks;
+}
+
+void port_DoorOpen(uint32_t holdTicks)
+{
+	if(doorOpen == 0)
+	{
+		_door_set(holdTicks);
+	}
+
+	doorCloseReq = 0;
+}
+
+void port_DoorPulse(uint32_t onTicks, uint32_t periodTicks)
+{
+	if(doorOpen == 1) //held open (toggle mode) or pulse in progress: the pulse ends it
+	{
+		doorCloseReq = 1;
+	}
+	else if((doorPulsed == 0) || ((time32_incr - doorPulseTick) >= periodTicks))
+	{
+		_door_set(onTicks);
+		doorCloseReq = 1;
+		doorPulsed = 1;
+		doorPulseTick = doorOpenTick;
+	}
+}
+
+void port_DoorClose(void)
+{
+	doorCloseReq = 1;
+	port_DoorRun();
+}
+
+void port_DoorRun(void)
+{
+	if((doorOpen == 1) && (doorCloseReq == 1) && ((time32_incr - doorOpenTick) >= doorHoldTicks))
+	{
+		GPIO_WriteBit(DOOR_GPIO, DOOR_GPIO_PIN, Bit_RESET);
+		doorOpen = 0;
+		doorCloseReq = 0;
+	}
+}
+
+uint32_t port_DoorIdleTime(void)
+{
+	uint32_t elapsed = time32_incr - doorOpenTick;
+
+	if((doorOpen == 0) || (doorCloseReq == 0))
+	{
+		return PORT_IDLE_MAX_TICKS;
+	}
+
+	return (elapsed >= doorHoldTicks) ? 0 : (doorHoldTicks - elapsed);
+}
+
 int SysTick_Configuration(void)
 {
-	if (SysTick_Config(SystemCoreClock / CLOCKS_PER_SEC))
+	sysTickCycles = SystemCoreClock / CLOCKS_PER_SEC;
+
+	if (SysTick_Config(sysTickCycles))
 	{
 		/* Capture error */
 		while (1);
@@ -315,6 +519,8 @@ void SPI_ChangeRate(uint16_t scalingfactor)
 
 	/* Write to SPIx CR1 */
 	SPIx->CR1 = tmpreg;
+
+	spiPrescaler = scalingfactor;
 }
 
 void SPI_ConfigFastRate(uint16_t scalingfactor)
@@ -341,6 +547,72 @@ void SPI_ConfigFastRate(uint16_t scalingfactor)
 
 	// Enable SPIx
 	SPI_Cmd(SPIx, ENABLE);
+
+	spiPrescaler = scalingfactor;
+}
+
+// select the fastest SPIx rate allowed by the declared DW1000 clock state
+static void _spi_govern(void)
+{
+	RCC_ClocksTypeDef clocks;
+	uint32_t limit;
+	uint16_t br;
+
+	if(dwClockState == DW_CLK_SLEEP)
+	{
+		return; //waking the device (CS held low) works at any rate
+	}
+
+	limit = ((dwClockState == DW_CLK_PLL) && (spiSlowCount == 0)) ? SPIx_PLL_MAX_HZ : SPIx_XTI_MAX_HZ;
+
+	RCC_GetClocksFreq(&clocks);
+
+	//BR[2:0] sits in CR1 bits 3-5, a prescaler of 2^(BR+1)
+	for(br = SPIx_FAST_PRESCALER; br < SPI_BaudRatePrescaler_256; br += SPI_BaudRatePrescaler_4)
+	{
+		if((clocks.PCLK2_Frequency >> ((br >> 3) + 1)) < limit)
+		{
+			break;
+		}
+	}
+
+	if(br != spiPrescaler)
+	{
+#if (DMA_ENABLE == 1)
+		//the SPI is re-initialised: let a queued DMA transaction finish first
+		while(spi_dma_busy())
+		{
+			spi_dma_poll();
+		}
+#endif
+		SPI_ConfigFastRate(br);
+	}
+}
+
+void port_SPIx_clockstate(dw_clk_state_e state)
+{
+	dwClockState = state;
+	_spi_govern();
+}
+
+dw_clk_state_e port_SPIx_getclockstate(void)
+{
+	return dwClockState;
+}
+
+void port_SPIx_slowbegin(void)
+{
+	spiSlowCount++;
+	_spi_govern();
+}
+
+void port_SPIx_slowend(void)
+{
+	if(spiSlowCount > 0)
+	{
+		spiSlowCount--;
+	}
+	_spi_govern();
 }
 
 int SPI_Configuration(void)
@@ -600,6 +872,34 @@ void ADC_Configuration(void)
 	 }
 }
 
+/*
+ * write words into the data EEPROM, only the words which differ are programmed
+ * returns 0 for success, -1 for error
+ */
+int portNvmWrite(uint32_t address, const uint32_t *data, int words)
+{
+	int i;
+	int result = 0;
+
+	DATA_EEPROM_Unlock();
+
+	for(i = 0; i < words; i++)
+	{
+		if(*(volatile uint32_t *)(address + 4*i) != data[i])
+		{
+			if(DATA_EEPROM_ProgramWord(address + 4*i, data[i]) != FLASH_COMPLETE)
+			{
+				result = -1;
+				break;
+			}
+		}
+	}
+
+	DATA_EEPROM_Lock();
+
+	return result;
+}
+
 void reset_DW1000(void)
 {
 	GPIO_InitTypeDef GPIO_InitStructure;
@@ -621,6 +921,8 @@ void reset_DW1000(void)
 	GPIO_Init(DW1000_RSTn_GPIO, &GPIO_InitStructure);
 
 	// Sleep(2); delay a remplacer .
+
+	port_SPIx_clockstate(DW_CLK_XTI); //the DW1000 restarts in INIT (crystal clock)
 }
 
 
@@ -962,6 +1264,7 @@ int peripherals_init (void)
 	rtc_init();
 	gpio_init();
 	systick_init();
+	portCycleCntInit();
 	interrupt_init();
 	//usart_init();
 	//spi_init();
@@ -30,18 +30,15 @@ void printf2(const char *format, ...);
 
 /*****************************************************************************************************************//*
  * To enable Direct Memory Access for SPI set this option to (1)
- * This option will increase speed of spi transactions but it will use an extra RAM memory buffer
+ * This option will increase speed of spi transactions (zero-copy, no extra RAM memory buffer)
+ * The DMA engine is asynchronous: spi_dma_submit() queues a transaction and calls its callback when it is done,
+ * writetospi()/readfromspi() are blocking wrappers (the USB to SPI reads are queued, see deca_usb.c)
+ * With (0), and for the header-only transactions, the serial (polled) byte loop of deca_spi.c is used
  */
-#define DMA_ENABLE	(0)
+#define DMA_ENABLE	(1)
 
 /*****************************************************************************************************************//*
 **/
-#if (DMA_ENABLE == 1)
- #define writetospi		writetospi_dma
- #define readfromspi	readfromspi_dma
- void dma_init(void);
-#else
-
  extern int writetospi_serial( uint16_t headerLength,
  			   	    const uint8_t *headerBuffer,
  					uint32_t bodylength,
@@ -53,6 +50,51 @@ void printf2(const char *format, ...);
  					 uint32_t readlength,
  					 uint8_t *readBuffer );
 
+#if (DMA_ENABLE == 1)
+ extern int writetospi_dma( uint16_t headerLength,
+ 			   	    const uint8_t *headerBuffer,
+ 					uint32_t bodylength,
+ 					const uint8_t *bodyBuffer
+ 				  );
+
+ extern int readfromspi_dma( uint16_t	headerLength,
+ 			    	 const uint8_t *headerBuffer,
+ 					 uint32_t readlength,
+ 					 uint8_t *readBuffer );
+
+ #define writetospi		writetospi_dma
+ #define readfromspi	readfromspi_dma
+ void dma_init(void);
+
+ typedef enum
+ {
+	 SPI_XFER_QUEUED = 0,
+	 SPI_XFER_ACTIVE,
+	 SPI_XFER_DONE,
+	 SPI_XFER_ERROR			/* aborted with spi_dma_abort() */
+ } spi_xfer_status_e;
+
+ typedef struct spi_xfer spi_xfer_t;
+
+ /* SPI transaction: header (copied), then body written from txBuffer (rxBuffer == NULL) or read into rxBuffer */
+ struct spi_xfer
+ {
+	 uint16_t headerLength;
+	 uint8_t header[4];
+	 const uint8_t *txBuffer;
+	 uint8_t *rxBuffer;
+	 uint32_t length;
+	 void (*callback)(spi_xfer_t *xfer);	/* called from the DMA IRQ (or spi_dma_poll), may submit, must not block */
+	 void *arg;								/* user data for the callback */
+	 volatile uint8_t status;				/* spi_xfer_status_e */
+ };
+
+ int spi_dma_submit(spi_xfer_t *xfer);
+ void spi_dma_abort(spi_xfer_t *xfer);
+ void spi_dma_poll(void);
+ int spi_dma_busy(void);
+ void dma_spi_irq(void);
+#else
  #define writetospi		writetospi_serial
  #define readfromspi	readfromspi_serial
 #endif
@@ -205,10 +247,77 @@ void spi_peripheral_init(void);
 void SPI_ChangeRate(uint16_t scalingfactor);
 void SPI_ConfigFastRate(uint16_t scalingfactor);
 
+/*****************************************************************************************************************//*
+ * SPI clock governor: the fastest safe SPIx rate follows the DW1000 system clock, below 3 MHz while it runs from the
+ * crystal (INIT state, OTP reads, CW mode) and below 20 MHz once its PLL is locked. Callers declare the clock state and
+ * bracket the accesses that need the slow rate, the governor picks the prescaler (SPI_ConfigFastRate() is only called
+ * when it changes).
+ */
+typedef enum
+{
+	DW_CLK_SLEEP = 0,		// asleep: only CS is toggled (wake-up), the rate is left as it is
+	DW_CLK_XTI,				// system clock on the crystal (after reset/CW mode)
+	DW_CLK_PLL				// PLL locked (IDLE, TX, RX)
+} dw_clk_state_e;
+
+#define SPIx_XTI_MAX_HZ				(3000000)
+#define SPIx_PLL_MAX_HZ				(20000000)
+#define SPIx_FAST_PRESCALER			SPI_BaudRatePrescaler_4	// lowest divider used (byte loop and DMA are run up to PCLK2/4)
+
+void port_SPIx_clockstate(dw_clk_state_e state);	// the DW1000 clock has changed
+dw_clk_state_e port_SPIx_getclockstate(void);
+void port_SPIx_slowbegin(void);						// the next accesses need the XTI rate (nested)
+void port_SPIx_slowend(void);
+
 unsigned long portGetTickCnt(void);
 
 #define portGetTickCount() 			portGetTickCnt()
 
+//DWT cycle counter: not described by the CMSIS v1.30 core_cm3.h the project uses
+#define PORT_DWT_CTRL				(*(volatile uint32_t *)0xE0001000)
+#define PORT_DWT_CYCCNT				(*(volatile uint32_t *)0xE0001004)
+#define PORT_DWT_CTRL_CYCCNTENA		(0x00000001ul)
+
+void portCycleCntInit(void);
+
+/*****************************************************************************************************************//*
+ * Idle: the main loop sleeps (WFI, sleep mode) until an interrupt handler calls portIdleWake() (DW1000, USB, RTC, DMA)
+ * or the tick count has advanced by the given number of ticks. The SysTick stays the timebase but is tickless while
+ * asleep: it is reloaded to fire once at the end of the sleep and the tick count is caught up on wake up. STOP mode is
+ * not used: it stops the HSI/PLL the SysTick, SPI and USB run from.
+ * MCU current estimate (not measured; STM32L152 datasheet typical values at HCLK = 32 MHz, about 8 mA in run mode and
+ * 2 mA in sleep mode): I ~= 2 mA + 6 mA * duty / 1000, e.g. ~2.3 mA at a 5 % duty cycle. The duty cycle and the wake
+ * ups are sent back by the USB "u" command (deca_usb.c).
+ */
+#define PORT_IDLE_MAX_TICKS			(CLOCKS_PER_SEC)	// longest sleep (1 s)
+
+void portIdle(uint32_t ticks);
+void portIdleWake(void);
+uint16_t portGetDutyCycle(uint32_t *wakeups);	// time the MCU was not in WFI (per mille) and WFI exits since the last call
+
+/*****************************************************************************************************************//*
+ * Door actuator (DOOR_GPIO): the calls only set the output and note the tick of the edge to come, port_DoorRun() (from
+ * the main loop) applies it once due, so the door is driven without stopping the ranging. A close request never cuts
+ * the opening short: the door stays open at least for the hold time (toggle mode) or the pulse length.
+ */
+#define PORT_MS_TO_TICKS(ms)		((uint32_t)(ms) * (CLOCKS_PER_SEC / 1000))
+
+void port_DoorOpen(uint32_t holdTicks);						// open, not closed before holdTicks
+void port_DoorPulse(uint32_t onTicks, uint32_t periodTicks);	// pulse of onTicks, not started again before periodTicks
+void port_DoorClose(void);									// close once the hold/pulse time has elapsed
+void port_DoorRun(void);
+uint32_t port_DoorIdleTime(void);							// ticks to the next edge (PORT_IDLE_MAX_TICKS if none)
+
+#define portGetCycleCount() 		(PORT_DWT_CYCCNT)	//core clock cycles (e.g. to time SPI accesses)
+
+/*****************************************************************************************************************//*
+ * MCU data EEPROM (non-volatile, word programmable): the DW1000 OTP calibration snapshot is kept at its start
+ */
+#define PORT_NVM_BASE				(0x08080000)
+#define PORT_NVM_OTPSNAP_ADDR		(PORT_NVM_BASE)
+
+int portNvmWrite(uint32_t address, const uint32_t *data, int words);
+
 void reset_DW1000(void);
 void setup_DW1000RSTnIRQ(int enable);
 void process_dwRSTn_irq(void) ;
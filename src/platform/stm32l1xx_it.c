@@ -211,6 +211,7 @@ void RTC_IRQHandler(void)
 	    RTC_ClearITPendingBit(RTC_IT_WUT);
 	    EXTI_ClearITPendingBit(EXTI_Line20); // And EXTI
 	  }
+	portIdleWake();
 }
 
 void SysTick_Handler(void)
@@ -238,6 +239,7 @@ void EXTI15_10_IRQHandler(void)
 	process_dwRSTn_irq();
     /* Clear EXTI Line 13 Pending Bit */
     EXTI_ClearITPendingBit(DECARSTIRQ_EXTI);
+    portIdleWake();
 }
 
 void EXTI3_IRQHandler(void)
@@ -245,6 +247,7 @@ void EXTI3_IRQHandler(void)
     process_deca_irq();
     /* Clear EXTI Line 3 Pending Bit */
     EXTI_ClearITPendingBit(EXTI_Line3);
+    portIdleWake();
 }
 
 void EXTI2_IRQHandler(void)
@@ -252,8 +255,18 @@ void EXTI2_IRQHandler(void)
     process_deca_irq();
     /* Clear EXTI Line 8 Pending Bit */
     EXTI_ClearITPendingBit(DECAIRQ_EXTI);
+    portIdleWake();
 }
 
+#if (DMA_ENABLE == 1)
+void DMA1_Channel2_IRQHandler(void)
+{
+    /* SPI RX DMA transfer complete: end the transaction, start the next one */
+    dma_spi_irq();
+    portIdleWake();
+}
+#endif
+
 void ADC1_IRQHandler(void)
 {
   if(ADC_GetITStatus(ADC1, ADC_IT_EOC) != RESET)
@@ -311,6 +324,7 @@ void OTG_FS_IRQHandler(void)
 
  //ZS - taking out or plugging in the cable causes this interrupt to trigger
   USBD_OTG_ISR_Handler (&USB_OTG_dev);
+  portIdleWake();
 }
 
 #ifdef USB_OTG_HS_DEDICATED_EP1_ENABLED
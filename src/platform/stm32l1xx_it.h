@@ -51,6 +51,7 @@ void DebugMon_Handler(void);
 void PendSV_Handler(void);
 void SysTick_Handler(void);
 void ADC1_IRQHandler(void);
+void DMA1_Channel2_IRQHandler(void);
 
 #ifdef __cplusplus
 }
@@ -49,7 +49,12 @@ uint8_t local_buff[5000];
 uint16_t local_buff_offset = 0;
 int tx_buff_length = 0;
 uint8_t tx_buff[5000];
-int local_have_data = 0;
+int local_have_data = 0;		// 1: message received, 2: reply to send, 3: reply waiting for its SPI read (DMA)
+#if (DMA_ENABLE == 1)
+#define USB_SPI_TIMEOUT_TICKS	PORT_MS_TO_TICKS(100)	// a queued SPI read not done by then is aborted, an error is replied
+static spi_xfer_t usb_spi_xfer;	// USB to SPI read, queued on the DMA engine so that usb_run() does not wait for it
+static uint32 usb_spi_tick;		// when usb_spi_xfer was queued
+#endif
 
 int version_size;
 uint8* version;
@@ -58,7 +63,12 @@ extern int ranging;
 
 extern uint32_t APP_Rx_length;
 extern uint32 inittestapplication(uint8 s1switch);
+#if (SPI_BENCHMARK == 1)
+extern spi_bench_t spiBench[SPI_BENCH_RATES];
+#endif
 extern void setLCDline1(uint8 s1switch);
+extern uint16 mcuDuty;
+extern uint32_t mcuWakeups;
 
 
 uint16_t DW_VCP_Init     (void) { return USBD_OK; }
@@ -198,10 +208,8 @@ void configSPIspeed(int high)
 	{
 		localSPIspeed = high;
 
-		if(high)
-			SPI_ConfigFastRate(SPI_BaudRatePrescaler_4);  //max SPI
-		else
-			SPI_ConfigFastRate(SPI_BaudRatePrescaler_32);  //max SPI before PLLs configured is ~4M
+		//the host knows whether the DW1000 PLL is running, the governor picks the matching rate
+		port_SPIx_clockstate(high ? DW_CLK_PLL : DW_CLK_XTI);
 	}
 }
 #pragma GCC optimize ("O3")
@@ -274,14 +282,37 @@ int process_usbmessage(void)
 						}
 						else
 						{
-							// do the read from the SPI
-							readfromspi(msglength-7, &local_buff[6], datalength, &tx_buff[2]);  // result is stored in the buffer
-
 							tx_buff[1] = 0x0; // no error
+#if (DMA_ENABLE == 1)
+							// queue the read, the reply is sent by usb_run() once it is done
+							usb_spi_xfer.headerLength = msglength-7;
+							if(usb_spi_xfer.headerLength <= sizeof(usb_spi_xfer.header))
+							{
+								memcpy(&usb_spi_xfer.header[0], &local_buff[6], usb_spi_xfer.headerLength);
+							}
+							usb_spi_xfer.txBuffer = NULL;
+							usb_spi_xfer.rxBuffer = &tx_buff[2];
+							usb_spi_xfer.length = datalength;
+							usb_spi_xfer.callback = NULL;
+
+							if(spi_dma_submit(&usb_spi_xfer) == DWT_SUCCESS)
+							{
+								usb_spi_tick = portGetTickCount();
+								result = 3;
+							}
+							else
+#endif
+							{
+								// do the read from the SPI
+								readfromspi(msglength-7, &local_buff[6], datalength, &tx_buff[2]);  // result is stored in the buffer
+							}
 						}
 
 						tx_buff_length = datalength + 3;
-						result = 2;
+						if(result == 0)
+						{
+							result = 2;
+						}
 					}
 
 					if((local_buff[1] & 0x1) == 1) //SPI write
@@ -417,6 +448,41 @@ int process_usbmessage(void)
 						tx_buff_length = 11;
 						result = 2;
 					}
+					if(local_buff[4] == 113) //"q"
+					{
+						//send back the event queue telemetry (evq_stats_t, little endian)
+						evq_stats_t stats;
+						instance_get_evqstats(&stats);
+						tx_buff[0] = 110;
+						memcpy(&tx_buff[1], &stats, sizeof(stats));
+						tx_buff[sizeof(stats)+1] = '\r';
+						tx_buff[sizeof(stats)+2] = '\n';
+						tx_buff_length = sizeof(stats) + 3;
+						result = 2;
+					}
+					if(local_buff[4] == 117) //"u"
+					{
+						//send back the MCU duty cycle (per mille, 16 bits) and the WFI wake ups of the last second (32 bits, little endian)
+						tx_buff[0] = 110;
+						memcpy(&tx_buff[1], &mcuDuty, 2);
+						memcpy(&tx_buff[3], &mcuWakeups, 4);
+						tx_buff[7] = '\r';
+						tx_buff[8] = '\n';
+						tx_buff_length = 9;
+						result = 2;
+					}
+#if (SPI_BENCHMARK == 1)
+					if(local_buff[4] == 98) //"b"
+					{
+						//send back the SPI benchmark (spi_bench_t for each prescaler, little endian)
+						tx_buff[0] = 110;
+						memcpy(&tx_buff[1], spiBench, sizeof(spiBench));
+						tx_buff[sizeof(spiBench)+1] = '\r';
+						tx_buff[sizeof(spiBench)+2] = '\n';
+						tx_buff_length = sizeof(spiBench) + 3;
+						result = 2;
+					}
+#endif
 				}
 			}
 			break;
@@ -468,7 +534,7 @@ int usb_init(void)
 	// enable/initialise the USB functionality
 	USBD_Init(&USB_OTG_dev,USB_OTG_FS_CORE_ID,&USR_desc,&USBD_CDC_cb,&USR_cb);
 
-    SPI_ConfigFastRate(SPI_BaudRatePrescaler_32);  //max SPI before PLLs configured is ~4M
+    port_SPIx_clockstate(DW_CLK_XTI);  //PLLs may not be configured
     localSPIspeed = 0;
 
     //this is called here to wake up the device (i.e. if it was in sleep mode before the restart)
@@ -522,6 +588,21 @@ void usb_run(void)
         	DW_VCP_DataTx(tx_buff, tx_buff_length);
 			local_have_data = 0;
         }
+#if (DMA_ENABLE == 1)
+        else if(local_have_data == 3)
+        {
+        	if(usb_spi_xfer.status == SPI_XFER_DONE) //the queued SPI read is done
+        	{
+        		local_have_data = 2;
+        	}
+        	else if((portGetTickCount() - usb_spi_tick) >= USB_SPI_TIMEOUT_TICKS) //give up, free the SPI and report it
+        	{
+        		spi_dma_abort(&usb_spi_xfer);
+        		tx_buff[1] = 0x1; // error
+        		local_have_data = 2;
+        	}
+        }
+#endif
 
 	  }
 }